@@ -49,7 +49,7 @@
  * 
  * Stop Trigger mode: 9
  *   Controller will return 9x where x is the number of triggers received during the last
- *   trigger mode run
+ *   trigger mode run (lowest byte only, command 13 gives the whole count)
  *
  * Set time interval for timed trigger mode: 10xtt
  *   Where x is the number of the interval (currently, 12 intervals can be stored)
@@ -69,6 +69,51 @@
  *   the pattern generation.
  *   Controller will retun 12.
  * 
+ * Get telemetry: 13
+ *   Controller will return 13 followed by (all 32-bit, most significant byte first):
+ *   the triggers seen in trigger mode, the pattern advances, the missed edges (rising
+ *   edges counted by interrupt 0 but not seen by the polling of loop()), the longest
+ *   loop() iteration (us), the loop() iteration time histogram (8 counts: below 8,
+ *   16, 32, 64, 128, 256 and 512 us and longer), and the serial bytes received and
+ *   sent.  Command 8 resets all but the serial byte counts.
+ *
+ * Apply several outputs at once: 14n followed by n commands
+ *   Where n is the number of commands (at most FRAMECOMMANDS), each one of 1p, 3xvv,
+ *   19i, 20, 21 or 22x as described here.  The whole frame is read before any output
+ *   changes, then all are applied together.
+ *   Controller will return 14n, or 14 followed by 0 (and apply nothing) when the
+ *   frame was incomplete, held another command or a preset out of range.
+ *
+ * Store a preset: 15ipaabbf
+ *   Where i is the preset (0 to PRESETS - 1), p the digital pattern, aa and bb the
+ *   12-bit values of DAC channels A and B (most significant byte first) and f the
+ *   flags: bit 0 blanking on, bit 1 blank on trigger low (as x=1 of command 22).
+ *   Presets are kept in the EEPROM.
+ *   Controller will return 15i, or 15 followed by 255 when i is out of range
+ *
+ * Set preset sequence for trigger mode: 16n i i ...
+ *   Where n is the number of entries (at most PRESETSEQUENCELENGTH) and each i a
+ *   preset.  In trigger mode, every trigger then recalls the next preset instead of
+ *   applying the next pattern.  n=0, as well as command 6, goes back to the patterns.
+ *   Controller will return 16n
+ *
+ * Set digital output and both analogue outputs: 17paabb
+ *   Where p is the digital pattern and aa and bb the 12-bit values of DAC channels
+ *   A and B (most significant byte first).  Both DAC channels change together (B is
+ *   written to the TLV5618 buffer first, writing A then updates both), right before
+ *   the digital outputs.
+ *   Controller will return 17, or n: when the values did not all arrive
+ *
+ * Get preset: 18i
+ *   Controller will return 18ipaabbf as stored with command 15, p is 255 when
+ *   preset i was never stored (or i is out of range)
+ *
+ * Recall preset: 19i
+ *   Where i is the preset (0 to PRESETS - 1).  Applies the pattern, both DAC values,
+ *   blanking and the blanking trigger direction of preset i at once (nothing for a
+ *   preset never stored).
+ *   Controller will return 19i, or 19 followed by 255 when i is out of range
+ *
  * Start blanking Mode: 20
  *   In blanking mode, zeroes will be written on the output pins when the trigger pin
  *   is low, when the trigger pin is high, the pattern set with command #1 will be 
@@ -89,6 +134,40 @@
  *
  * Get Version: 31
  *   Returns: version number (as ASCI string) \r\n
+ *   Version 4 added the bank of bases (commands 35 to 37)
+ *   Version 5 added the telemetry, frames, presets and combined outputs (commands 13 to 19)
+ *
+ * Get compressed sensing capabilities: 33
+ *   Returns (asci!) CS_enabled\r\n
+ *
+ * Get basis identifier: 34
+ *   Returns the hashCode of the selected basis (as ASCI string) \r\n
+ *
+ * List the bases: 35
+ *   basis.h can hold a bank of bases (BASIS_BANK), all stored in flash.
+ *   Controller will return 35, the number n of bases (8-bit), the index of the
+ *   selected one (8-bit) and for each basis its hashCode (32-bit), its number of
+ *   rows (16-bit), its number of values per row (16-bit) and its encoding (8-bit,
+ *   bits per value)
+ *
+ * Select a basis: 36x
+ *   Where x is the index of the basis in the bank.  Stops the row being played,
+ *   clears the playlist and the row queue and goes back to the first row.  The
+ *   exposure table is kept.  Not possible during a CS run.
+ *   Controller will return 36x
+ *
+ * Read back a basis: 37xffcc
+ *   Where x is the index of the basis in the bank, ff the first chunk (16-bit) and
+ *   cc the number of chunks (16-bit, 0 for all the remaining ones) to send.  The
+ *   stored basis (as in basis.h: rows one after the other, in the encoding of the
+ *   basis) is cut into chunks of READBACKCHUNK bytes, the last one may be shorter.
+ *   Controller will return 37, the rows (16-bit), the values per row (16-bit), the
+ *   encoding (8-bit), the shift (8-bit), the DAC words high and control (16-bit
+ *   each), the hashCode (32-bit), the size in bytes (32-bit) and READBACKCHUNK
+ *   (8-bit), then for each chunk its index (16-bit), its bytes and the CRC-16
+ *   (CCITT, 0xFFFF start) of the index and the bytes (16-bit).  All multi-byte
+ *   numbers are most significant byte first, the 16-bit values of the basis itself
+ *   are stored least significant byte first.
  *
  * Read digital state of analogue input pins 0-5: 40
  *   Returns raw value of PINC (two high bits are not used)
@@ -97,6 +176,65 @@
  *   x=0-5.  Returns analogue value as a 10-bit number (0-1023)
  *
  *
+ * Compressed sensing (CS) mode on/off: 50x
+ *   x=1: in trigger mode, every trigger also plays the next basis row on DAC
+ *   channel A, x=0: normal trigger mode.  Returns (asci!) 2\r\n
+ *
+ * Get compressed sensing mode: 51
+ *   Returns (asci!) 3x\r\n where x is 0 or 1
+ *
+ * Set CS exposure: 52xxx
+ *   Where xxx is the exposure in ms as a 24-bit number (most significant byte first).
+ *   The values of a basis row are spread evenly over this exposure.
+ *   Returns (asci!) 4 followed by the exposure \r\n
+ *
+ * Set CS exposure table: 53nn tttt tttt ...
+ *   Where nn is the number of entries (16-bit, at most EXPOSURETABLELENGTH) and each
+ *   tttt is the exposure (in us, 32-bit, most significant byte first) of the basis
+ *   row with the same index.  Rows with an entry use it instead of the exposure
+ *   set with command 52.  nn=0 clears the table.
+ *   Controller will return 53nn
+ *
+ * Start CS run: 54
+ *   Every rising edge on the trigger pin (counted by interrupt 0) plays the next basis
+ *   row.  Edges that arrive while a row is still being played are counted as missed.
+ *   Also resets the maximum row update time (see command 59).
+ *   Controller will return 54
+ *
+ * Stop CS run: 55
+ *   Controller will return 55 followed by the number of rows completed and the number
+ *   of missed triggers (both 32-bit, most significant byte first)
+ *
+ * Get CS run progress: 56
+ *   Controller will return 56, the current row (16-bit), rows completed (32-bit),
+ *   missed triggers (32-bit), the number n of row advances since the last call (8-bit,
+ *   at most CSEVENTLENGTH) and for each of them the row (16-bit) and the time (micros(),
+ *   32-bit) of the rising edge of its trigger, oldest first
+ *
+ * Set CS row playlist: 57nn rr rr ...
+ *   Where nn is the number of entries (16-bit, at most PLAYLISTLENGTH) and each rr
+ *   the index (16-bit) of a basis row.  Rows are then played in this order (and the
+ *   playlist repeated) instead of the order of the basis array.  nn=0 goes back to
+ *   the basis order.  Starts again at the first entry.
+ *   A list with an invalid row is still read to its end, then rejected; the rows
+ *   are then played in the basis order.
+ *   Controller will return 57nn
+ *
+ * Queue CS rows: 58nn rr rr ...
+ *   Where nn is the number of rows (16-bit) and each rr the index (16-bit) of a basis
+ *   row.  Queued rows are played first, in order, before going on with the playlist
+ *   (or the basis order).  Used by the host to choose the next rows of an adaptive run.
+ *   The queue holds ROWQUEUELENGTH rows and is emptied by commands 50, 54 and 57.
+ *   Controller will return 58 followed by the number of rows in the queue (16-bit)
+ *
+ * Get CS row update time: 59
+ *   A basis row is played by the Timer1 compare interrupt, which copies one DAC word
+ *   of basis.h to the TLV5618 per step.  The row update time is the time (in us)
+ *   from the trigger edge (timed by interrupt 0 for a rising edge) to the first
+ *   value of the row being on the DAC.
+ *   Controller will return 59 followed by the update time of the last row and the
+ *   maximum since the last command 54 (both 32-bit, most significant byte first)
+ *
  * 
  * Possible extensions:
  *   Set and Get Mode (low, change, rising, falling) for trigger mode
@@ -104,7 +242,68 @@
  *   Get Number of digital patterns
  */
  
-   unsigned int version_ = 2;
+ #include <avr/pgmspace.h>
+ #include <EEPROM.h>
+ // Flash address of a basis.  On boards with more than 64 KB of flash (RAMPZ)
+ // the bases can lie above the reach of 16-bit pointers, they are then read
+ // with far addresses.  BASIS_ADDRESS takes the name of a PROGMEM array.
+ #ifdef RAMPZ
+ typedef uint_farptr_t BasisAddress;
+ #define BASIS_ADDRESS(name) pgm_get_far_address(name)
+ #define basisReadByte(address) pgm_read_byte_far(address)
+ #define basisReadWord(address) pgm_read_word_far(address)
+ #define basisCopy(dest, address, size) memcpy_PF(dest, address, size)
+ #else
+ typedef unsigned int BasisAddress;
+ #define BASIS_ADDRESS(name) ((BasisAddress) (name))
+ #define basisReadByte(address) pgm_read_byte(address)
+ #define basisReadWord(address) pgm_read_word(address)
+ #define basisCopy(dest, address, size) memcpy_P(dest, (const void*) (address), size)
+ #endif
+ // A basis in flash, its rows one after the other.  Its address is given by
+ // basis_address(), a far address does not fit in a PROGMEM initializer.
+ struct BasisEntry {
+   int rows;
+   int values;
+   byte encoding;         // bits per value: 1 (bit-packed), 8 or 16
+   byte shift;            // 8-bit values are shifted left by this
+   unsigned int high;     // DAC word of a set bit of a 1-bit basis
+   unsigned int control;  // control bits of the DAC words
+   long id;               // hashCode of the basis
+ };
+ // Basis exported by the CS plugin ("Export to Arduino"), saved next to this sketch.
+ // The exporter writes a bank of bases, basis_bank[BASIS_BANK].  Older files hold a
+ // single basis, described by BASIS_ENCODING (16 when not defined) and, when the
+ // values are complete TLV5618 words, BASIS_DAC_WORDS
+ #include "basis.h"
+
+ // Serial port that counts the bytes it moves, for the telemetry (command 13)
+ class CountingSerial : public Stream
+ {
+   public:
+     unsigned long bytesIn;
+     unsigned long bytesOut;
+     CountingSerial() : bytesIn(0), bytesOut(0) {}
+     int available() { return Serial.available(); }
+     int peek() { return Serial.peek(); }
+     int read() { int c = Serial.read(); if (c >= 0) bytesIn++; return c; }
+     void flush() { Serial.flush(); }
+     void begin(unsigned long baud) { Serial.begin(baud); }
+     size_t write(uint8_t b) { bytesOut++; return Serial.write(b); }
+     size_t write(int n) { return write((uint8_t) n); }
+     size_t write(unsigned int n) { return write((uint8_t) n); }
+     size_t write(long n) { return write((uint8_t) n); }
+     size_t write(unsigned long n) { return write((uint8_t) n); }
+     using Print::write;
+ };
+ CountingSerial serial_;
+ // the commands below keep using Serial; all of their traffic goes through serial_
+ #define Serial serial_
+ #if !defined(BASIS_BANK) && !defined(BASIS_ENCODING)
+ #define BASIS_ENCODING 16
+ #endif
+
+   unsigned int version_ = 5;
    
    // pin on which to receive the trigger (2 and 3 can be used with interrupts, although this code does not use interrupts)
    int inPin_ = 2;
@@ -117,6 +316,10 @@
    int clockPin = 4;
    // pin connected to CS of TLV5618
    int latchPin = 5;
+   // dataPin, clockPin and latchPin are on port D, written directly by dacWrite()
+   byte dataBit_ = 1 << dataPin;
+   byte clockBit_ = 1 << clockPin;
+   byte latchBit_ = 1 << latchPin;
 
    const int SEQUENCELENGTH = 12;  // this should be good enough for everybody;)
    byte triggerPattern_[SEQUENCELENGTH] = {0,0,0,0,0,0,0,0,0,0,0,0};
@@ -132,6 +335,71 @@
    bool blankOnHigh_ = false;
    bool triggerMode_ = false;
    boolean triggerState_ = false;
+
+   // Compressed sensing
+   bool csMode_ = false;
+   unsigned long csExposure_ = 1;  // ms
+   int csRow_ = 0;  // next basis row to be played
+   const int PLAYLISTLENGTH = 128;
+   int playlist_[PLAYLISTLENGTH];  // order in which the basis rows are played
+   int playlistLength_ = 0;
+   int playlistPosition_ = 0;
+   const int ROWQUEUELENGTH = 32;
+   int rowQueue_[ROWQUEUELENGTH];  // rows chosen by the host, played before the playlist
+   byte rowQueueStart_ = 0;
+   byte rowQueueCount_ = 0;
+   const int EXPOSURETABLELENGTH = 128;
+   unsigned long exposureTable_[EXPOSURETABLELENGTH];  // us
+   int exposureTableLength_ = 0;
+   bool csRun_ = false;
+   volatile unsigned long csTriggers_ = 0;  // rising edges, counted in triggerEdge()
+   volatile unsigned long csTriggerTime_ = 0;  // micros() at the last rising edge
+   unsigned long csTriggersHandled_ = 0;
+   unsigned long csRowsCompleted_ = 0;
+   unsigned long csMissedTriggers_ = 0;
+   // row advances not yet reported to the host
+   const int CSEVENTLENGTH = 16;
+   int csEventRow_[CSEVENTLENGTH];
+   unsigned long csEventTime_[CSEVENTLENGTH];
+   byte csEventStart_ = 0;
+   byte csEventCount_ = 0;
+   // telemetry (command 13), reset by command 8
+   unsigned long triggerCount_ = 0;     // triggers seen in trigger mode
+   unsigned long patternAdvances_ = 0;
+   unsigned long edgesAtStart_ = 0;     // csTriggers_ at command 8
+   unsigned long edgesAtStop_ = 0;      // csTriggers_ at command 9
+   unsigned long loopRisingEdges_ = 0;  // rising edges seen by loop() in trigger mode
+   const byte LOOPHISTOGRAMLENGTH = 8;
+   unsigned long loopHistogram_[LOOPHISTOGRAMLENGTH];  // below 8, 16, ... 512 us, longer
+   unsigned long loopMax_ = 0;  // us
+   unsigned long loopStart_ = 0;
+   // basis row being played by the Timer1 compare interrupt
+   const unsigned long MINDWELL = 20;  // us, time for the interrupt to write a value
+   volatile bool rowPlaying_ = false;
+   volatile int playRow_ = 0;
+   volatile int playIndex_ = 0;
+   unsigned long rowUpdateTime_ = 0;  // us
+   unsigned long maxRowUpdateTime_ = 0;
+   // selected basis
+   BasisEntry activeBasis_;
+   BasisAddress activeData_ = 0;
+   byte activeBasisIndex_ = 0;
+   unsigned int rowBytes_ = 0;   // flash bytes per row
+   unsigned int dacMask_ = 0xFFFF;  // value bits kept from the stored words
+   BasisEntry bankEntry_;  // filled by loadBankEntry()
+   BasisAddress bankData_ = 0;
+   const byte READBACKCHUNK = 64;
+   const byte FRAMECOMMANDS = 8;  // in one command 14
+   // presets (commands 15, 16, 18 and 19), PRESETBYTES each from the start of the EEPROM,
+   // copied to presets_ so that a trigger does not wait for the EEPROM
+   const byte PRESETS = 16;
+   const byte PRESETBYTES = 6;
+   byte presets_[PRESETS][PRESETBYTES];
+   // 12-bit values last written to DAC channels A and B, 0xFFFF when unknown
+   unsigned int dacValue_[2] = {0xFFFF, 0xFFFF};
+   const byte PRESETSEQUENCELENGTH = 16;
+   byte presetSequence_[PRESETSEQUENCELENGTH];
+   byte presetSequenceLength_ = 0;
  
  void setup() {
    // Higher speeds do not appear to be reliable
@@ -154,9 +422,19 @@
    PORTC = PORTC | B00111111;
    
    digitalWrite(latchPin, HIGH);   
+
+   for (byte i = 0; i < PRESETS; i++)
+     for (byte j = 0; j < PRESETBYTES; j++)
+       presets_[i][j] = EEPROM.read(i * PRESETBYTES + j);
+   selectBasis(0);
+   attachInterrupt(0, triggerEdge, RISING);
  }
  
  void loop() {
+   unsigned long now = micros();
+   addLoopTime(now - loopStart_);
+   loopStart_ = now;
+
    if (Serial.available() > 0) {
      int inByte = Serial.read();
      switch (inByte) {
@@ -213,7 +491,7 @@
               }
             }
           }
-          Serial.write( "n:");//Serial.print("n:");
+          Serial.write( "n:");
           break;
           
        // Sets the number of digital patterns that will be used
@@ -222,6 +500,7 @@
            int pL = Serial.read();
            if ( (pL >= 0) && (pL <= 12) ) {
              patternLength_ = pL;
+             presetSequenceLength_ = 0;
              Serial.write( byte(6));
              Serial.write( patternLength_);
            }
@@ -239,10 +518,11 @@
          
        //  starts trigger mode
        case 8: 
-         if (patternLength_ > 0) {
+         if (patternLength_ > 0 || presetSequenceLength_ > 0) {
            sequenceNr_ = 0;
            triggerNr_ = -skipTriggers_;
            triggerState_ = digitalRead(inPin_) == HIGH;
+           resetTelemetry();
            PORTB = B00000000;
            Serial.write( byte(8));
            triggerMode_ = true;           
@@ -252,6 +532,9 @@
          // return result from last triggermode
        case 9:
           triggerMode_ = false;
+          noInterrupts();
+          edgesAtStop_ = csTriggers_;
+          interrupts();
           PORTB = B00000000;
           Serial.write( byte(9));
           Serial.write( triggerNr_);
@@ -303,6 +586,73 @@
          }
          break;
 
+       // Counters of the last trigger mode run
+       case 13:
+         Serial.write( byte(13));
+         writeLong(triggerCount_);
+         writeLong(patternAdvances_);
+         writeLong(missedEdges());
+         writeLong(loopMax_);
+         for (byte i = 0; i < LOOPHISTOGRAMLENGTH; i++)
+           writeLong(loopHistogram_[i]);
+         writeLong(serial_.bytesIn);
+         writeLong(serial_.bytesOut);
+         break;
+
+       // Applies several commands at once
+       case 14:
+         applyFrame();
+         break;
+
+       // Stores a preset
+       case 15:
+         storePreset();
+         break;
+
+       // Sets the presets recalled in trigger mode
+       case 16:
+         if (waitForSerial(timeOut_)) {
+           byte n = Serial.read();
+           byte i = 0;
+           for (; i < n && waitForSerial(timeOut_); i++) {
+             byte preset = Serial.read();
+             if (i < PRESETSEQUENCELENGTH)
+               presetSequence_[i] = preset;
+           }
+           presetSequenceLength_ = (i == n && n <= PRESETSEQUENCELENGTH) ? n : 0;
+           Serial.write( byte(16));
+           Serial.write( presetSequenceLength_);
+         }
+         break;
+
+       // Sets the digital and both analogue outputs at once
+       case 17:
+         setOutputs();
+         break;
+
+       // Returns a preset
+       case 18:
+         if (waitForSerial(timeOut_)) {
+           byte preset = Serial.read();
+           Serial.write( byte(18));
+           Serial.write( preset);
+           for (byte i = 0; i < PRESETBYTES; i++)
+             Serial.write(preset < PRESETS ? EEPROM.read(preset * PRESETBYTES + i) : byte(255));
+         }
+         break;
+
+       // Recalls a preset
+       case 19:
+         if (waitForSerial(timeOut_)) {
+           byte preset = Serial.read();
+           recallPreset(preset);
+           if (!blanking_ && !triggerMode_)
+             PORTB = currentPattern_;
+           Serial.write( byte(19));
+           Serial.write( preset < PRESETS ? preset : byte(255));
+         }
+         break;
+
        // Blanks output based on TTL input
        case 20:
          blanking_ = true;
@@ -337,6 +687,72 @@
          Serial.println(version_);
          break;
 
+       case 33:
+         Serial.println("CS_enabled");
+         break;
+
+       case 34:
+         Serial.println(activeBasis_.id);
+         break;
+
+       case 35:
+         Serial.write( byte(35));
+         Serial.write( basisCount());
+         Serial.write( activeBasisIndex_);
+         for (byte i = 0; i < basisCount(); i++) {
+           loadBankEntry(i);
+           writeLong(bankEntry_.id);
+           Serial.write( highByte(bankEntry_.rows));
+           Serial.write( lowByte(bankEntry_.rows));
+           Serial.write( highByte(bankEntry_.values));
+           Serial.write( lowByte(bankEntry_.values));
+           Serial.write( bankEntry_.encoding);
+         }
+         break;
+
+       case 36:
+         if (waitForSerial(timeOut_)) {
+           byte index = Serial.read();
+           if (index < basisCount() && !csRun_) {
+             selectBasis(index);
+             Serial.write( byte(36));
+             Serial.write( index);
+             break;
+           }
+         }
+         Serial.write( "n:");
+         break;
+
+       // Streams a stored basis, for verification by the host
+       case 37:
+         if (waitForSerial(timeOut_)) {
+           byte index = Serial.read();
+           unsigned int first = 0;
+           unsigned int count = 0;
+           byte i = 0;
+           for (; i < 4; i++) {
+             if (!waitForSerial(timeOut_))
+               break;
+             if (i < 2)
+               first = (first << 8) | Serial.read();
+             else
+               count = (count << 8) | Serial.read();
+           }
+           if (i == 4 && index < basisCount()) {
+             loadBankEntry(index);
+             unsigned long size = (unsigned long) bankEntry_.rows * basisRowBytes(bankEntry_.encoding, bankEntry_.values);
+             unsigned int chunks = (size + READBACKCHUNK - 1) / READBACKCHUNK;
+             if (first <= chunks) {
+               if (count == 0 || count > chunks - first)
+                 count = chunks - first;
+               sendBasis(size, first, count);
+               break;
+             }
+           }
+         }
+         Serial.write( "n:");
+         break;
+
        case 40:
          Serial.write( byte(40));
          Serial.write( PINC);
@@ -374,13 +790,194 @@
          }
          break;
 
+       // Switches CS mode on or off
+       case 50:
+         if (waitForSerial(timeOut_)) {
+           csMode_ = Serial.read() != 0;
+           firstRow();
+           Serial.println(2);
+         }
+         break;
+
+       case 51:
+         Serial.print(3);
+         Serial.println(csMode_ ? 1 : 0);
+         break;
+
+       // Sets the exposure over which a basis row is played
+       case 52:
+         {
+           unsigned long exposure = 0;
+           for (int i = 0; i < 3; i++) {
+             if (!waitForSerial(timeOut_))
+               break;
+             exposure = (exposure << 8) | Serial.read();
+           }
+           csExposure_ = exposure;
+           Serial.print(4);
+           Serial.println(csExposure_);
+         }
+         break;
+
+       // Per basis row exposures, sent in one go
+       case 53:
+         {
+           // the whole table is read, also when it is too long, so that
+           // none of it is taken for commands
+           unsigned long n, exposure;
+           bool ok = readNumber(2, n);
+           bool valid = ok && n <= EXPOSURETABLELENGTH;
+           for (unsigned long i = 0; ok && i < n; i++) {
+             ok = readNumber(4, exposure);
+             if (ok && valid)
+               exposureTable_[i] = exposure;
+           }
+           if (!ok)
+             discardSerial();
+           else if (valid) {
+             exposureTableLength_ = n;
+             Serial.write( byte(53));
+             Serial.write( highByte(n));
+             Serial.write( lowByte(n));
+             break;
+           }
+         }
+         Serial.write( "n:");
+         break;
+
+       // Starts a hardware triggered CS run
+       case 54:
+         noInterrupts();
+         csTriggersHandled_ = csTriggers_;
+         interrupts();
+         firstRow();
+         csRowsCompleted_ = 0;
+         csMissedTriggers_ = 0;
+         csEventStart_ = 0;
+         csEventCount_ = 0;
+         maxRowUpdateTime_ = 0;
+         csRun_ = true;
+         Serial.write( byte(54));
+         break;
+
+       case 55:
+         csRun_ = false;
+         Serial.write( byte(55));
+         writeLong(csRowsCompleted_);
+         writeLong(csMissedTriggers_);
+         break;
+
+       case 56:
+         Serial.write( byte(56));
+         Serial.write( highByte(csRow_));
+         Serial.write( lowByte(csRow_));
+         writeLong(csRowsCompleted_);
+         writeLong(csMissedTriggers_);
+         Serial.write( csEventCount_);
+         for (byte i = 0; i < csEventCount_; i++) {
+           byte j = (csEventStart_ + i) % CSEVENTLENGTH;
+           Serial.write( highByte(csEventRow_[j]));
+           Serial.write( lowByte(csEventRow_[j]));
+           writeLong(csEventTime_[j]);
+         }
+         csEventStart_ = 0;
+         csEventCount_ = 0;
+         break;
+
+       // Order in which the basis rows are played
+       case 57:
+         {
+           // read completely, an invalid row only rejects the list
+           unsigned long n, row;
+           bool ok = readNumber(2, n);
+           bool valid = ok && n <= PLAYLISTLENGTH;
+           bool written = false;
+           for (unsigned long i = 0; ok && i < n; i++) {
+             ok = readNumber(2, row);
+             if (!ok || row >= (unsigned long) b_nelements)
+               valid = false;
+             else if (valid) {
+               playlist_[i] = row;
+               written = true;
+             }
+           }
+           if (!ok)
+             discardSerial();
+           if (valid) {
+             playlistLength_ = n;
+             firstRow();
+             Serial.write( byte(57));
+             Serial.write( highByte(n));
+             Serial.write( lowByte(n));
+             break;
+           }
+           // the old playlist was partly overwritten
+           if (written) {
+             playlistLength_ = 0;
+             firstRow();
+           }
+         }
+         Serial.write( "n:");
+         break;
+
+       // Rows to be played next
+       case 58:
+         {
+           // read completely, the rows are only queued when all are valid
+           unsigned long n, row;
+           bool ok = readNumber(2, n);
+           bool valid = ok && n <= (unsigned long) (ROWQUEUELENGTH - rowQueueCount_);
+           for (unsigned long i = 0; ok && i < n; i++) {
+             ok = readNumber(2, row);
+             if (!ok || row >= (unsigned long) b_nelements)
+               valid = false;
+             else if (valid)
+               rowQueue_[(rowQueueStart_ + rowQueueCount_ + i) % ROWQUEUELENGTH] = row;
+           }
+           if (!ok)
+             discardSerial();
+           if (valid) {
+             rowQueueCount_ += n;
+             Serial.write( byte(58));
+             Serial.write( byte(0));
+             Serial.write( rowQueueCount_);
+             break;
+           }
+         }
+         Serial.write( "n:");
+         break;
+
+       case 59:
+         Serial.write( byte(59));
+         writeLong(rowUpdateTime_);
+         writeLong(maxRowUpdateTime_);
+         break;
+
        }
     }
+
+    if (csRun_) {
+      noInterrupts();
+      unsigned long triggers = csTriggers_;
+      unsigned long triggerTime = csTriggerTime_;
+      interrupts();
+      // a new row starts once the previous one has been played
+      if (triggers != csTriggersHandled_ && !rowPlaying_) {
+        csMissedTriggers_ += triggers - csTriggersHandled_ - 1;
+        csTriggersHandled_ = triggers;
+        int row = takeRow();
+        addCSEvent(row, triggerTime);
+        playBasisRow(row, triggerTime);
+        csRowsCompleted_++;
+      }
+    }
     
     // In trigger mode, we will blank even if blanking is not on..
     if (triggerMode_) {
       boolean tmp = PIND & inPinBit_;
       if (tmp != triggerState_) {
+        if (tmp)
+          loopRisingEdges_++;
         if (blankOnHigh_ && tmp ) {
           PORTB = 0;
         }
@@ -389,12 +986,29 @@
         }
         else { 
           if (triggerNr_ >=0) {
-            PORTB = triggerPattern_[sequenceNr_];
+            if (presetSequenceLength_ > 0) {
+              recallPreset(presetSequence_[sequenceNr_]);
+              // the preset sets the trigger direction on which to blank too
+              PORTB = (blankOnHigh_ ? tmp : !tmp) ? 0 : currentPattern_;
+            } else
+              PORTB = triggerPattern_[sequenceNr_];
             sequenceNr_++;
-            if (sequenceNr_ >= patternLength_)
+            if (sequenceNr_ >= (presetSequenceLength_ > 0 ? presetSequenceLength_ : patternLength_))
               sequenceNr_ = 0;
+            patternAdvances_++;
+            if (csMode_) {
+              // triggerEdge() timed a rising edge, a falling one is only seen here
+              unsigned long edgeTime = micros();
+              if (!blankOnHigh_) {
+                noInterrupts();
+                edgeTime = csTriggerTime_;
+                interrupts();
+              }
+              playBasisRow(takeRow(), edgeTime);
+            }
           }
           triggerNr_++;
+          triggerCount_++;
         }
         
         triggerState_ = tmp;       
@@ -424,26 +1038,533 @@ bool waitForSerial(unsigned long timeOut)
     return false;
  }
 
+// Reads a number of count bytes, most significant byte first
+bool readNumber(byte count, unsigned long& value)
+{
+  value = 0;
+  for (byte i = 0; i < count; i++) {
+    if (!waitForSerial(timeOut_))
+      return false;
+    value = (value << 8) | Serial.read();
+  }
+  return true;
+}
+
+// Drops the rest of a payload that timed out, until the line is quiet
+void discardSerial()
+{
+  while (waitForSerial(timeOut_))
+    Serial.read();
+}
+
 // Sets analogue output in the TLV5618
 // channel is either 0 ('A') or 1 ('B')
 // value should be between 0 and 4095 (12 bit max)
 // pins should be connected as described above
 void analogueOut(int channel, byte msb, byte lsb) 
 {
-  digitalWrite(latchPin, LOW);
   msb &= B00001111;
+  dacValue_[channel == 0 ? 0 : 1] = ((unsigned int) msb << 8) | lsb;
   if (channel == 0)
      msb |= B10000000;
   // Note that in all other cases, the data will be written to DAC B and BUFFER
-  shiftOut(dataPin, clockPin, MSBFIRST, msb);
-  shiftOut(dataPin, clockPin, MSBFIRST, lsb);
+  dacWriteFromLoop(((unsigned int) msb << 8) | lsb);
+}
+
+
+// Writes a value into the buffer of the TLV5618 without changing an output,
+// the next write to channel A (see analogueOut) moves it to channel B
+void analogueBuffer(byte msb, byte lsb) 
+{
+  msb &= B00001111;
+  dacValue_[1] = ((unsigned int) msb << 8) | lsb;
+  msb |= B00010000;
+  dacWriteFromLoop(((unsigned int) msb << 8) | lsb);
+}
+
+
+// Writes a 16-bit word (control bits and 12-bit value) to the TLV5618 on
+// the port D bits, fast enough for an interrupt
+void dacWrite(unsigned int word)
+{
+  PORTD &= ~latchBit_;
+  for (unsigned int bit = 0x8000; bit != 0; bit >>= 1) {
+    if (word & bit)
+      PORTD |= dataBit_;
+    else
+      PORTD &= ~dataBit_;
+    PORTD |= clockBit_;
+    PORTD &= ~clockBit_;
+  }
   // The TLV5618 needs one more toggle of the clockPin:
-  digitalWrite(clockPin, HIGH);
-  digitalWrite(clockPin, LOW);
-  digitalWrite(latchPin, HIGH);
+  PORTD |= clockBit_;
+  PORTD &= ~clockBit_;
+  PORTD |= latchBit_;
+}
+
+// dacWrite outside the Timer1 interrupt, which is held off meanwhile so that
+// it cannot write a row value in the middle of this word
+void dacWriteFromLoop(unsigned int word)
+{
+  byte rowInterrupt = holdRowInterrupt();
+  dacWrite(word);
+  releaseRowInterrupt(rowInterrupt);
+}
+
+// Holds off the Timer1 row interrupt only, the trigger and serial interrupts
+// go on.  Returns its enable bit for releaseRowInterrupt
+byte holdRowInterrupt()
+{
+  noInterrupts();
+  byte rowInterrupt = TIMSK1 & _BV(OCIE1A);
+  TIMSK1 &= ~_BV(OCIE1A);
+  interrupts();
+  return rowInterrupt;
+}
+
+void releaseRowInterrupt(byte rowInterrupt)
+{
+  TIMSK1 |= rowInterrupt;
+}
+
+// Starts playing the values of a basis row on DAC channel A, spread evenly
+// over the exposure of that row.  The first value is written right away, the
+// others by the Timer1 compare interrupt.  startTime is the time of the trigger edge
+void playBasisRow(int row, unsigned long startTime)
+{
+  unsigned long exposure = csExposure_ * 1000;
+  if (row < exposureTableLength_)
+    exposure = exposureTable_[row];
+  unsigned long dwell = exposure / b_nvalues;
+  if (dwell < MINDWELL)
+    dwell = MINDWELL;
+
+  // smallest prescaler for which the dwell fits in OCR1A (16 MHz clock:
+  // 0.5, 4, 16 or 64 us per tick)
+  byte prescaler;
+  unsigned long ticks;
+  if (dwell < 32768) {
+    prescaler = _BV(CS11);
+    ticks = dwell * 2;
+  } else if (dwell < 262144) {
+    prescaler = _BV(CS11) | _BV(CS10);
+    ticks = dwell / 4;
+  } else if (dwell < 1048576) {
+    prescaler = _BV(CS12);
+    ticks = dwell / 16;
+  } else {
+    prescaler = _BV(CS12) | _BV(CS10);
+    ticks = min(dwell / 64, 65536UL);
+  }
+
+  stopRowPlayback();
+  playRow_ = row;
+  playIndex_ = 1;
+  dacWrite(dacWord(row, 0)); // the row interrupt was stopped above
+  rowUpdateTime_ = micros() - startTime;
+  if (rowUpdateTime_ > maxRowUpdateTime_)
+    maxRowUpdateTime_ = rowUpdateTime_;
+
+  rowPlaying_ = true;
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | prescaler;
+  OCR1A = ticks - 1;
+  TCNT1 = 0;
+  TIMSK1 |= _BV(OCIE1A);
+}
+
+void stopRowPlayback()
+{
+  TIMSK1 &= ~_BV(OCIE1A);
+  TCCR1B = 0;
+  rowPlaying_ = false;
+}
+
+// Next value of the row being played, zero after the last one
+ISR(TIMER1_COMPA_vect)
+{
+  if (playIndex_ < b_nvalues) {
+    dacWrite(dacWord(playRow_, playIndex_));
+    playIndex_++;
+  } else {
+    dacWrite(dacZero());
+    stopRowPlayback();
+  }
+}
+
+// Value i of a row of the selected basis as a TLV5618 word.  The exporter
+// stores complete words, the control bits are added for older basis.h files
+unsigned int dacWord(int row, int i)
+{
+  BasisAddress p = activeData_ + (unsigned long) row * rowBytes_;
+  switch (activeBasis_.encoding) {
+    case 1:
+      return (basisReadByte(p + (i >> 3)) >> (i & 7)) & 1 ? activeBasis_.high : activeBasis_.control;
+    case 8:
+      return ((basisReadByte(p + i) << activeBasis_.shift) & dacMask_) | activeBasis_.control;
+    default:
+      return (basisReadWord(p + 2 * i) & dacMask_) | activeBasis_.control;
+  }
+}
+
+// Zero on the DAC channel of the basis
+unsigned int dacZero()
+{
+  return activeBasis_.control;
+}
+
+byte basisCount()
+{
+#ifdef BASIS_BANK
+  return BASIS_BANK;
+#else
+  return 1;
+#endif
+}
+
+// Copies entry index of the bank to bankEntry_ and its address to bankData_
+void loadBankEntry(byte index)
+{
+#ifdef BASIS_BANK
+  basisCopy(&bankEntry_, BASIS_ADDRESS(basis_bank) + index * sizeof(BasisEntry), sizeof(BasisEntry));
+  bankData_ = basis_address(index);
+#else
+  bankEntry_ = activeBasis_;
+  bankData_ = activeData_;
+#endif
+}
+
+// Flash bytes used by each row of a basis
+unsigned int basisRowBytes(byte encoding, int values)
+{
+  if (encoding == 1)
+    return (values + 7) / 8;
+  return values * (encoding / 8);
+}
+
+// Answer to command 37 for bankEntry_: header, then chunks first to
+// first + count - 1 of its size bytes, each with its CRC
+void sendBasis(unsigned long size, unsigned int first, unsigned int count)
+{
+  Serial.write( byte(37));
+  Serial.write( highByte(bankEntry_.rows));
+  Serial.write( lowByte(bankEntry_.rows));
+  Serial.write( highByte(bankEntry_.values));
+  Serial.write( lowByte(bankEntry_.values));
+  Serial.write( bankEntry_.encoding);
+  Serial.write( bankEntry_.shift);
+  Serial.write( highByte(bankEntry_.high));
+  Serial.write( lowByte(bankEntry_.high));
+  Serial.write( highByte(bankEntry_.control));
+  Serial.write( lowByte(bankEntry_.control));
+  writeLong(bankEntry_.id);
+  writeLong(size);
+  Serial.write( READBACKCHUNK);
+
+  for (unsigned int chunk = first; chunk < first + count; chunk++) {
+    unsigned long offset = (unsigned long) chunk * READBACKCHUNK;
+    unsigned int n = min(size - offset, (unsigned long) READBACKCHUNK);
+    unsigned int crc = 0xFFFF;
+    crc = crc16(crc, highByte(chunk));
+    crc = crc16(crc, lowByte(chunk));
+    Serial.write( highByte(chunk));
+    Serial.write( lowByte(chunk));
+    for (unsigned int j = 0; j < n; j++) {
+      byte b = basisReadByte(bankData_ + offset + j);
+      crc = crc16(crc, b);
+      Serial.write( b);
+    }
+    Serial.write( highByte(crc));
+    Serial.write( lowByte(crc));
+  }
+}
+
+// CRC-16/CCITT (polynomial 0x1021), one byte at a time
+unsigned int crc16(unsigned int crc, byte b)
+{
+  crc ^= (unsigned int) b << 8;
+  for (byte i = 0; i < 8; i++)
+    crc = (crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1) & 0xFFFF;
+  return crc;
+}
+
+// Makes basis index of the bank the one played by the CS modes
+void selectBasis(byte index)
+{
+  stopRowPlayback();
+#ifdef BASIS_BANK
+  basisCopy(&activeBasis_, BASIS_ADDRESS(basis_bank) + index * sizeof(BasisEntry), sizeof(BasisEntry));
+  activeData_ = basis_address(index);
+  dacMask_ = 0xFFFF;
+#else
+  init_basis(b_nelements, b_nvalues);
+  activeData_ = BASIS_ADDRESS(basis);
+  activeBasis_.rows = b_nelements;
+  activeBasis_.values = b_nvalues;
+  activeBasis_.encoding = BASIS_ENCODING;
+  activeBasis_.shift = 0;
+#if BASIS_ENCODING == 8
+  activeBasis_.shift = basis_shift;
+#endif
+#ifdef BASIS_DAC_WORDS
+  activeBasis_.control = basis_dac_control;
+  dacMask_ = 0xFFFF;
+#else
+  // plain 12-bit values, written to DAC A
+  activeBasis_.control = 0x8000;
+  dacMask_ = 0x0FFF;
+#endif
+  activeBasis_.high = activeBasis_.control;
+#if BASIS_ENCODING == 1
+  activeBasis_.high = (basis_high & dacMask_) | activeBasis_.control;
+#endif
+  activeBasis_.id = atol(basis_id);
+#endif
+  activeBasisIndex_ = index;
+  b_nelements = activeBasis_.rows;
+  b_nvalues = activeBasis_.values;
+  rowBytes_ = basisRowBytes(activeBasis_.encoding, b_nvalues);
+  playlistLength_ = 0;
+  firstRow();
 }
 
+// Row for the current trigger: a queued row if there is one, otherwise the
+// next one of the playlist (or of the basis)
+int takeRow()
+{
+  if (rowQueueCount_ > 0) {
+    int row = rowQueue_[rowQueueStart_];
+    rowQueueStart_ = (rowQueueStart_ + 1) % ROWQUEUELENGTH;
+    rowQueueCount_--;
+    return row;
+  }
+  int row = csRow_;
+  nextRow();
+  return row;
+}
+
+// Goes back to the first row of the playlist (or of the basis)
+void firstRow()
+{
+  rowQueueStart_ = 0;
+  rowQueueCount_ = 0;
+  playlistPosition_ = 0;
+  csRow_ = playlistLength_ > 0 ? playlist_[0] : 0;
+}
+
+void nextRow()
+{
+  if (playlistLength_ > 0) {
+    playlistPosition_++;
+    if (playlistPosition_ >= playlistLength_)
+      playlistPosition_ = 0;
+    csRow_ = playlist_[playlistPosition_];
+  } else {
+    csRow_++;
+    if (csRow_ >= b_nelements)
+      csRow_ = 0;
+  }
+}
 
+// Interrupt 0 (pin 2), counts the triggers of a CS run
+void triggerEdge()
+{
+  csTriggers_++;
+  csTriggerTime_ = micros();
+}
+
+// Keeps the last CSEVENTLENGTH row advances for command 56
+void addCSEvent(int row, unsigned long time)
+{
+  byte j = (csEventStart_ + csEventCount_) % CSEVENTLENGTH;
+  csEventRow_[j] = row;
+  csEventTime_[j] = time;
+  if (csEventCount_ < CSEVENTLENGTH)
+    csEventCount_++;
+  else
+    csEventStart_ = (csEventStart_ + 1) % CSEVENTLENGTH;
+}
+
+void resetTelemetry()
+{
+  triggerCount_ = 0;
+  patternAdvances_ = 0;
+  noInterrupts();
+  edgesAtStart_ = csTriggers_;
+  interrupts();
+  loopRisingEdges_ = 0;
+  for (byte i = 0; i < LOOPHISTOGRAMLENGTH; i++)
+    loopHistogram_[i] = 0;
+  loopMax_ = 0;
+  loopStart_ = micros();
+}
+
+// Rising edges of the current (or last) trigger mode run that loop() did not see
+unsigned long missedEdges()
+{
+  noInterrupts();
+  unsigned long edges = triggerMode_ ? csTriggers_ : edgesAtStop_;
+  interrupts();
+  return edges - edgesAtStart_ - loopRisingEdges_;
+}
+
+void addLoopTime(unsigned long us)
+{
+  if (us > loopMax_)
+    loopMax_ = us;
+  byte i = 0;
+  for (unsigned long limit = 8; i < LOOPHISTOGRAMLENGTH - 1 && us >= limit; limit <<= 1)
+    i++;
+  loopHistogram_[i]++;
+}
+
+// Command 14: the frame is read completely before any output is changed
+void applyFrame()
+{
+  byte frame[FRAMECOMMANDS * 4];
+  byte length = 0;
+  byte n = 0;
+  bool valid = waitForSerial(timeOut_);
+  if (valid) {
+    n = Serial.read();
+    valid = n <= FRAMECOMMANDS;
+  }
+  for (byte i = 0; i < n && valid; i++) {
+    valid = waitForSerial(timeOut_);
+    if (!valid)
+      break;
+    byte command = Serial.read();
+    byte args;
+    if (command == 1)
+      args = 1;
+    else if (command == 3)
+      args = 3;
+    else if (command == 19 || command == 22)
+      args = 1;
+    else if (command == 20 || command == 21)
+      args = 0;
+    else {
+      valid = false;
+      break;
+    }
+    frame[length++] = command;
+    for (byte j = 0; j < args && valid; j++) {
+      valid = waitForSerial(timeOut_);
+      if (valid)
+        frame[length++] = Serial.read();
+    }
+    if (valid && command == 19 && frame[length - 1] >= PRESETS)
+      valid = false;
+  }
+  Serial.write( byte(14));
+  if (!valid) {
+    Serial.write( byte(0));
+    return;
+  }
+
+  // no basis row is written to the DAC in between
+  byte rowInterrupt = holdRowInterrupt();
+  bool patternSet = false;
+  for (byte i = 0; i < length; ) {
+    byte command = frame[i++];
+    if (command == 1) {
+      currentPattern_ = frame[i++] & B00111111;
+      patternSet = true;
+    } else if (command == 3) {
+      analogueOut(frame[i], frame[i + 1], frame[i + 2]);
+      i += 3;
+    } else if (command == 19) {
+      recallPreset(frame[i++]);
+      patternSet = true;
+    } else if (command == 22) {
+      blankOnHigh_ = frame[i++] == 0;
+    } else {
+      blanking_ = command == 20;
+    }
+  }
+  if (patternSet && !blanking_)
+    PORTB = currentPattern_;
+  releaseRowInterrupt(rowInterrupt);
+  Serial.write(n);
+}
+
+// Command 17
+void setOutputs()
+{
+  byte values[5];
+  for (byte i = 0; i < 5; i++) {
+    if (!waitForSerial(timeOut_)) {
+      discardSerial();
+      Serial.write( "n:");
+      return;
+    }
+    values[i] = Serial.read();
+  }
+  // no basis row is written to channel A between B and A
+  byte rowInterrupt = holdRowInterrupt();
+  analogueBuffer(values[3], values[4]);
+  analogueOut(0, values[1], values[2]);
+  releaseRowInterrupt(rowInterrupt);
+  currentPattern_ = values[0] & B00111111;
+  if (!blanking_)
+    PORTB = currentPattern_;
+  Serial.write( byte(17));
+}
+
+// Command 15
+void storePreset()
+{
+  byte preset[PRESETBYTES + 1];
+  for (byte i = 0; i < PRESETBYTES + 1; i++) {
+    if (!waitForSerial(timeOut_))
+      return;
+    preset[i] = Serial.read();
+  }
+  Serial.write( byte(15));
+  if (preset[0] >= PRESETS) {
+    Serial.write( byte(255));
+    return;
+  }
+  preset[1] &= B00111111;
+  preset[2] &= B00001111;
+  preset[4] &= B00001111;
+  // update only writes the bytes that change, the EEPROM wears out
+  for (byte i = 0; i < PRESETBYTES; i++) {
+    EEPROM.update(preset[0] * PRESETBYTES + i, preset[i + 1]);
+    presets_[preset[0]][i] = preset[i + 1];
+  }
+  Serial.write( preset[0]);
+}
+
+// Applies a preset stored with command 15, but for the digital outputs, on
+// which the pattern goes as for command 1 (or trigger mode).  A DAC channel
+// that already holds its value is not written again, but for channel A in
+// CS mode, where basis rows are played on it.
+void recallPreset(byte preset)
+{
+  if (preset >= PRESETS)
+    return;
+  const byte* stored = presets_[preset];
+  if (stored[0] == 255)  // never stored
+    return;
+  currentPattern_ = stored[0];
+  if (csMode_ || dacValue_[0] != (((unsigned int) stored[1] << 8) | stored[2]))
+    analogueOut(0, stored[1], stored[2]);
+  if (dacValue_[1] != (((unsigned int) stored[3] << 8) | stored[4]))
+    analogueOut(1, stored[3], stored[4]);
+  byte flags = stored[5];
+  blanking_ = (flags & 1) != 0;
+  blankOnHigh_ = (flags & 2) == 0;
+}
+
+// Sends 4 bytes, most significant first
+void writeLong(unsigned long value)
+{
+  Serial.write( byte(value >> 24));
+  Serial.write( byte(value >> 16));
+  Serial.write( byte(value >> 8));
+  Serial.write( byte(value));
+}
 
 /* 
  // This function is called through an interrupt   
@@ -18,6 +18,10 @@
 #include <cstdio>
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 
 #ifdef WIN32
    #define WIN32_LEAN_AND_MEAN
@@ -31,6 +35,8 @@ const char* g_DeviceNameArduinoShutter = "Arduino-Shutter";
 const char* g_DeviceNameArduinoDA1 = "Arduino-DAC1";
 const char* g_DeviceNameArduinoDA2 = "Arduino-DAC2";
 const char* g_DeviceNameArduinoInput = "Arduino-Input";
+const char* g_DeviceNameArduinoPresets = "Arduino-Presets";
+const char* g_DeviceNameArduinoCSProcessor = "Arduino-CSReconstruction";
 
 const char* g_DeviceNameDAZStage = "DA Z Stage";
 const char* g_PropertyMinUm = "Stage Low Position(um)";
@@ -39,17 +45,38 @@ const char* g_PropertyMaxUm = "Stage High Position(um)";
 
 // Global info about the state of the Arduino.  This should be folded into a class
 const int g_Min_MMVersion = 1;
-const int g_Max_MMVersion = 3; // CS: changed from 2
+const int g_Max_MMVersion = 5; // CS: changed from 2
 const int cs_version_allowed_ = 3; // CS: created
+const int g_BasisBankVersion = 4; // commands 35 to 37
+const int g_OutputCommandsVersion = 5; // commands 13 to 19
+const unsigned g_MaxExposureTableLength = 128; // EXPOSURETABLELENGTH in the firmware
+const unsigned g_MaxPlaylistLength = 128; // PLAYLISTLENGTH in the firmware
+const unsigned g_MaxCSQueueLength = 32; // ROWQUEUELENGTH in the firmware
+const unsigned g_CSRowLogLength = 256; // rows kept for the CS group sync check
+const unsigned g_MaxCSProgressFailures = 3; // consecutive failed polls of a CS run
+const unsigned g_MaxResyncs = 2; // per command
+const unsigned g_MaxFrameCommands = 8; // in one command 14, see FRAMECOMMANDS
+const int g_CombinedKeys[] = {shadowPattern, shadowDA1, shadowDA2}; // outputs of command 17
+const char* g_TransactionBegin = "Begin";
+const char* g_TransactionCommit = "Commit";
 const char* g_versionProp = "Version";
 const char* g_normalLogicString = "Normal";
 const char* g_invertedLogicString = "Inverted";
 
+const char* g_LogLevelDebug = "Debug";
+const char* g_LogLevelInfo = "Info";
+const char* g_LogLevelError = "Error";
 const char* g_On = "On";
 const char* g_Off = "Off";
+const char* g_CSMethodIncremental = "Incremental";
+const char* g_CSMethodStack = "Stack";
+const char* g_CSPriorNone = "None";
+const char* g_CSPriorWavelet = "Wavelet";
 
 // static lock
 MMThreadLock CArduinoHub::lock_;
+std::vector<CArduinoHub*> CArduinoHub::csHubs_;
+MMThreadLock CArduinoHub::csHubsLock_;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Exported MMDevice API
@@ -62,6 +89,8 @@ MODULE_API void InitializeModuleData()
    RegisterDevice(g_DeviceNameArduinoDA1, MM::SignalIODevice, "DAC channel 1");
    RegisterDevice(g_DeviceNameArduinoDA2, MM::SignalIODevice, "DAC channel 2");
    RegisterDevice(g_DeviceNameArduinoInput, MM::GenericDevice, "ADC");
+   RegisterDevice(g_DeviceNameArduinoPresets, MM::StateDevice, "Output presets");
+   RegisterDevice(g_DeviceNameArduinoCSProcessor, MM::ImageProcessorDevice, "Incremental CS reconstruction");
    
    //RegisterDevice(g_DeviceNameDAZStage, MM::StageDevice, "Arduino-controlled Z-stage"); // Added to control Stage
 }
@@ -95,6 +124,14 @@ MODULE_API MM::Device* CreateDevice(const char* deviceName)
    {
       return new CArduinoInput;
    }
+   else if (strcmp(deviceName, g_DeviceNameArduinoPresets) == 0)
+   {
+      return new CArduinoPresets;
+   }
+   else if (strcmp(deviceName, g_DeviceNameArduinoCSProcessor) == 0)
+   {
+      return new CArduinoCSProcessor;
+   }
    //lse if (strcmp(deviceName, g_DeviceNameDAZStage) == 0)
    //{
    //   return new CArduinoZStage;
@@ -115,11 +152,37 @@ MODULE_API void DeleteDevice(MM::Device* pDevice)
 CArduinoHub::CArduinoHub() :
    initialized_ (false),
    switchState_ (0),
-   shutterState_ (0)
+   shutterState_ (0),
+   csBasisIndex_ (0),
+   csRunActive_ (false),
+   csCurrentRow_ (0),
+   csRowsCompleted_ (0),
+   csMissedTriggers_ (0),
+   csGroupLeader_ (true),
+   csGroupOffset_ (0),
+   csSyncErrors_ (0),
+   csThread_ (0),
+   latencyOpcode_ (-1),
+   latencyCommand_ (0),
+   shadowMaxAgeMs_ (1000),
+   shadowThread_ (0),
+   linkResyncs_ (0),
+   linkResyncFailures_ (0),
+   linkRetries_ (0),
+   asyncCommands_ (false),
+   transactionDepth_ (0),
+   propertyTransaction_ (false),
+   commandThread_ (0)
 {
+   for (int i = 0; i < shadowKeys; i++)
+      shadow_[i].valid = false;
+   for (int i = 0; i < numPresets; i++)
+      presets_[i].defined = false;
    portAvailable_ = false;
    invertedLogic_ = false;
    timedOutputActive_ = false;
+   sequenceActive_ = false;
+   telemetryValid_ = false;
 
    InitializeDefaultErrorMessages();
 
@@ -130,6 +193,7 @@ CArduinoHub::CArduinoHub() :
    errorText << "The firmware version on the Arduino is not compatible with this adapter.  Please use firmware version ";
    errorText <<  g_Min_MMVersion << " to " << g_Max_MMVersion;
    SetErrorText(ERR_VERSION_MISMATCH, errorText.str().c_str());
+   SetErrorText(ERR_TRAFFIC_FILE, "Could not write or read the Arduino traffic recording");
 
    CPropertyAction* pAct = new CPropertyAction(this, &CArduinoHub::OnPort);
    CreateProperty(MM::g_Keyword_Port, "Undefined", MM::String, false, pAct, true);
@@ -151,9 +215,17 @@ void CArduinoHub::GetName(char* name) const
    CDeviceUtils::CopyLimitedString(name, g_DeviceNameArduinoHub);
 }
 
+// Telemetry, frames, presets and combined outputs (commands 13 to 19)
+bool CArduinoHub::HasOutputCommands()
+{
+   return version_ >= g_OutputCommandsVersion;
+}
+
 bool CArduinoHub::Busy()
 {
-   return false;
+   // a command taken off the queue is pending until its answer arrived
+   MMThreadGuard guard(commandLock_);
+   return !commandsPending_.empty();
 }
 
 // * Return the version of the Arduino firmware *
@@ -169,12 +241,12 @@ int CArduinoHub::GetControllerVersion(int& version)
    command[0] = 30;
    version = 0;
 
-   ret = WriteToComPort(port_.c_str(), (const unsigned char*) command, 1);
+   ret = WriteToComPortH((const unsigned char*) command, 1);
    if (ret != DEVICE_OK)
       return ret;
 
    std::string answer;
-   ret = GetSerialAnswer(port_.c_str(), "\r\n", answer);
+   ret = GetSerialAnswerH(answer);
    if (ret != DEVICE_OK)
       return ret;
 
@@ -183,12 +255,12 @@ int CArduinoHub::GetControllerVersion(int& version)
 
    // Check version number of the Arduino
    command[0] = 31;
-   ret = WriteToComPort(port_.c_str(), (const unsigned char*) command, 1);
+   ret = WriteToComPortH((const unsigned char*) command, 1);
    if (ret != DEVICE_OK)
       return ret;
 
    std::string ans;
-   ret = GetSerialAnswer(port_.c_str(), "\r\n", ans);
+   ret = GetSerialAnswerH(ans);
    if (ret != DEVICE_OK) {
          return ret;
    }
@@ -209,12 +281,12 @@ int CArduinoHub::GetCSMode(int& yesno)
    command[0] = 33;
    yesno = 0;
 
-   ret = WriteToComPort(port_.c_str(), (const unsigned char*) command, 1);
+   ret = WriteToComPortH((const unsigned char*) command, 1);
    if (ret != DEVICE_OK)
       return ret;
 
     std::string ans;
-    ret = GetSerialAnswer(port_.c_str(), "\r\n", ans);
+    ret = GetSerialAnswerH(ans);
     if (ret != DEVICE_OK) {
          return ret;
     }
@@ -243,12 +315,12 @@ int CArduinoHub::GetCSBasisId(int& basis_id)
 
    // Check version number of the Arduino
    command[0] = 34;
-   ret = WriteToComPort(port_.c_str(), (const unsigned char*) command, 1);
+   ret = WriteToComPortH((const unsigned char*) command, 1);
    if (ret != DEVICE_OK)
       return ret;
 
    std::string ans;
-   ret = GetSerialAnswer(port_.c_str(), "\r\n", ans);
+   ret = GetSerialAnswerH(ans);
    if (ret != DEVICE_OK) {
          return ret;
    }
@@ -259,1414 +331,4508 @@ int CArduinoHub::GetCSBasisId(int& basis_id)
 
 }
 
-bool CArduinoHub::SupportsDeviceDetection(void)
+// Trigger, loop() timing and serial counters of the firmware (command 13)
+int CArduinoHub::ReadTelemetry(ArduinoTelemetry& telemetry)
 {
-   return true;
+   unsigned char command[1];
+   command[0] = 13;
+   int ret = WriteToComPortH(command, 1);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   unsigned char answer[57];
+   ret = ReadNBytes(57, answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (answer[0] != 13)
+      return ERR_COMMUNICATION;
+
+   unsigned long values[14];
+   for (unsigned i = 0; i < 14; i++)
+   {
+      const unsigned char* v = &answer[1 + 4 * i];
+      values[i] = ((unsigned long) v[0] << 24) | (v[1] << 16) | (v[2] << 8) | v[3];
+   }
+   telemetry.triggers = values[0];
+   telemetry.patternAdvances = values[1];
+   telemetry.missedEdges = values[2];
+   telemetry.loopMaxUs = values[3];
+   for (unsigned i = 0; i < 8; i++)
+      telemetry.loopHistogram[i] = values[4 + i];
+   telemetry.bytesIn = values[12];
+   telemetry.bytesOut = values[13];
+   telemetry_ = telemetry;
+   telemetryTime_ = GetCurrentMMTime();
+   telemetryValid_ = true;
+   return DEVICE_OK;
 }
 
-MM::DeviceDetectionStatus CArduinoHub::DetectDevice(void)
+std::string CArduinoHub::FormatTelemetry(const ArduinoTelemetry& telemetry)
 {
-   if (initialized_)
-      return MM::CanCommunicate;
+   std::ostringstream os;
+   os << telemetry.triggers << " triggers, " << telemetry.patternAdvances << " pattern advances, "
+      << telemetry.missedEdges << " missed edges, longest loop " << telemetry.loopMaxUs << " us (";
+   for (unsigned i = 0; i < 8; i++)
+      os << (i > 0 ? "," : "") << telemetry.loopHistogram[i];
+   os << "), serial " << telemetry.bytesIn << " bytes in, " << telemetry.bytesOut << " bytes out";
+   return os.str();
+}
 
-   // all conditions must be satisfied...
-   MM::DeviceDetectionStatus result = MM::Misconfigured;
-   char answerTO[MM::MaxStrLength];
-   
-   try
+// The counters are read once for all the Telemetry properties, again when
+// older than the shadow period.  While timed output, a sequence or a CS run
+// goes on, the last ones read are kept: any byte sent would stop them.
+int CArduinoHub::OnTelemetry(MM::PropertyBase* pProp, MM::ActionType eAct, long counter)
+{
+   if (eAct == MM::BeforeGet)
    {
-      std::string portLowerCase = port_;
-      for( std::string::iterator its = portLowerCase.begin(); its != portLowerCase.end(); ++its)
-      {
-         *its = (char)tolower(*its);
-      }
-      if( 0< portLowerCase.length() &&  0 != portLowerCase.compare("undefined")  && 0 != portLowerCase.compare("unknown") )
+      ArduinoTelemetry telemetry;
       {
-         result = MM::CanNotCommunicate;
-         // record the default answer time out
-         GetCoreCallback()->GetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
-
-         // device specific default communication parameters
-         // for Arduino Duemilanova
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_Handshaking, g_Off);
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, "57600" );
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_StopBits, "1");
-         // Arduino timed out in GetControllerVersion even if AnswerTimeout  = 300 ms
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", "500.0");
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "DelayBetweenCharsMs", "0");
-         MM::Device* pS = GetCoreCallback()->GetDevice(this, port_.c_str());
-         pS->Initialize();
-         // The first second or so after opening the serial port, the Arduino is waiting for firmwareupgrades.  Simply sleep 2 seconds.
-         CDeviceUtils::SleepMs(2000);
          MMThreadGuard myLock(lock_);
-         PurgeComPort(port_.c_str());
-         int v = 0;
-         int ret = GetControllerVersion(v);
-         // later, Initialize will explicitly check the version #
-         if( DEVICE_OK != ret )
-         {
-            LogMessageCode(ret,true);
-         }
-         else
+         bool running = timedOutputActive_ || sequenceActive_ || csRunActive_;
+         if (!running && (!telemetryValid_ ||
+               (GetCurrentMMTime() - telemetryTime_).getMsec() > GetShadowPeriodMs()))
          {
-            // to succeed must reach here....
-            result = MM::CanCommunicate;
+            PurgeComPort(port_.c_str());
+            int ret = ReadTelemetry(telemetry);
+            if (ret != DEVICE_OK)
+               return ret;
          }
-         pS->Shutdown();
-         // always restore the AnswerTimeout to the default
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
-
+         if (!telemetryValid_)
+            return DEVICE_OK;
+         telemetry = telemetry_;
+      }
+      unsigned long counters[] = {telemetry.triggers, telemetry.patternAdvances, telemetry.missedEdges,
+            telemetry.loopMaxUs, telemetry.bytesIn, telemetry.bytesOut};
+      if (counter < 6)
+         pProp->Set((long) counters[counter]);
+      else
+      {
+         std::ostringstream os;
+         for (unsigned i = 0; i < 8; i++)
+            os << (i > 0 ? "," : "") << telemetry.loopHistogram[i];
+         pProp->Set(os.str().c_str());
       }
    }
-   catch(...)
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnLatencyCommand(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
    {
-      LogMessage("Exception in DetectDevice!",false);
+      pProp->Set((long) latencyCommand_);
    }
-
-   return result;
+   else if (eAct == MM::AfterSet)
+   {
+      long command;
+      pProp->Get(command);
+      latencyCommand_ = (unsigned char) command;
+   }
+   return DEVICE_OK;
 }
 
-
-int CArduinoHub::Initialize()
+int CArduinoHub::OnLatency(MM::PropertyBase* pProp, MM::ActionType eAct, long statistic)
 {
-   // Name
-   int ret = CreateProperty(MM::g_Keyword_Name, g_DeviceNameArduinoHub, MM::String, true);
-   if (DEVICE_OK != ret)
-      return ret;
-
-   // The first second or so after opening the serial port, the Arduino is waiting for firmwareupgrades.  Simply sleep 1 second.
-   CDeviceUtils::SleepMs(2000);
-
-   MMThreadGuard myLock(lock_);
-
-   // Check that we have a controller:
-   PurgeComPort(port_.c_str());
-   ret = GetControllerVersion(version_);
-   if( DEVICE_OK != ret)
-      return ret;
-
-   if (version_ < g_Min_MMVersion || version_ > g_Max_MMVersion)
-      return ERR_VERSION_MISMATCH;
-
-   CPropertyAction* pAct = new CPropertyAction(this, &CArduinoHub::OnVersion);
-   std::ostringstream sversion;
-   sversion << version_;
-   CreateProperty(g_versionProp, sversion.str().c_str(), MM::Integer, true, pAct);
-   
-    // Test if the controller accepts compressed sensing
-    if (version_ == cs_version_allowed_) {
-        ret = GetCSMode(cs_firmware_);
-        if( DEVICE_OK != ret)
-            return ret;       
-    }
-   
-    // CS enabled property
-    if (cs_firmware_) {
-        // CS Mode
-        pAct = new CPropertyAction(this, &CArduinoHub::OnCSOnOff);
-        CreateProperty("Compressed sensing", "0", MM::Integer, false, pAct, false);
-        
-        // TODOCreate new property here
-        pAct = new CPropertyAction(this, &CArduinoHub::OnExposureChanged);
-        CreateProperty("Arduino Exposure", "1", MM::Integer, false, pAct, false);
-        
-        CreateProperty("CSEnabled", "true", MM::String, true);
-    } else {
-        CreateProperty("CSEnabled", "false", MM::String, true);
-    }
-        
-    // Get basis id (hashCode)
-    pAct = new CPropertyAction(this, &CArduinoHub::OnVersion);
-    if (cs_firmware_) {
-        // Check the basis Id here
-        GetCSBasisId(cs_basis_id_);
-        std::ostringstream sbasis_id;
-        sbasis_id << cs_basis_id_;
-        CreateProperty("CSBasisId", sbasis_id.str().c_str(), MM::Integer, pAct); 
-    }
-
-   ret = UpdateStatus();
-   if (ret != DEVICE_OK)
-      return ret;
-
-   // turn off verbose serial debug messages
-   // GetCoreCallback()->SetDeviceProperty(port_.c_str(), "Verbose", "0");
-
-   initialized_ = true;
+   if (eAct == MM::BeforeGet)
+   {
+      switch (statistic)
+      {
+         case 0: pProp->Set((long) latency_.GetCount(latencyCommand_)); break;
+         case 1: pProp->Set((long) latency_.GetTimeouts(latencyCommand_)); break;
+         case 2: pProp->Set((long) latency_.GetPercentile(latencyCommand_, 0.5)); break;
+         case 3: pProp->Set((long) latency_.GetPercentile(latencyCommand_, 0.99)); break;
+         case 4: pProp->Set((long) latency_.GetMax(latencyCommand_)); break;
+         default: pProp->Set(latency_.GetSummary().c_str()); break;
+      }
+   }
    return DEVICE_OK;
 }
 
-int CArduinoHub::DetectInstalledDevices()
+int CArduinoHub::OnLatencyReset(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   if (MM::CanCommunicate == DetectDevice()) 
+   if (eAct == MM::AfterSet)
    {
-      std::vector<std::string> peripherals; 
-      peripherals.clear();
-      peripherals.push_back(g_DeviceNameArduinoSwitch);
-      peripherals.push_back(g_DeviceNameArduinoShutter);
-      peripherals.push_back(g_DeviceNameArduinoInput);
-      peripherals.push_back(g_DeviceNameArduinoDA1);
-      peripherals.push_back(g_DeviceNameArduinoDA2);
-      for (size_t i=0; i < peripherals.size(); i++) 
+      std::string reset;
+      pProp->Get(reset);
+      if (reset == "Reset")
       {
-         MM::Device* pDev = ::CreateDevice(peripherals[i].c_str());
-         if (pDev) 
-         {
-            AddInstalledDevice(pDev);
-         }
+         MMThreadGuard myLock(lock_);
+         latency_.Reset();
       }
+      pProp->Set("Idle");
    }
-
    return DEVICE_OK;
 }
 
-int CArduinoHub::Shutdown()
+int CArduinoHub::OnLinkCounter(MM::PropertyBase* pProp, MM::ActionType eAct, long counter)
 {
-   initialized_ = false;
+   if (eAct == MM::BeforeGet)
+   {
+      unsigned long counters[] = {linkResyncs_, linkResyncFailures_, linkRetries_};
+      pProp->Set((long) counters[counter]);
+   }
    return DEVICE_OK;
 }
 
-int CArduinoHub::OnPort(MM::PropertyBase* pProp, MM::ActionType pAct)
+int CArduinoHub::OnAsyncCommands(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   if (pAct == MM::BeforeGet)
+   if (eAct == MM::BeforeGet)
    {
-      pProp->Set(port_.c_str());
+      pProp->Set(asyncCommands_ ? g_On : g_Off);
    }
-   else if (pAct == MM::AfterSet)
+   else if (eAct == MM::AfterSet)
    {
-      pProp->Get(port_);
-      portAvailable_ = true;
+      std::string async;
+      pProp->Get(async);
+      asyncCommands_ = (async == g_On);
    }
    return DEVICE_OK;
 }
 
-int CArduinoHub::OnVersion(MM::PropertyBase* pProp, MM::ActionType pAct)
+int CArduinoHub::OnTransaction(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   if (pAct == MM::BeforeGet)
+   if (eAct == MM::BeforeGet)
    {
-      pProp->Set((long)version_);
+      pProp->Set(propertyTransaction_ ? g_TransactionBegin : g_TransactionCommit);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string transaction;
+      pProp->Get(transaction);
+      if (transaction == g_TransactionBegin && !propertyTransaction_)
+      {
+         propertyTransaction_ = true;
+         BeginTransaction();
+      }
+      else if (transaction == g_TransactionCommit && propertyTransaction_)
+      {
+         propertyTransaction_ = false;
+         return CommitTransaction();
+      }
    }
    return DEVICE_OK;
 }
 
-int CArduinoHub::OnLogic(MM::PropertyBase* pProp, MM::ActionType pAct)
+void CArduinoHub::BeginTransaction()
 {
-   if (pAct == MM::BeforeGet)
-   {
-      if (invertedLogic_)
-         pProp->Set(g_invertedLogicString);
-      else
-         pProp->Set(g_normalLogicString);
-   } else if (pAct == MM::AfterSet)
+   MMThreadGuard guard(commandLock_);
+   if (transactionDepth_++ == 0)
    {
-      std::string logic;
-      pProp->Get(logic);
-      if (logic.compare(g_invertedLogicString)==0)
-         invertedLogic_ = true;
-      else invertedLogic_ = false;
+#ifdef WIN32
+      transactionThread_ = GetCurrentThreadId();
+#else
+      transactionThread_ = pthread_self();
+#endif
    }
-   return DEVICE_OK;
 }
 
-/* Should set the exposure property to the Arduino */
-int CArduinoHub::OnExposureChanged(MM::PropertyBase* pProp, MM::ActionType eAct) {
-    if (eAct == MM::AfterSet) { // If the property is being edited, send the new value to the Arduino 
-        LogMessage("Property modified", false);
-        
-        long cson;
-        pProp->Get(cson);    
-        std::stringstream ss;
-        ss << cson;
-        LogMessage(ss.str());
-        
-        // request the state to the Arduino
-        unsigned char command[4];
-        command[0] = 52;
-        // a3=a%256;a2=(a-a3)/256.%256;a1=(a-a2*256-a3)/(256.*256)%256; print int(a1),int(a2),int(a3)
+// Expects caller to hold commandLock_
+bool CArduinoHub::IsTransactionThread()
+{
+#ifdef WIN32
+   return transactionThread_ == GetCurrentThreadId();
+#else
+   return pthread_equal(transactionThread_, pthread_self()) != 0;
+#endif
+}
 
-        command[3] = (unsigned char) cson % 256;
-        command[2] = (unsigned char) ((cson - command[3])/256) % 256;
-        command[1] = (unsigned char) ((cson - command[2]*256-command[3])/(256*256)) % 256;
-        
-        int ret = WriteToComPort(port_.c_str(), (const unsigned char*) command, 4);
-        if (ret != DEVICE_OK)
-            return ret;
+int CArduinoHub::CommitTransaction()
+{
+   std::vector<QueuedCommand> commands;
+   {
+      MMThreadGuard guard(commandLock_);
+      if (transactionDepth_ == 0 || --transactionDepth_ > 0)
+         return DEVICE_OK;
+      commands.swap(transaction_);
+   }
+   if (commands.empty())
+      return DEVICE_OK;
 
-        // read the answer
-        std::string answer;
-        ret = GetSerialAnswer(port_.c_str(), "\r\n", answer);
-        if (ret != DEVICE_OK) {
-            return ret;
-        }
-        LogMessage(answer); 
-        if (answer != std::string("4")+ss.str()) { // Answer is gonna be the concatenations
-            return ERR_COMMUNICATION;   
-        }           
-    }
-    return DEVICE_OK;
+   // the frame goes after the commands queued before the commit
+   WaitForAllCommands();
+
+   // the commit is synchronous, its caller gets the error
+   return SendTransaction(commands);
 }
 
-/* Should set ON or OFF the CS mode*/
-int CArduinoHub::OnCSOnOff(MM::PropertyBase* pProp, MM::ActionType eAct) 
+// Sends the commands of a transaction
+int CArduinoHub::SendTransaction(const std::vector<QueuedCommand>& commands)
 {
-    if (eAct == MM::BeforeGet) // Do this when the property is being requested
-    {
-        LogMessage("Property queried", false);
-        
-        // request the state to the Arduino
-        unsigned char command[1];
-        command[0] = 51;
-        int ret = WriteToComPort(port_.c_str(), (const unsigned char*) command, 1);
-        if (ret != DEVICE_OK)
+   // older firmware gets the commands one by one
+   if (commands.size() == 1 || commands.size() > g_MaxFrameCommands || !HasOutputCommands())
+   {
+      for (unsigned i = 0; i < commands.size(); i++)
+      {
+         const QueuedCommand& c = commands[i];
+         int ret = SendCommandNow(c.device, c.command, c.len, c.answerLen, c.shadowKey, c.shadowValue);
+         if (ret != DEVICE_OK)
             return ret;
+      }
+      return DEVICE_OK;
+   }
 
-        // read the answer
-        std::string answer;
-        ret = GetSerialAnswer(port_.c_str(), "\r\n", answer);
-        if (ret != DEVICE_OK) {
-            return ret;
-        }
-        
-        // analyze the answer
-        LogMessage(answer); 
-
-        if (answer == "30") { // CS activated
-            pProp->Set("0");
-        } else if (answer == "31") { // CS deactivated
-            pProp->Set("1");
-        } else {
-            return ERR_COMMUNICATION;   
-        }   
-    } 
-    else if (eAct == MM::AfterSet) // If the property is being edited, send the new value to the Arduino 
-    {
-        LogMessage("Property modified", false);
-        
-        long cson;
-        pProp->Get(cson);    
-        std::stringstream ss;
-        ss << cson;
-        LogMessage(ss.str());
-        
-        // request the state to the Arduino
-        unsigned char command[2];
-        command[0] = 50;
-        command[1] = cson;
-        int ret = WriteToComPort(port_.c_str(), (const unsigned char*) command, 2);
-        if (ret != DEVICE_OK)
-            return ret;
-
-        // read the answer
-        std::string answer;
-        ret = GetSerialAnswer(port_.c_str(), "\r\n", answer);
-        if (ret != DEVICE_OK) {
-            return ret;
-        }
-        LogMessage(answer); 
-        if (answer != "2") { // CS activated
-            return ERR_COMMUNICATION;   
-        }           
-    }
-    return DEVICE_OK;
-}
-///////////////////////////////////////////////////////////////////////////////
-// CArduinoSwitch implementation
-// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+   MMThreadGuard myLock(lock_);
+   bool sent;
+   int ret = SendCombined(commands, sent);
+   if (sent)
+      return ret;
 
-CArduinoSwitch::CArduinoSwitch() : 
-   nrPatternsUsed_(0),
-   currentDelay_(0),
-   sequenceOn_(false),
-   blanking_(false),
-   initialized_(false),
-   numPos_(64), 
-   busy_(false)
-{
-   InitializeDefaultErrorMessages();
+   std::vector<unsigned char> frame;
+   frame.push_back(14);
+   frame.push_back((unsigned char) commands.size());
+   for (unsigned i = 0; i < commands.size(); i++)
+      frame.insert(frame.end(), commands[i].command, commands[i].command + commands[i].len);
 
-   // add custom error messages
-   SetErrorText(ERR_UNKNOWN_POSITION, "Invalid position (state) specified");
-   SetErrorText(ERR_INITIALIZE_FAILED, "Initialization of the device failed");
-   SetErrorText(ERR_WRITE_FAILED, "Failed to write data to the device");
-   SetErrorText(ERR_CLOSE_FAILED, "Failed closing the device");
-   SetErrorText(ERR_COMMUNICATION, "Error in communication with Arduino board");
-   SetErrorText(ERR_NO_PORT_SET, "Hub Device not found.  The Arduino Hub device is needed to create this device");
+   unsigned char answer[2];
+   ret = Transact(&frame[0], (unsigned) frame.size(), answer, 2);
+   if (ret != DEVICE_OK)
+      return ret;
+   // 0 when the board rejected the frame, nothing was applied then
+   if (answer[1] != commands.size())
+      return ERR_COMMUNICATION;
 
-   for (unsigned int i=0; i < NUMPATTERNS; i++)
-      pattern_[i] = 0;
+   for (unsigned i = 0; i < commands.size(); i++)
+      SetShadow(commands[i].shadowKey, commands[i].shadowValue);
+   SetTimedOutput(false);
+   ArduinoLog::Write(ArduinoLog::Debug, this, "Applied {} commands in one frame", (unsigned) commands.size());
+   return DEVICE_OK;
+}
 
-   // Description
-   int ret = CreateProperty(MM::g_Keyword_Description, "Arduino digital output driver", MM::String, true);
-   assert(DEVICE_OK == ret);
+int CArduinoHub::SendCommand(const MM::Device* device, const unsigned char* command, unsigned len,
+      unsigned answerLen, int shadowKey, long shadowValue)
+{
+   QueuedCommand queued;
+   queued.device = device;
+   memcpy(queued.command, command, std::min(len, (unsigned) sizeof(queued.command)));
+   queued.len = std::min(len, (unsigned) sizeof(queued.command));
+   queued.answerLen = answerLen;
+   queued.shadowKey = shadowKey;
+   queued.shadowValue = shadowValue;
 
-   // Name
-   ret = CreateProperty(MM::g_Keyword_Name, g_DeviceNameArduinoSwitch, MM::String, true);
-   assert(DEVICE_OK == ret);
+   {
+      MMThreadGuard guard(commandLock_);
+      if (transactionDepth_ > 0 && IsTransactionThread())
+      {
+         // the board applies the frame in order, the replaced write moves
+         // to the end
+         std::vector<QueuedCommand>::iterator it = transaction_.begin();
+         while (it != transaction_.end() && it->shadowKey != shadowKey)
+            ++it;
+         if (it != transaction_.end())
+            transaction_.erase(it);
+         transaction_.push_back(queued);
+         return DEVICE_OK;
+      }
+   }
 
-   // parent ID display
-   CreateHubIDProperty();
+   if (!asyncCommands_)
+   {
+      // keeps the order with commands queued before AsyncCommands went off
+      int ret = WaitForCommands(device);
+      if (ret != DEVICE_OK)
+         return ret;
+      return SendCommandNow(device, command, len, answerLen, shadowKey, shadowValue);
+   }
 
+   MMThreadGuard guard(commandLock_);
+   std::map<const MM::Device*, int>::iterator error = commandErrors_.find(device);
+   if (error != commandErrors_.end())
+   {
+      // the command fails as a whole, as it would when sent at once
+      int ret = error->second;
+      commandErrors_.erase(error);
+      return ret;
+   }
+   commandQueue_.push_back(queued);
+   commandsPending_[device]++;
+   commandSignal_.Notify();
+   return DEVICE_OK;
 }
 
-CArduinoSwitch::~CArduinoSwitch()
+int CArduinoHub::SendCommandNow(const MM::Device* device, const unsigned char* command, unsigned len,
+      unsigned answerLen, int shadowKey, long shadowValue)
 {
-   Shutdown();
-}
+   MMThreadGuard myLock(lock_);
+   unsigned char answer[4];
+   int ret = Transact(command, len, answer, std::min(answerLen, (unsigned) sizeof(answer)), device);
+   if (ret != DEVICE_OK)
+      return ret;
 
-void CArduinoSwitch::GetName(char* name) const
-{
-   CDeviceUtils::CopyLimitedString(name, g_DeviceNameArduinoSwitch);
+   SetShadow(shadowKey, shadowValue);
+   SetTimedOutput(false);
+   return DEVICE_OK;
 }
 
-
-int CArduinoSwitch::Initialize()
+int CArduinoHub::SendCombined(const std::vector<QueuedCommand>& commands, bool& sent)
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable()) {
-      return ERR_NO_PORT_SET;
-   }
-   char hubLabel[MM::MaxStrLength];
-   hub->GetLabel(hubLabel);
-   SetParentID(hubLabel); // for backward comp.
+   sent = false;
+   if (!HasOutputCommands())
+      return DEVICE_OK;
 
-   // set property list
-   // -----------------
-   
-   // create positions and labels
-   const int bufSize = 65;
-   char buf[bufSize];
-   for (long i=0; i<numPos_; i++)
+   long values[3];
+   bool changed[3] = {false, false, false};
+   for (unsigned i = 0; i < commands.size(); i++)
    {
-      snprintf(buf, bufSize, "%d", (unsigned)i);
-      SetPositionLabel(i, buf);
+      int k = 0;
+      while (k < 3 && g_CombinedKeys[k] != commands[i].shadowKey)
+         k++;
+      if (k == 3)
+         return DEVICE_OK;
+      values[k] = commands[i].shadowValue;
+      changed[k] = true;
+   }
+   // command 17 writes all three, each one has to come with the commands
+   for (int k = 0; k < 3; k++)
+   {
+      if (!changed[k])
+         return DEVICE_OK;
    }
 
-   // State
-   // -----
-   CPropertyAction* pAct = new CPropertyAction (this, &CArduinoSwitch::OnState);
-   int nRet = CreateProperty(MM::g_Keyword_State, "0", MM::Integer, false, pAct);
-   if (nRet != DEVICE_OK)
-      return nRet;
-   SetPropertyLimits(MM::g_Keyword_State, 0, numPos_ - 1);
-
-   // Label
-   // -----
-   pAct = new CPropertyAction (this, &CStateBase::OnLabel);
-   nRet = CreateProperty(MM::g_Keyword_Label, "", MM::String, false, pAct);
-   if (nRet != DEVICE_OK)
-      return nRet;
-
-   pAct = new CPropertyAction(this, &CArduinoSwitch::OnSequence);
-   nRet = CreateProperty("Sequence", g_On, MM::String, false, pAct);
-   if (nRet != DEVICE_OK)
-      return nRet;
-   AddAllowedValue("Sequence", g_On);
-   AddAllowedValue("Sequence", g_Off);
-
-   // Starts "blanking" mode: goal is to synchronize laser light with camera exposure
-   std::string blankMode = "Blanking Mode";
-   pAct = new CPropertyAction(this, &CArduinoSwitch::OnBlanking);
-   nRet = CreateProperty(blankMode.c_str(), "Idle", MM::String, false, pAct);
-   if (nRet != DEVICE_OK)
-      return nRet;
-   AddAllowedValue(blankMode.c_str(), g_On);
-   AddAllowedValue(blankMode.c_str(), g_Off);
-
-   // Blank on TTL high or low
-   pAct = new CPropertyAction(this, &CArduinoSwitch::OnBlankingTriggerDirection);
-   nRet = CreateProperty("Blank On", "Low", MM::String, false, pAct);
-   if (nRet != DEVICE_OK)
-      return nRet;
-   AddAllowedValue("Blank On", "Low");
-   AddAllowedValue("Blank On", "High");
-
-   /*
-   // Starts producing timed digital output patterns 
-   // Parameters that influence the pattern are 'Repeat Timed Pattern', 'Delay', 'State' where the latter two are manipulated with the Get and SetPattern functions
-   std::string timedOutput = "Timed Output Mode";
-   pAct = new CPropertyAction(this, &CArduinoSwitch::OnStartTimedOutput);
-   nRet = CreateProperty(timedOutput.c_str(), "Idle", MM::String, false, pAct);
-   if (nRet != DEVICE_OK)
-      return nRet;
-   AddAllowedValue(timedOutput.c_str(), "Stop");
-   AddAllowedValue(timedOutput.c_str(), "Start");
-   AddAllowedValue(timedOutput.c_str(), "Running");
-   AddAllowedValue(timedOutput.c_str(), "Idle");
+   unsigned char command[6];
+   command[0] = 17;
+   command[1] = (unsigned char) (values[0] & 63);
+   command[2] = (unsigned char) (values[1] / 256L);
+   command[3] = (unsigned char) (values[1] & 255);
+   command[4] = (unsigned char) (values[2] / 256L);
+   command[5] = (unsigned char) (values[2] & 255);
+   unsigned char answer[1];
+   sent = true;
+   int ret = Transact(command, 6, answer, 1, commands[0].device);
+   if (ret != DEVICE_OK)
+      return ret;
 
-   // Sets a delay (in ms) to be used in timed output mode
-   // This delay will be transferred to the Arduino using the Get and SetPattern commands
-   pAct = new CPropertyAction(this, &CArduinoSwitch::OnDelay);
-   nRet = CreateProperty("Delay (ms)", "0", MM::Integer, false, pAct);
-   if (nRet != DEVICE_OK)
-      return nRet;
-   SetPropertyLimits("Delay (ms)", 0, 65535);
+   for (int k = 0; k < 3; k++)
+      SetShadow(g_CombinedKeys[k], values[k]);
+   SetTimedOutput(false);
+   return DEVICE_OK;
+}
 
-   // Repeat the timed Pattern this many times:
-   pAct = new CPropertyAction(this, &CArduinoSwitch::OnRepeatTimedPattern);
-   nRet = CreateProperty("Repeat Timed Pattern", "0", MM::Integer, false, pAct);
-   if (nRet != DEVICE_OK)
-      return nRet;
-   SetPropertyLimits("Repeat Timed Pattern", 0, 255);
-   */
+// Pattern and DA writes queued one after the other go out together
+bool CArduinoHub::SendQueuedCommand()
+{
+   std::vector<QueuedCommand> batch;
+   {
+      MMThreadGuard guard(commandLock_);
+      if (commandQueue_.empty())
+         return false;
+      batch.push_back(commandQueue_.front());
+      commandQueue_.pop_front();
+      const int* combinedEnd = g_CombinedKeys + 3;
+      while (!commandQueue_.empty() &&
+            std::find(g_CombinedKeys, combinedEnd, batch[0].shadowKey) != combinedEnd &&
+            std::find(g_CombinedKeys, combinedEnd, commandQueue_.front().shadowKey) != combinedEnd)
+      {
+         batch.push_back(commandQueue_.front());
+         commandQueue_.pop_front();
+      }
+   }
 
-   nRet = UpdateStatus();
-   if (nRet != DEVICE_OK)
-      return nRet;
+   std::vector<int> results(batch.size(), DEVICE_OK);
+   bool sent = false;
+   if (batch.size() > 1)
+   {
+      MMThreadGuard myLock(lock_);
+      int ret = SendCombined(batch, sent);
+      if (sent)
+         results.assign(batch.size(), ret);
+   }
+   for (unsigned i = 0; i < batch.size() && !sent; i++)
+   {
+      const QueuedCommand& c = batch[i];
+      results[i] = SendCommandNow(c.device, c.command, c.len, c.answerLen, c.shadowKey, c.shadowValue);
+   }
 
-   initialized_ = true;
+   for (unsigned i = 0; i < batch.size(); i++)
+   {
+      const QueuedCommand& queued = batch[i];
+      int ret = results[i];
+      if (ret != DEVICE_OK)
+         ArduinoLog::Write(ArduinoLog::Error, queued.device, "Queued command {} failed ({})",
+               (int) queued.command[0], ret);
+
+      MMThreadGuard guard(commandLock_);
+      if (ret != DEVICE_OK && commandErrors_.find(queued.device) == commandErrors_.end())
+         commandErrors_[queued.device] = ret;
+      if (--commandsPending_[queued.device] == 0)
+         commandsPending_.erase(queued.device);
+   }
+   commandSignal_.Notify();
+   return true;
+}
 
-   return DEVICE_OK;
+void CArduinoHub::WaitForAllCommands()
+{
+   for (;;)
+   {
+      unsigned long generation = commandSignal_.GetGeneration();
+      {
+         MMThreadGuard guard(commandLock_);
+         if (commandsPending_.empty())
+            return;
+      }
+      commandSignal_.Wait(generation, 100);
+   }
 }
 
-int CArduinoSwitch::Shutdown()
+bool CArduinoHub::IsCommandPending(const MM::Device* device)
 {
-   initialized_ = false;
-   return DEVICE_OK;
+   MMThreadGuard guard(commandLock_);
+   return commandsPending_.find(device) != commandsPending_.end();
 }
 
-int CArduinoSwitch::WriteToPort(long value)
+int CArduinoHub::WaitForCommands(const MM::Device* device)
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable()) {
-      return ERR_NO_PORT_SET;
+   for (;;)
+   {
+      unsigned long generation = commandSignal_.GetGeneration();
+      if (!IsCommandPending(device))
+         break;
+      commandSignal_.Wait(generation, 100);
    }
 
-   MMThreadGuard myLock(hub->GetLock());
-
-   value = 63 & value;
-   if (hub->IsLogicInverted())
-      value = ~value;
+   MMThreadGuard guard(commandLock_);
+   int ret = DEVICE_OK;
+   std::map<const MM::Device*, int>::iterator error = commandErrors_.find(device);
+   if (error != commandErrors_.end())
+   {
+      ret = error->second;
+      commandErrors_.erase(error);
+   }
+   return ret;
+}
 
-   hub->PurgeComPortH();
+int CArduinoHub::Transact(const unsigned char* command, unsigned len, unsigned char* answer, unsigned answerLen,
+      const MM::Device* caller)
+{
+   int ret = TransactOnce(command, len, answer, answerLen, caller);
+   for (unsigned attempt = 0; ret == ERR_COMMUNICATION && attempt < g_MaxResyncs; attempt++)
+   {
+      std::ostringstream os;
+      os << "Lost sync on command " << (int) command[0] << ", resynchronizing";
+      LogMessage(os.str().c_str(), false);
+      if (Resync() != DEVICE_OK)
+         return ERR_COMMUNICATION;
+      ret = TransactOnce(command, len, answer, answerLen, caller);
+      if (ret == DEVICE_OK)
+         linkRetries_++;
+   }
+   return ret;
+}
 
-   unsigned char command[2];
-   command[0] = 1;
-   command[1] = (unsigned char) value;
-   int ret = hub->WriteToComPortH((const unsigned char*) command, 2);
+int CArduinoHub::TransactOnce(const unsigned char* command, unsigned len, unsigned char* answer, unsigned answerLen,
+      const MM::Device* caller)
+{
+   PurgeComPort(port_.c_str());
+   int ret = WriteToComPortH(command, len, caller);
    if (ret != DEVICE_OK)
       return ret;
-
-   MM::MMTime startTime = GetCurrentMMTime();
-   unsigned long bytesRead = 0;
-   unsigned char answer[1];
-   while ((bytesRead < 1) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-      ret = hub->ReadFromComPortH(answer, 1, bytesRead);
-      if (ret != DEVICE_OK)
-         return ret;
-   }
-   if (answer[0] != 1)
+   ret = ReadNBytes(answerLen, answer, caller);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (answer[0] != command[0])
       return ERR_COMMUNICATION;
-
-   hub->SetTimedOutput(false);
-
    return DEVICE_OK;
 }
 
-int CArduinoSwitch::LoadSequence(unsigned size, unsigned char* seq)
+// Reads and drops whatever the board still sends, until it has been quiet
+// for 20 ms or for at most maxMs
+// Expects caller to guard the port
+void CArduinoHub::DrainComPort(long maxMs)
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable())
-      return ERR_NO_PORT_SET;
-
-   hub->PurgeComPortH();
-
-   for (unsigned i=0; i < size; i++)
+   PurgeComPort(port_.c_str());
+   MM::MMTime start = GetCurrentMMTime();
+   MM::MMTime lastByte = start;
+   unsigned char buffer[64];
+   while ((GetCurrentMMTime() - lastByte).getMsec() < 20 && (GetCurrentMMTime() - start).getMsec() < maxMs)
    {
-      unsigned char value = seq[i];
+      unsigned long bytesRead = 0;
+      if (ReadFromComPortH(buffer, sizeof(buffer), bytesRead) != DEVICE_OK)
+         break;
+      if (bytesRead > 0)
+         lastByte = GetCurrentMMTime();
+   }
+}
 
-      value = 63 & value;
-      if (hub->IsLogicInverted())
-         value = ~value;
+// Drains the port, identifies the board again (command 30) and sends the
+// written state of the shadow again, in case the board was reset.  The
+// outputs and blanking are left to a running sequence or timed output, and
+// the CS mode to a CS run, which command 50 would send back to its first row.
+// Expects caller to guard the port
+int CArduinoHub::Resync()
+{
+   linkResyncs_++;
+   MM::MMTime start = GetCurrentMMTime();
+   DrainComPort();
 
-      unsigned char command[3];
-      command[0] = 5;
-      command[1] = (unsigned char) i;
-      command[2] = value;
-      int ret = hub->WriteToComPortH((const unsigned char*) command, 3);
-      if (ret != DEVICE_OK)
-         return ret;
+   unsigned char command[4];
+   unsigned char answer[4];
+   std::string text;
+   command[0] = 30;
+   int ret = WriteToComPortH(command, 1);
+   if (ret == DEVICE_OK)
+      ret = GetSerialAnswerH(text);
+   if (ret == DEVICE_OK && text != "MM-Ard")
+      ret = ERR_BOARD_NOT_FOUND;
+
+   bool outputs = !timedOutputActive_ && !sequenceActive_;
+   long value;
+   if (ret == DEVICE_OK && outputs && GetShadow(shadowPattern, value))
+   {
+      command[0] = 1;
+      command[1] = (unsigned char) value;
+      ret = TransactOnce(command, 2, answer, 1, 0);
+   }
+   for (int channel = 0; channel < 2 && ret == DEVICE_OK && outputs; channel++)
+   {
+      if (!GetShadow(shadowDA1 + channel, value))
+         continue;
+      command[0] = 3;
+      command[1] = (unsigned char) channel;
+      command[2] = (unsigned char) (value / 256L);
+      command[3] = (unsigned char) (value & 255);
+      ret = TransactOnce(command, 4, answer, 4, 0);
+   }
+   if (ret == DEVICE_OK && outputs && GetShadow(shadowBlanking, value))
+   {
+      command[0] = value ? 20 : 21;
+      ret = TransactOnce(command, 1, answer, 1, 0);
+   }
+   if (ret == DEVICE_OK && outputs && GetShadow(shadowBlankOnLow, value))
+   {
+      command[0] = 22;
+      command[1] = (unsigned char) value;
+      ret = TransactOnce(command, 2, answer, 1, 0);
+   }
+   if (ret == DEVICE_OK && cs_firmware_ && GetShadow(shadowExposure, value))
+   {
+      command[0] = 52;
+      command[1] = (unsigned char) ((value >> 16) & 255);
+      command[2] = (unsigned char) ((value >> 8) & 255);
+      command[3] = (unsigned char) (value & 255);
+      ret = WriteToComPortH(command, 4);
+      if (ret == DEVICE_OK)
+         ret = GetSerialAnswerH(text);
+   }
+   if (ret == DEVICE_OK && cs_firmware_ && !csRunActive_ && GetShadow(shadowCSMode, value))
+   {
+      command[0] = 50;
+      command[1] = (unsigned char) value;
+      ret = WriteToComPortH(command, 2);
+      if (ret == DEVICE_OK)
+         ret = GetSerialAnswerH(text);
+      if (ret == DEVICE_OK && text != "2")
+         ret = ERR_COMMUNICATION;
+   }
 
+   std::ostringstream os;
+   if (ret != DEVICE_OK)
+   {
+      linkResyncFailures_++;
+      os << "Resynchronization failed (" << ret << "), the hardware configuration has to be reloaded";
+   }
+   else
+      os << "Resynchronized in " << (long) (GetCurrentMMTime() - start).getMsec() << " ms";
+   LogMessage(os.str().c_str(), false);
+   return ret;
+}
 
-      MM::MMTime startTime = GetCurrentMMTime();
-      unsigned long bytesRead = 0;
-      unsigned char answer[3];
-      while ((bytesRead < 3) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-         unsigned long br;
-         ret = hub->ReadFromComPortH(answer + bytesRead, 3, br);
+int CArduinoHub::OnShadowMaxAge(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(shadowMaxAgeMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      MMThreadGuard guard(shadowLock_);
+      pProp->Get(shadowMaxAgeMs_);
+   }
+   return DEVICE_OK;
+}
+
+void CArduinoHub::SetShadow(int key, long value)
+{
+   {
+      MMThreadGuard guard(shadowLock_);
+      shadow_[key].value = value;
+      shadow_[key].valid = true;
+      shadow_[key].time = GetCurrentMMTime();
+   }
+
+   // a recalled preset sets all the outputs it holds
+   if (key == shadowPreset && value >= 0 && value < numPresets && presets_[value].defined)
+   {
+      const ArduinoPreset& preset = presets_[value];
+      SetShadow(shadowPattern, preset.pattern);
+      SetShadow(shadowDA1, preset.da1);
+      SetShadow(shadowDA2, preset.da2);
+      SetShadow(shadowBlanking, preset.blanking ? 1 : 0);
+      SetShadow(shadowBlankOnLow, preset.blankOnLow ? 1 : 0);
+   }
+}
+
+int CArduinoHub::ReadPresets()
+{
+   for (unsigned i = 0; i < numPresets; i++)
+   {
+      unsigned char command[2];
+      command[0] = 18;
+      command[1] = (unsigned char) i;
+      unsigned char answer[8];
+      int ret = Transact(command, 2, answer, 8);
       if (ret != DEVICE_OK)
          return ret;
-      bytesRead += br;
-      }
-      if (answer[0] != 5)
+      if (answer[1] != i)
          return ERR_COMMUNICATION;
 
+      // the pattern is 255 in a preset never stored
+      ArduinoPreset& preset = presets_[i];
+      preset.defined = answer[2] != 255;
+      preset.pattern = answer[2];
+      preset.da1 = answer[3] * 256 + answer[4];
+      preset.da2 = answer[5] * 256 + answer[6];
+      preset.blanking = (answer[7] & 1) != 0;
+      preset.blankOnLow = (answer[7] & 2) != 0;
    }
+   return DEVICE_OK;
+}
 
-   unsigned char command[2];
-   command[0] = 6;
-   command[1] = (unsigned char) size;
-   int ret = hub->WriteToComPortH((const unsigned char*) command, 2);
+int CArduinoHub::StorePreset(unsigned index, const ArduinoPreset& preset)
+{
+   if (index >= numPresets)
+      return ERR_UNKNOWN_POSITION;
+
+   unsigned char command[8];
+   command[0] = 15;
+   command[1] = (unsigned char) index;
+   command[2] = (unsigned char) (preset.pattern & 63);
+   command[3] = (unsigned char) (preset.da1 / 256);
+   command[4] = (unsigned char) (preset.da1 & 255);
+   command[5] = (unsigned char) (preset.da2 / 256);
+   command[6] = (unsigned char) (preset.da2 & 255);
+   command[7] = (unsigned char) ((preset.blanking ? 1 : 0) | (preset.blankOnLow ? 2 : 0));
+   unsigned char answer[2];
+   int ret = Transact(command, 8, answer, 2);
    if (ret != DEVICE_OK)
       return ret;
-
-   MM::MMTime startTime = GetCurrentMMTime();
-   unsigned long bytesRead = 0;
-   unsigned char answer[2];
-   while ((bytesRead < 2) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-      unsigned long br;
-      ret = hub->ReadFromComPortH(answer + bytesRead, 2, br);
-      if (ret != DEVICE_OK)
-         return ret;
-      bytesRead += br;
-   }
-   if (answer[0] != 6)
+   if (answer[1] != index)
       return ERR_COMMUNICATION;
 
+   presets_[index] = preset;
+   presets_[index].defined = true;
+   presets_[index].pattern = command[2];
    return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Action handlers
-///////////////////////////////////////////////////////////////////////////////
+bool CArduinoHub::GetPreset(unsigned index, ArduinoPreset& preset)
+{
+   if (index >= numPresets || !presets_[index].defined)
+      return false;
+   preset = presets_[index];
+   return true;
+}
 
-int CArduinoSwitch::OnState(MM::PropertyBase* pProp, MM::ActionType eAct)
+void CArduinoHub::InvalidateShadow(int key)
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable())
-      return ERR_NO_PORT_SET;
+   MMThreadGuard guard(shadowLock_);
+   shadow_[key].valid = false;
+}
 
-   if (eAct == MM::BeforeGet)
+bool CArduinoHub::GetShadow(int key, long& value)
+{
+   MMThreadGuard guard(shadowLock_);
+   MM::MMTime now = GetCurrentMMTime();
+   ShadowEntry& entry = shadow_[key];
+   entry.lastRead = now;
+   // written state does not go stale, the board only changes it on command
+   bool input = key == shadowCSMode || key >= shadowDigitalInputs;
+   if (!entry.valid || (input && (now - entry.time).getMsec() > shadowMaxAgeMs_))
+      return false;
+   value = entry.value;
+   return true;
+}
+
+long CArduinoHub::GetShadowPeriodMs()
+{
+   MMThreadGuard guard(shadowLock_);
+   return (std::max)(shadowMaxAgeMs_ / 2, 50L);
+}
+
+// Reads again the inputs queried in the last 10 periods that are halfway to
+// stale.  Stays off the port during CS runs, sequences and timed output: any
+// byte sent then would stop them.
+void CArduinoHub::RevalidateShadow()
+{
+   if (csRunActive_ || timedOutputActive_ || sequenceActive_)
+      return;
+   std::vector<int> keys;
    {
-      // nothing to do, let the caller use cached property
+      MMThreadGuard guard(shadowLock_);
+      if (shadowMaxAgeMs_ <= 0)
+         return;
+      MM::MMTime now = GetCurrentMMTime();
+      for (int key = 0; key < shadowKeys; key++)
+      {
+         const ShadowEntry& entry = shadow_[key];
+         bool input = key == shadowCSMode || key >= shadowDigitalInputs;
+         if (input && entry.valid && (now - entry.lastRead).getMsec() < 10 * shadowMaxAgeMs_ &&
+               (now - entry.time).getMsec() > shadowMaxAgeMs_ / 2)
+            keys.push_back(key);
+      }
    }
-   else if (eAct == MM::AfterSet)
+   for (unsigned i = 0; i < keys.size(); i++)
    {
-      long pos;
-      pProp->Get(pos);
-      hub->SetSwitchState(pos);
-      if (hub->GetShutterState() > 0)
-         return WriteToPort(pos);
+      MMThreadGuard myLock(lock_);
+      long value;
+      unsigned char bits;
+      PurgeComPort(port_.c_str());
+      if (keys[i] == shadowCSMode)
+         ReadCSMode(value);
+      else if (keys[i] == shadowDigitalInputs)
+         ReadDigitalInputs(bits);
+      else
+         ReadAnalogInput(keys[i] - shadowAnalogInput0, value);
    }
-   else if (eAct == MM::IsSequenceable)                                      
-   {                                                                         
-      if (sequenceOn_)                                                       
-         pProp->SetSequenceable(NUMPATTERNS);                           
-      else                                                                   
-         pProp->SetSequenceable(0);                                          
-   } 
-   else if (eAct == MM::AfterLoadSequence)                                   
-   {                                                                         
-      std::vector<std::string> sequence = pProp->GetSequence();              
-      std::ostringstream os;
-      if (sequence.size() > NUMPATTERNS)                                
-         return DEVICE_SEQUENCE_TOO_LARGE;                                   
-      unsigned char* seq = new unsigned char[sequence.size()];               
-      for (unsigned int i=0; i < sequence.size(); i++)                       
-      {
-         std::istringstream os (sequence[i]);
-         int val;
-         os >> val;
-         seq[i] = (unsigned char) val;
-      }                                                                      
-      int ret = LoadSequence((unsigned) sequence.size(), seq);
-      if (ret != DEVICE_OK)                                                  
-         return ret;                                                         
-                                                                             
-      delete[] seq;                                                          
-   }                                                                         
-   else if (eAct == MM::StartSequence)
-   { 
-      MMThreadGuard myLock(hub->GetLock());
+}
 
-      hub->PurgeComPortH();
-      unsigned char command[1];
-      command[0] = 8;
-      int ret = hub->WriteToComPortH((const unsigned char*) command, 1);
-      if (ret != DEVICE_OK)
-         return ret;
+// Property value 0 when CS is on (answer 30), 1 when it is off (31)
+// Expects caller to guard the port
+int CArduinoHub::ReadCSMode(long& mode)
+{
+   unsigned char command[1];
+   command[0] = 51;
+   int ret = WriteToComPortH((const unsigned char*) command, 1);
+   if (ret != DEVICE_OK)
+      return ret;
 
-      MM::MMTime startTime = GetCurrentMMTime();
-      unsigned long bytesRead = 0;
-      unsigned char answer[1];
-      while ((bytesRead < 1) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-         unsigned long br;
-         ret = hub->ReadFromComPortH(answer + bytesRead, 1, br);
-         if (ret != DEVICE_OK)
-            return ret;
-         bytesRead += br;
-      }
-      if (answer[0] != 8)
-         return ERR_COMMUNICATION;
-   }
-   else if (eAct == MM::StopSequence)                                        
-   {
-      MMThreadGuard myLock(hub->GetLock());
+   std::string answer;
+   ret = GetSerialAnswerH(answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   ArduinoLog::Write(ArduinoLog::Debug, this, "CS mode answer: {}", answer);
 
-      unsigned char command[1];
-      command[0] = 9;
-      int ret = hub->WriteToComPortH((const unsigned char*) command, 1);
-      if (ret != DEVICE_OK)
-         return ret;
+   if (answer == "30")
+      mode = 0;
+   else if (answer == "31")
+      mode = 1;
+   else
+      return ERR_COMMUNICATION;
+   SetShadow(shadowCSMode, mode);
+   return DEVICE_OK;
+}
 
-      MM::MMTime startTime = GetCurrentMMTime();
-      unsigned long bytesRead = 0;
-      unsigned char answer[2];
-      while ((bytesRead < 2) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-         unsigned long br;
-         ret = hub->ReadFromComPortH(answer + bytesRead, 2, br);
-         if (ret != DEVICE_OK)
-            return ret;
-         bytesRead += br;
-      }
-      if (answer[0] != 9)
-         return ERR_COMMUNICATION;
+// State of all digital input pins (command 40)
+// Expects caller to guard the port
+int CArduinoHub::ReadDigitalInputs(unsigned char& bits, const MM::Device* caller)
+{
+   unsigned char command[1];
+   command[0] = 40;
+   unsigned char answer[2];
+   int ret = Transact(command, 1, answer, 2, caller);
+   if (ret != DEVICE_OK)
+      return ret;
 
-      std::ostringstream os;
-      os << "Sequence had " << (int) answer[1] << " transitions";
-      LogMessage(os.str().c_str(), false);
+   bits = answer[1];
+   SetShadow(shadowDigitalInputs, bits);
+   return DEVICE_OK;
+}
 
-   }                                                                         
+// Expects caller to guard the port
+int CArduinoHub::ReadAnalogInput(unsigned channel, long& value, const MM::Device* caller)
+{
+   unsigned char command[2];
+   command[0] = 41;
+   command[1] = (unsigned char) channel;
+   unsigned char answer[4];
+   int ret = Transact(command, 2, answer, 4, caller);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (answer[1] != channel)
+      return ERR_COMMUNICATION;
 
+   value = (answer[2] << 8) | answer[3];
+   SetShadow(shadowAnalogInput0 + channel, value);
    return DEVICE_OK;
 }
 
-int CArduinoSwitch::OnSequence(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CArduinoHub::OnLogLevel(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
    if (eAct == MM::BeforeGet)
    {
-      if (sequenceOn_)
-         pProp->Set(g_On);
-      else
-         pProp->Set(g_Off);
+      ArduinoLog::Level level = ArduinoLog::GetLevel();
+      pProp->Set(level == ArduinoLog::Debug ? g_LogLevelDebug : level == ArduinoLog::Info ? g_LogLevelInfo : g_LogLevelError);
    }
    else if (eAct == MM::AfterSet)
    {
-      std::string state;
-      pProp->Get(state);
-      if (state == g_On)
-         sequenceOn_ = true;
-      else
-         sequenceOn_ = false;
+      std::string level;
+      pProp->Get(level);
+      ArduinoLog::SetLevel(level == g_LogLevelDebug ? ArduinoLog::Debug : level == g_LogLevelInfo ? ArduinoLog::Info : ArduinoLog::Error);
    }
    return DEVICE_OK;
 }
 
-// Synchronize the "Running" property with the Arduino
-// -- Send command 12 when acquisition is running
-// -- Send command  9 when acquisition is Idle
-int CArduinoSwitch::OnStartTimedOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CArduinoHub::OnTrafficRecording(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable())
-      return ERR_NO_PORT_SET;
-
-   if (eAct == MM::BeforeGet) {
-      if (hub->IsTimedOutputActive())
-         pProp->Set("Running");
-      else
-         pProp->Set("Idle");
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(traffic_.IsOpen() ? g_On : g_Off);
    }
    else if (eAct == MM::AfterSet)
    {
-      MMThreadGuard myLock(hub->GetLock());
-
-      std::string prop;
-      pProp->Get(prop);
-
-      if (prop =="Start") {
-         hub->PurgeComPortH();
-         unsigned char command[1];
-         command[0] = 12;
-         int ret = hub->WriteToComPortH((const unsigned char*) command, 1);
+      std::string recording;
+      pProp->Get(recording);
+      MMThreadGuard myLock(lock_);
+      traffic_.Close();
+      trafficDevices_.clear();
+      if (recording == g_On)
+      {
+         char path[MM::MaxStrLength];
+         long capacity;
+         int ret = GetProperty("TrafficFile", path);
          if (ret != DEVICE_OK)
             return ret;
+         ret = GetProperty("TrafficRecordCapacity", capacity);
+         if (ret != DEVICE_OK)
+            return ret;
+         if (capacity <= 0)
+            return DEVICE_INVALID_PROPERTY_VALUE;
+         trafficStart_ = GetCurrentMMTime();
+         return traffic_.Open(path, (unsigned) capacity);
+      }
+   }
+   return DEVICE_OK;
+}
 
-         MM::MMTime startTime = GetCurrentMMTime();
-         unsigned long bytesRead = 0;
-         unsigned char answer[1];
-         while ((bytesRead < 1) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-            unsigned long br;
-            ret = hub->ReadFromComPortH(answer + bytesRead, 1, br);
-            if (ret != DEVICE_OK)
-               return ret;
-            bytesRead += br;
-         }
-         if (answer[0] != 12)
-            return ERR_COMMUNICATION;
-         hub->SetTimedOutput(true);
-      } else {
-         unsigned char command[1];
-         command[0] = 9;
-         int ret = hub->WriteToComPortH((const unsigned char*) command, 1);
-         if (ret != DEVICE_OK)
-            return ret;
+int CArduinoHub::OnTrafficRecordsWritten(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long) traffic_.GetNumberOfRecords());
+   }
+   return DEVICE_OK;
+}
 
-         MM::MMTime startTime = GetCurrentMMTime();
-         unsigned long bytesRead = 0;
-         unsigned char answer[2];
-         while ((bytesRead < 2) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-            unsigned long br;
-            ret = hub->ReadFromComPortH(answer + bytesRead, 2, br);
-            if (ret != DEVICE_OK)
-               return ret;
-            bytesRead += br;
-         }
-         if (answer[0] != 9)
-            return ERR_COMMUNICATION;
-         hub->SetTimedOutput(false);
+int CArduinoHub::OnTrafficReplay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::AfterSet)
+   {
+      std::string path;
+      pProp->Get(path);
+      if (path.empty())
+         return DEVICE_OK;
+      char writes[MM::MaxStrLength];
+      int ret = GetProperty("TrafficReplayWrites", writes);
+      if (ret != DEVICE_OK)
+         return ret;
+      MMThreadGuard myLock(lock_);
+      ret = ReplayTraffic(path, strcmp(writes, g_On) == 0, trafficReport_);
+      if (ret != DEVICE_OK)
+         return ret;
+      LogMessage("Traffic replay of " + path + ": " + trafficReport_, false);
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnTrafficReplayReport(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(trafficReport_.c_str());
+   }
+   return DEVICE_OK;
+}
+
+// Bank of bases stored in the firmware and the selected one (command 35).
+// Expects caller to guard the port
+int CArduinoHub::GetCSBases(std::vector<CSBasisInfo>& bases, unsigned& selected)
+{
+   unsigned char command[1];
+   command[0] = 35;
+   int ret = WriteToComPortH(command, 1);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   unsigned char answer[3];
+   ret = ReadNBytes(3, answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (answer[0] != 35 || answer[2] >= answer[1])
+      return ERR_COMMUNICATION;
+
+   bases.clear();
+   for (unsigned i = 0; i < answer[1]; i++)
+   {
+      unsigned char entry[9];
+      ret = ReadNBytes(9, entry);
+      if (ret != DEVICE_OK)
+         return ret;
+      CSBasisInfo info;
+      info.id = (int) (((unsigned long) entry[0] << 24) | (entry[1] << 16) | (entry[2] << 8) | entry[3]);
+      info.rows = (entry[4] << 8) | entry[5];
+      info.values = (entry[6] << 8) | entry[7];
+      info.encoding = entry[8];
+      info.shift = 0;
+      info.high = 0;
+      info.control = 0;
+      bases.push_back(info);
+   }
+   selected = answer[2];
+   return DEVICE_OK;
+}
+
+// Makes a basis of the bank the one played by the firmware (command 36)
+int CArduinoHub::SelectCSBasis(unsigned index)
+{
+   if (index >= csBases_.size())
+      return DEVICE_INVALID_PROPERTY_VALUE;
+   if (csRunActive_)
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   // the boards of a group hold slices of the same bank.  When one of them
+   // fails, the others go back to the basis they had.
+   std::vector<CArduinoHub*> followers;
+   GetCSGroupFollowers(followers);
+   std::vector<unsigned> previous;
+   int ret = DEVICE_OK;
+   for (unsigned i = 0; i < followers.size() && ret == DEVICE_OK; i++)
+   {
+      previous.push_back(followers[i]->csBasisIndex_);
+      ret = followers[i]->SelectCSBasis(index);
+      if (ret != DEVICE_OK)
+         previous.pop_back();
+   }
+
+   MMThreadGuard myLock(lock_);
+   unsigned char command[2];
+   command[0] = 36;
+   command[1] = (unsigned char) index;
+   unsigned char answer[2];
+   if (ret == DEVICE_OK)
+   {
+      PurgeComPort(port_.c_str());
+      ret = WriteToComPortH(command, 2);
+      if (ret == DEVICE_OK)
+         ret = ReadNBytes(2, answer);
+      if (ret == DEVICE_OK && (answer[0] != 36 || answer[1] != command[1]))
+         ret = ERR_COMMUNICATION;
+   }
+   if (ret != DEVICE_OK)
+   {
+      for (unsigned i = 0; i < previous.size(); i++)
+      {
+         MMThreadGuard followerLock(followers[i]->GetLock());
+         followers[i]->SelectCSBasis(previous[i]);
       }
+      return ret;
    }
 
+   csBasisIndex_ = index;
+   cs_basis_id_ = csBases_[index].id;
+   // the firmware starts again at the first row without playlist
+   csCurrentRow_ = 0;
+
+   std::ostringstream sbasis_id;
+   sbasis_id << cs_basis_id_;
+   OnPropertyChanged("CSBasisId", sbasis_id.str().c_str());
    return DEVICE_OK;
 }
 
-// Synchronize the Arduino wrt the blanking state
-// Uses command 20 to switch blanking On
-// Uses command 21 to switch blanking Off
-int CArduinoSwitch::OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct)
+std::string CArduinoHub::GetCSBasisLabel(unsigned index) const
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable())
-      return ERR_NO_PORT_SET;
+   std::ostringstream os;
+   os << index << ": id " << csBases_[index].id;
+   if (csBases_[index].rows > 0)
+      os << ", " << csBases_[index].rows << " x " << csBases_[index].values;
+   return os.str();
+}
 
-   if (eAct == MM::BeforeGet) {
-      if (blanking_)
-         pProp->Set(g_On);
-      else
-         pProp->Set(g_Off);
+// CRC-16/CCITT (polynomial 0x1021) as computed by the firmware
+static unsigned CRC16(unsigned crc, const unsigned char* data, unsigned n)
+{
+   for (unsigned i = 0; i < n; i++)
+   {
+      crc ^= (unsigned) data[i] << 8;
+      for (int b = 0; b < 8; b++)
+         crc = (crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1) & 0xFFFF;
    }
-   else if (eAct == MM::AfterSet)
+   return crc;
+}
+
+// Reads chunks first to first + count - 1 (all the remaining ones for count 0)
+// of a stored basis with command 37.  The header goes to info, data is sized
+// on the first call and received marks the chunks whose CRC was right.
+// Expects caller to guard the port
+int CArduinoHub::ReadCSBasisChunks(unsigned index, unsigned first, unsigned count, CSBasisInfo& info,
+      std::vector<unsigned char>& data, std::vector<bool>& received)
+{
+   unsigned char command[6];
+   command[0] = 37;
+   command[1] = (unsigned char) index;
+   command[2] = (unsigned char) (first >> 8);
+   command[3] = (unsigned char) (first & 255);
+   command[4] = (unsigned char) (count >> 8);
+   command[5] = (unsigned char) (count & 255);
+   int ret = WriteToComPortH(command, 6);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   unsigned char header[20];
+   ret = ReadNBytes(20, header);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (header[0] != 37 || header[19] == 0)
+      return ERR_COMMUNICATION;
+   info.rows = (header[1] << 8) | header[2];
+   info.values = (header[3] << 8) | header[4];
+   info.encoding = header[5];
+   info.shift = header[6];
+   info.high = (header[7] << 8) | header[8];
+   info.control = (header[9] << 8) | header[10];
+   info.id = (int) (((unsigned long) header[11] << 24) | (header[12] << 16) | (header[13] << 8) | header[14]);
+   unsigned long size = ((unsigned long) header[15] << 24) | (header[16] << 16) | (header[17] << 8) | header[18];
+   unsigned chunkSize = header[19];
+   unsigned nChunks = (unsigned) ((size + chunkSize - 1) / chunkSize);
+   if (data.size() != size) {
+      data.assign(size, 0);
+      received.assign(nChunks, false);
+   }
+   if (first > nChunks)
+      return ERR_COMMUNICATION;
+   if (count == 0 || count > nChunks - first)
+      count = nChunks - first;
+
+   std::vector<unsigned char> chunk(chunkSize + 4);
+   for (unsigned k = first; k < first + count; k++)
    {
-      MMThreadGuard myLock(hub->GetLock());
+      unsigned n = (unsigned) std::min<unsigned long>(chunkSize, size - (unsigned long) k * chunkSize);
+      ret = ReadNBytes(n + 4, &chunk[0]);
+      if (ret != DEVICE_OK)
+         return ret;
+      // after lost bytes the rest of the stream is out of step
+      if ((unsigned) ((chunk[0] << 8) | chunk[1]) != k)
+         return ERR_COMMUNICATION;
+      unsigned crc = (chunk[n + 2] << 8) | chunk[n + 3];
+      if (CRC16(0xFFFF, &chunk[0], n + 2) == crc)
+      {
+         memcpy(&data[(size_t) k * chunkSize], &chunk[2], n);
+         received[k] = true;
+      }
+   }
+   return DEVICE_OK;
+}
 
-      std::string prop;
-      pProp->Get(prop);
+// Reads back a basis of the bank at the full rate of the serial link.  The
+// chunks that arrive damaged are requested again one by one.
+int CArduinoHub::ReadCSBasis(unsigned index, unsigned& rows, unsigned& values, std::vector<double>& codes)
+{
+   if (!cs_firmware_ || version_ < g_BasisBankVersion)
+      return DEVICE_UNSUPPORTED_COMMAND;
+   if (index >= csBases_.size())
+      return DEVICE_INVALID_PROPERTY_VALUE;
 
-      if (prop == g_On && !blanking_) {
-         hub->PurgeComPortH();
-         unsigned char command[1];
-         command[0] = 20;
-         int ret = hub->WriteToComPortH((const unsigned char*) command, 1);
+   MMThreadGuard myLock(lock_);
+   CSBasisInfo info;
+   std::vector<unsigned char> data;
+   std::vector<bool> received;
+   PurgeComPort(port_.c_str());
+   int ret = ReadCSBasisChunks(index, 0, 0, info, data, received);
+   // the whole basis at 57600 baud (10 bits per byte), with some margin
+   long streamMs = 500 + (long) (data.size() / 5);
+   for (int attempt = 0; attempt < 3; attempt++)
+   {
+      if (ret != DEVICE_OK && received.empty())
+         return ret;
+      // the firmware streams on after a broken chunk, it is asked again
+      // once the line is quiet
+      if (ret != DEVICE_OK)
+         DrainComPort(streamMs);
+      ret = DEVICE_OK;
+      for (unsigned k = 0; k < received.size() && ret == DEVICE_OK; k++)
+      {
+         if (received[k])
+            continue;
+         ret = ReadCSBasisChunks(index, k, 1, info, data, received);
          if (ret != DEVICE_OK)
-            return ret;
+            DrainComPort(streamMs);
+      }
+   }
+   if (ret != DEVICE_OK)
+      return ret;
+   for (unsigned k = 0; k < received.size(); k++)
+   {
+      if (!received[k])
+         return ERR_COMMUNICATION;
+   }
 
-         MM::MMTime startTime = GetCurrentMMTime();
-         unsigned long bytesRead = 0;
-         unsigned char answer[1];
-         while ((bytesRead < 1) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-            unsigned long br;
-            ret = hub->ReadFromComPortH(answer + bytesRead, 1, br);
-            if (ret != DEVICE_OK)
-               return ret;
-            bytesRead += br;
-         }
-         if (answer[0] != 20)
-            return ERR_COMMUNICATION;
-         blanking_ = true;
-         hub->SetTimedOutput(false);
-         LogMessage("Switched blanking on", true);
+   // decoded as the firmware does before writing to the DAC
+   rows = info.rows;
+   values = info.values;
+   size_t rowBytes = info.encoding == 1 ? (values + 7) / 8 : values * (info.encoding / 8);
+   if (rowBytes * rows > data.size())
+      return ERR_COMMUNICATION;
+   codes.resize((size_t) rows * values);
+   for (unsigned r = 0; r < rows; r++)
+   {
+      const unsigned char* row = &data[r * rowBytes];
+      for (unsigned i = 0; i < values; i++)
+      {
+         unsigned word;
+         if (info.encoding == 1)
+            word = (row[i >> 3] >> (i & 7)) & 1 ? info.high : info.control;
+         else if (info.encoding == 8)
+            word = (row[i] << info.shift) | info.control;
+         else
+            word = row[2 * i] | (row[2 * i + 1] << 8);
+         codes[(size_t) r * values + i] = word & 0x0FFF;
+      }
+   }
 
-      } else if (prop == g_Off && blanking_){
-         unsigned char command[1];
-         command[0] = 21;
-         int ret = hub->WriteToComPortH((const unsigned char*) command, 1);
-         if (ret != DEVICE_OK)
-            return ret;
+   std::ostringstream os;
+   os << "Read back CS basis " << index << " (" << rows << " x " << values << ", " << data.size() << " bytes)";
+   LogMessage(os.str().c_str(), true);
+   return DEVICE_OK;
+}
 
-         MM::MMTime startTime = GetCurrentMMTime();
-         unsigned long bytesRead = 0;
-         unsigned char answer[2];
-         while ((bytesRead < 2) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-            unsigned long br;
-            ret = hub->ReadFromComPortH(answer + bytesRead, 2, br);
-            if (ret != DEVICE_OK)
-               return ret;
-            bytesRead += br;
+bool CArduinoHub::SupportsDeviceDetection(void)
+{
+   return true;
+}
+
+MM::DeviceDetectionStatus CArduinoHub::DetectDevice(void)
+{
+   if (initialized_)
+      return MM::CanCommunicate;
+
+   // all conditions must be satisfied...
+   MM::DeviceDetectionStatus result = MM::Misconfigured;
+   char answerTO[MM::MaxStrLength];
+   
+   try
+   {
+      std::string portLowerCase = port_;
+      for( std::string::iterator its = portLowerCase.begin(); its != portLowerCase.end(); ++its)
+      {
+         *its = (char)tolower(*its);
+      }
+      if( 0< portLowerCase.length() &&  0 != portLowerCase.compare("undefined")  && 0 != portLowerCase.compare("unknown") )
+      {
+         result = MM::CanNotCommunicate;
+         // record the default answer time out
+         GetCoreCallback()->GetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
+
+         // device specific default communication parameters
+         // for Arduino Duemilanova
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_Handshaking, g_Off);
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, "57600" );
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_StopBits, "1");
+         // Arduino timed out in GetControllerVersion even if AnswerTimeout  = 300 ms
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", "500.0");
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "DelayBetweenCharsMs", "0");
+         MM::Device* pS = GetCoreCallback()->GetDevice(this, port_.c_str());
+         pS->Initialize();
+         // The first second or so after opening the serial port, the Arduino is waiting for firmwareupgrades.  Simply sleep 2 seconds.
+         CDeviceUtils::SleepMs(2000);
+         MMThreadGuard myLock(lock_);
+         PurgeComPort(port_.c_str());
+         int v = 0;
+         int ret = GetControllerVersion(v);
+         // later, Initialize will explicitly check the version #
+         if( DEVICE_OK != ret )
+         {
+            LogMessageCode(ret,true);
          }
-         if (answer[0] != 21)
-            return ERR_COMMUNICATION;
-         blanking_ = false;
-         hub->SetTimedOutput(false);
-         LogMessage("Switched blanking off", true);
+         else
+         {
+            // to succeed must reach here....
+            result = MM::CanCommunicate;
+         }
+         pS->Shutdown();
+         // always restore the AnswerTimeout to the default
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
+
+      }
+   }
+   catch(...)
+   {
+      LogMessage("Exception in DetectDevice!",false);
+   }
+
+   return result;
+}
+
+
+int CArduinoHub::Initialize()
+{
+   // Name
+   int ret = CreateProperty(MM::g_Keyword_Name, g_DeviceNameArduinoHub, MM::String, true);
+   if (DEVICE_OK != ret)
+      return ret;
+
+   // The first second or so after opening the serial port, the Arduino is waiting for firmwareupgrades.  Simply sleep 1 second.
+   CDeviceUtils::SleepMs(2000);
+
+   MMThreadGuard myLock(lock_);
+
+   // Check that we have a controller:
+   PurgeComPort(port_.c_str());
+   ret = GetControllerVersion(version_);
+   if( DEVICE_OK != ret)
+      return ret;
+
+   if (version_ < g_Min_MMVersion || version_ > g_Max_MMVersion)
+      return ERR_VERSION_MISMATCH;
+
+   CPropertyAction* pAct = new CPropertyAction(this, &CArduinoHub::OnVersion);
+   std::ostringstream sversion;
+   sversion << version_;
+   CreateProperty(g_versionProp, sversion.str().c_str(), MM::Integer, true, pAct);
+   
+    // Test if the controller accepts compressed sensing
+    if (version_ >= cs_version_allowed_) {
+        ret = GetCSMode(cs_firmware_);
+        if( DEVICE_OK != ret)
+            return ret;       
+    }
+   
+    // CS enabled property
+    if (cs_firmware_) {
+        // CS Mode
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSOnOff);
+        CreateProperty("Compressed sensing", "0", MM::Integer, false, pAct, false);
+        
+        // TODOCreate new property here
+        pAct = new CPropertyAction(this, &CArduinoHub::OnExposureChanged);
+        CreateProperty("Arduino Exposure", "1", MM::Integer, false, pAct, false);
+
+        // Exposure (ms) of each basis row, uploaded in one go
+        pAct = new CPropertyAction(this, &CArduinoHub::OnExposureTable);
+        CreateProperty("CSExposureTable", "", MM::String, false, pAct, false);
+
+        // Hardware triggered run: the camera trigger advances the basis row
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSRun);
+        CreateProperty("CSRun", g_Off, MM::String, false, pAct, false);
+        AddAllowedValue("CSRun", g_On);
+        AddAllowedValue("CSRun", g_Off);
+
+        // Basis row(s) to play: a single row, or a sequence uploaded as playlist
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSRow);
+        CreateProperty("CSRow", "0", MM::Integer, false, pAct, false);
+
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSCurrentRow);
+        CreateProperty("CSCurrentRow", "0", MM::Integer, true, pAct);
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSRowsCompleted);
+        CreateProperty("CSRowsCompleted", "0", MM::Integer, true, pAct);
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSMissedTriggers);
+        CreateProperty("CSMissedTriggers", "0", MM::Integer, true, pAct);
+
+        // Time (us) from the trigger to the first value of a row on the DAC
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSRowUpdateTime);
+        CreateProperty("CSRowUpdateTime", "0", MM::Integer, true, pAct);
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSRowUpdateTimeMax);
+        CreateProperty("CSRowUpdateTimeMax", "0", MM::Integer, true, pAct);
+        
+        CreateProperty("CSEnabled", "true", MM::String, true);
+    } else {
+        CreateProperty("CSEnabled", "false", MM::String, true);
+    }
+        
+    // Get basis id (hashCode)
+    if (cs_firmware_) {
+        // Check the basis Id here
+        GetCSBasisId(cs_basis_id_);
+
+        // Bases stored in the firmware, firmware without a bank has only one
+        if (version_ < g_BasisBankVersion || GetCSBases(csBases_, csBasisIndex_) != DEVICE_OK || csBases_.empty()) {
+           PurgeComPort(port_.c_str());
+           CSBasisInfo info;
+           info.id = cs_basis_id_;
+           info.rows = 0;
+           info.values = 0;
+           info.encoding = 0;
+           info.shift = 0;
+           info.high = 0;
+           info.control = 0;
+           csBases_.assign(1, info);
+           csBasisIndex_ = 0;
+        }
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSBasis);
+        CreateProperty("CSBasis", GetCSBasisLabel(csBasisIndex_).c_str(), MM::String, false, pAct, false);
+        for (unsigned i = 0; i < csBases_.size(); i++)
+           AddAllowedValue("CSBasis", GetCSBasisLabel(i).c_str());
+
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSBasisId);
+        std::ostringstream sbasis_id;
+        sbasis_id << cs_basis_id_;
+        CreateProperty("CSBasisId", sbasis_id.str().c_str(), MM::Integer, true, pAct);
+
+        // Boards with the same CSGroup play one basis, each its own elements
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSGroup);
+        CreateProperty("CSGroup", "", MM::String, false, pAct);
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSGroupRole);
+        CreateProperty("CSGroupRole", "Leader", MM::String, false, pAct);
+        AddAllowedValue("CSGroupRole", "Leader");
+        AddAllowedValue("CSGroupRole", "Follower");
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSGroupOffset);
+        CreateProperty("CSGroupOffset", "0", MM::Integer, false, pAct);
+        pAct = new CPropertyAction(this, &CArduinoHub::OnCSGroupSyncErrors);
+        CreateProperty("CSGroupSyncErrors", "0", MM::Integer, true, pAct);
+
+        MMThreadGuard hubsLock(csHubsLock_);
+        csHubs_.push_back(this);
+    }
+
+    // Firmware counters, see OnTelemetry
+    if (HasOutputCommands()) {
+        const char* telemetry[] = {"TelemetryTriggers", "TelemetryPatternAdvances", "TelemetryMissedEdges",
+              "TelemetryLoopTimeMax", "TelemetrySerialBytesIn", "TelemetrySerialBytesOut",
+              "TelemetryLoopTimeHistogram"};
+        for (long i = 0; i < 7; i++) {
+            CPropertyActionEx* pExAct = new CPropertyActionEx(this, &CArduinoHub::OnTelemetry, i);
+            CreateProperty(telemetry[i], i < 6 ? "0" : "", i < 6 ? MM::Integer : MM::String, true, pExAct);
+        }
+    }
+
+   // Host side latency of the commands sent, per opcode (us)
+   pAct = new CPropertyAction(this, &CArduinoHub::OnLatencyCommand);
+   CreateProperty("LatencyCommand", "0", MM::Integer, false, pAct);
+   SetPropertyLimits("LatencyCommand", 0, 255);
+   const char* latency[] = {"LatencyCount", "LatencyTimeouts", "LatencyP50", "LatencyP99", "LatencyMax"};
+   for (long i = 0; i < 5; i++) {
+      CPropertyActionEx* pExAct = new CPropertyActionEx(this, &CArduinoHub::OnLatency, i);
+      CreateProperty(latency[i], "0", MM::Integer, true, pExAct);
+   }
+   CPropertyActionEx* pExAct = new CPropertyActionEx(this, &CArduinoHub::OnLatency, 5);
+   CreateProperty("LatencySummary", "", MM::String, true, pExAct);
+   pAct = new CPropertyAction(this, &CArduinoHub::OnLatencyReset);
+   CreateProperty("LatencyReset", "Idle", MM::String, false, pAct);
+   AddAllowedValue("LatencyReset", "Idle");
+   AddAllowedValue("LatencyReset", "Reset");
+
+   // Recording of the bytes exchanged with the board into a ring file, and
+   // their replay against the board (commands that read it only, unless
+   // TrafficReplayWrites is On)
+   CreateProperty("TrafficFile", "", MM::String, false);
+   CreateProperty("TrafficRecordCapacity", "65536", MM::Integer, false);
+   pAct = new CPropertyAction(this, &CArduinoHub::OnTrafficRecording);
+   CreateProperty("TrafficRecording", g_Off, MM::String, false, pAct);
+   AddAllowedValue("TrafficRecording", g_Off);
+   AddAllowedValue("TrafficRecording", g_On);
+   pAct = new CPropertyAction(this, &CArduinoHub::OnTrafficRecordsWritten);
+   CreateProperty("TrafficRecordsWritten", "0", MM::Integer, true, pAct);
+   CreateProperty("TrafficReplayWrites", g_Off, MM::String, false);
+   AddAllowedValue("TrafficReplayWrites", g_Off);
+   AddAllowedValue("TrafficReplayWrites", g_On);
+   pAct = new CPropertyAction(this, &CArduinoHub::OnTrafficReplay);
+   CreateProperty("TrafficReplay", "", MM::String, false, pAct);
+   pAct = new CPropertyAction(this, &CArduinoHub::OnTrafficReplayReport);
+   CreateProperty("TrafficReplayReport", "", MM::String, true, pAct);
+
+   // Messages of the hot paths, formatted on a background thread
+   pAct = new CPropertyAction(this, &CArduinoHub::OnLogLevel);
+   CreateProperty("LogLevel", g_LogLevelInfo, MM::String, false, pAct);
+   AddAllowedValue("LogLevel", g_LogLevelDebug);
+   AddAllowedValue("LogLevel", g_LogLevelInfo);
+   AddAllowedValue("LogLevel", g_LogLevelError);
+
+   // Property reads of the board state are served from the shadow of the hub
+   pAct = new CPropertyAction(this, &CArduinoHub::OnShadowMaxAge);
+   CreateProperty("ShadowMaxAge", "1000", MM::Integer, false, pAct);
+   SetPropertyLimits("ShadowMaxAge", 0, 60000);
+
+   // Recovery of the serial link after lost or stray bytes
+   const char* link[] = {"LinkResyncs", "LinkResyncFailures", "LinkRetriedCommands"};
+   for (long i = 0; i < 3; i++) {
+      CPropertyActionEx* pExAct = new CPropertyActionEx(this, &CArduinoHub::OnLinkCounter, i);
+      CreateProperty(link[i], "0", MM::Integer, true, pExAct);
+   }
+
+   // Queue the commands of the switch, shutter and DA devices, so that they
+   // return before the board answered
+   pAct = new CPropertyAction(this, &CArduinoHub::OnAsyncCommands);
+   CreateProperty("AsyncCommands", g_Off, MM::String, false, pAct);
+   AddAllowedValue("AsyncCommands", g_Off);
+   AddAllowedValue("AsyncCommands", g_On);
+
+   // Collect the device commands between Begin and Commit and apply them at
+   // once on the board
+   pAct = new CPropertyAction(this, &CArduinoHub::OnTransaction);
+   CreateProperty("Transaction", g_TransactionCommit, MM::String, false, pAct);
+   AddAllowedValue("Transaction", g_TransactionBegin);
+   AddAllowedValue("Transaction", g_TransactionCommit);
+
+   ret = UpdateStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // turn off verbose serial debug messages
+   // GetCoreCallback()->SetDeviceProperty(port_.c_str(), "Verbose", "0");
+
+   ArduinoLog::Start(GetCoreCallback(), this);
+   shadowThread_ = new ArduinoShadowThread(*this);
+   shadowThread_->Start();
+   commandThread_ = new ArduinoCommandThread(*this);
+   commandThread_->Start();
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int CArduinoHub::DetectInstalledDevices()
+{
+   if (MM::CanCommunicate == DetectDevice()) 
+   {
+      std::vector<std::string> peripherals; 
+      peripherals.clear();
+      peripherals.push_back(g_DeviceNameArduinoSwitch);
+      peripherals.push_back(g_DeviceNameArduinoShutter);
+      peripherals.push_back(g_DeviceNameArduinoInput);
+      peripherals.push_back(g_DeviceNameArduinoPresets);
+      peripherals.push_back(g_DeviceNameArduinoDA1);
+      peripherals.push_back(g_DeviceNameArduinoDA2);
+      peripherals.push_back(g_DeviceNameArduinoCSProcessor);
+      for (size_t i=0; i < peripherals.size(); i++) 
+      {
+         MM::Device* pDev = ::CreateDevice(peripherals[i].c_str());
+         if (pDev) 
+         {
+            AddInstalledDevice(pDev);
+         }
+      }
+   }
+
+   return DEVICE_OK;
+}
+
+int CArduinoHub::Shutdown()
+{
+   // sends what is still queued
+   if (commandThread_ != 0) {
+      delete commandThread_;
+      commandThread_ = 0;
+   }
+   if (csThread_ != 0) {
+      delete csThread_;
+      csThread_ = 0;
+   }
+   {
+      MMThreadGuard hubsLock(csHubsLock_);
+      csHubs_.erase(std::remove(csHubs_.begin(), csHubs_.end(), this), csHubs_.end());
+   }
+   {
+      MMThreadGuard myLock(lock_);
+      traffic_.Close();
+   }
+   if (shadowThread_ != 0) {
+      delete shadowThread_;
+      shadowThread_ = 0;
+   }
+   if (initialized_)
+      ArduinoLog::Stop(this);
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnPort(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(port_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(port_);
+      portAvailable_ = true;
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnVersion(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set((long)version_);
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnLogic(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      if (invertedLogic_)
+         pProp->Set(g_invertedLogicString);
+      else
+         pProp->Set(g_normalLogicString);
+   } else if (pAct == MM::AfterSet)
+   {
+      std::string logic;
+      pProp->Get(logic);
+      if (logic.compare(g_invertedLogicString)==0)
+         invertedLogic_ = true;
+      else invertedLogic_ = false;
+   }
+   return DEVICE_OK;
+}
+
+/* Should set the exposure property to the Arduino */
+int CArduinoHub::OnExposureChanged(MM::PropertyBase* pProp, MM::ActionType eAct) {
+    if (eAct == MM::AfterSet) { // If the property is being edited, send the new value to the Arduino 
+        long cson;
+        pProp->Get(cson);    
+        ArduinoLog::Write(ArduinoLog::Debug, this, "Exposure modified: {}", cson);
+        long previous = 0;
+        bool known = GetShadow(shadowExposure, previous);
+        int ret = SendExposure(cson);
+        if (ret != DEVICE_OK)
+            return ret;
+
+        // a group gets the same exposure, or keeps the one it had
+        std::ostringstream ss;
+        ss << cson;
+        std::vector<CArduinoHub*> followers;
+        GetCSGroupFollowers(followers);
+        std::vector<std::string> followerPrevious;
+        for (unsigned i = 0; i < followers.size(); i++) {
+            char value[MM::MaxStrLength];
+            followers[i]->GetProperty("Arduino Exposure", value);
+            ret = followers[i]->SetProperty("Arduino Exposure", ss.str().c_str());
+            if (ret != DEVICE_OK) {
+                for (unsigned j = 0; j < followerPrevious.size(); j++)
+                    followers[j]->SetProperty("Arduino Exposure", followerPrevious[j].c_str());
+                if (known && SendExposure(previous) == DEVICE_OK)
+                    pProp->Set(previous);
+                return ret;
+            }
+            followerPrevious.push_back(value);
+        }
+    }
+    return DEVICE_OK;
+}
+
+// Sets the exposure over which a basis row is played (command 52)
+int CArduinoHub::SendExposure(long exposureMs)
+{
+   MMThreadGuard myLock(lock_);
+   unsigned char command[4];
+   command[0] = 52;
+   command[1] = (unsigned char) ((exposureMs >> 16) & 255);
+   command[2] = (unsigned char) ((exposureMs >> 8) & 255);
+   command[3] = (unsigned char) (exposureMs & 255);
+   int ret = WriteToComPortH(command, 4);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // the answer is 4 followed by the exposure
+   std::string answer;
+   ret = GetSerialAnswerH(answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   ArduinoLog::Write(ArduinoLog::Debug, this, "Exposure answer: {}", answer);
+   std::ostringstream expected;
+   expected << "4" << exposureMs;
+   if (answer != expected.str())
+      return ERR_COMMUNICATION;
+   SetShadow(shadowExposure, exposureMs);
+   return DEVICE_OK;
+}
+
+// Reads n bytes of a binary answer, gives up after 500 ms
+// Expects caller to guard the port
+int CArduinoHub::ReadNBytes(unsigned int n, unsigned char* answer, const MM::Device* caller)
+{
+   MM::MMTime startTime = GetCurrentMMTime();
+   unsigned long bytesRead = 0;
+   while ((bytesRead < n) && ( (GetCurrentMMTime() - startTime).getMsec() < 500)) {
+      unsigned long bR;
+      int ret = ReadFromComPortH(answer + bytesRead, n - bytesRead, bR, caller);
+      if (ret != DEVICE_OK)
+         return ret;
+      bytesRead += bR;
+   }
+   if (bytesRead < n)
+   {
+      RecordTimeout();
+      return ERR_COMMUNICATION;
+   }
+
+   return DEVICE_OK;
+}
+
+// A command is timed from its write to the first bytes of its answer.  A
+// command still waiting for its answer when the next one is sent timed out.
+// Expects caller to guard the port
+int CArduinoHub::WriteToComPortH(const unsigned char* command, unsigned len, const MM::Device* caller)
+{
+   if (latencyOpcode_ >= 0)
+      RecordTimeout();
+   if (len > 0)
+   {
+      latencyOpcode_ = command[0];
+      latencyStart_ = GetCurrentMMTime();
+   }
+   if (traffic_.IsOpen())
+      RecordTraffic(ArduinoTrafficRecord::hostToBoard, caller, command, len);
+   return WriteToComPort(port_.c_str(), command, len);
+}
+
+int CArduinoHub::ReadFromComPortH(unsigned char* answer, unsigned maxLen, unsigned long& bytesRead, const MM::Device* caller)
+{
+   int ret = ReadFromComPort(port_.c_str(), answer, maxLen, bytesRead);
+   if (ret == DEVICE_OK && bytesRead > 0 && latencyOpcode_ >= 0)
+      RecordAnswer();
+   if (ret == DEVICE_OK && bytesRead > 0 && traffic_.IsOpen())
+      RecordTraffic(ArduinoTrafficRecord::boardToHost, caller, answer, bytesRead);
+   return ret;
+}
+
+int CArduinoHub::GetSerialAnswerH(std::string& answer, const MM::Device* caller)
+{
+   int ret = GetSerialAnswer(port_.c_str(), "\r\n", answer);
+   if (ret == DEVICE_OK && traffic_.IsOpen())
+   {
+      std::string line = answer + "\r\n";
+      RecordTraffic(ArduinoTrafficRecord::boardToHost, caller, (const unsigned char*) line.c_str(), (unsigned long) line.size());
+   }
+   if (latencyOpcode_ >= 0)
+   {
+      if (ret == DEVICE_OK)
+         RecordAnswer();
+      else
+         RecordTimeout();
+   }
+   return ret;
+}
+
+void CArduinoHub::RecordAnswer()
+{
+   MM::MMTime elapsed = GetCurrentMMTime() - latencyStart_;
+   double us = elapsed.getUsec();
+   latency_.Record((unsigned char) latencyOpcode_, us > 0 ? (unsigned long) us : 0);
+   latencyOpcode_ = -1;
+}
+
+void CArduinoHub::RecordTimeout()
+{
+   if (latencyOpcode_ >= 0)
+      latency_.RecordTimeout((unsigned char) latencyOpcode_);
+   latencyOpcode_ = -1;
+}
+
+void CArduinoHub::RecordTraffic(unsigned char direction, const MM::Device* caller,
+      const unsigned char* data, unsigned long length)
+{
+   if (caller == 0)
+      caller = this;
+   unsigned char device;
+   std::map<const MM::Device*, unsigned char>::iterator it = trafficDevices_.find(caller);
+   if (it != trafficDevices_.end())
+      device = it->second;
+   else
+   {
+      char label[MM::MaxStrLength];
+      label[0] = 0;
+      caller->GetLabel(label);
+      device = traffic_.GetDeviceIndex(label);
+      trafficDevices_[caller] = device;
+   }
+   double us = (GetCurrentMMTime() - trafficStart_).getUsec();
+   traffic_.Record(us > 0 ? (unsigned long long) us : 0, direction, device, data, length);
+}
+
+// True when the bytes hold only commands that read the state of the board:
+// 2, 13, 18, 30, 31, 33 to 35, 37, 40, 41, 51, 56 and 59
+static bool IsReadOnlyTraffic(const std::vector<unsigned char>& command)
+{
+   size_t i = 0;
+   while (i < command.size())
+   {
+      switch (command[i])
+      {
+         case 2: case 13: case 30: case 31: case 33: case 34: case 35:
+         case 40: case 51: case 56: case 59:
+            i += 1;
+            break;
+         case 18: case 41:
+            i += 2;
+            break;
+         case 37:
+            i += 6;
+            break;
+         default:
+            return false;
+      }
+   }
+   return i == command.size();
+}
+
+// Sends the commands of a recording again, with their original spacing, and
+// compares the answers and the time to their first byte with the recording.
+// A recording cut by the ring starts with the first whole command.  Commands
+// that change the board are skipped unless writes is set, as the board may be
+// driving the instrument by now.
+// Expects caller to guard the port
+int CArduinoHub::ReplayTraffic(const std::string& path, bool writes, std::string& report)
+{
+   ArduinoTrafficReader reader;
+   int ret = reader.Open(path);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   const unsigned n = reader.GetNumberOfRecords();
+   ArduinoTrafficRecord record;
+   unsigned i = 0;
+   for (; i < n; i++)
+   {
+      reader.GetRecord(i, record);
+      if (record.direction == ArduinoTrafficRecord::hostToBoard && !(record.flags & ArduinoTrafficRecord::continued))
+         break;
+   }
+
+   unsigned commands = 0, skipped = 0, answered = 0, differing = 0, missing = 0;
+   double recordedUs = 0.0, replayedUs = 0.0, worstUs = 0.0;
+   int worstOpcode = -1;
+   unsigned long long firstUs = 0;
+   MM::MMTime start = GetCurrentMMTime();
+   while (i < n)
+   {
+      std::vector<unsigned char> command, expected;
+      unsigned long long commandUs = 0, answerUs = 0;
+      for (; i < n; i++)
+      {
+         reader.GetRecord(i, record);
+         if (record.direction != ArduinoTrafficRecord::hostToBoard)
+            break;
+         commandUs = record.timeUs;
+         command.insert(command.end(), record.data, record.data + record.length);
+      }
+      for (; i < n; i++)
+      {
+         reader.GetRecord(i, record);
+         if (record.direction != ArduinoTrafficRecord::boardToHost)
+            break;
+         if (expected.empty())
+            answerUs = record.timeUs;
+         expected.insert(expected.end(), record.data, record.data + record.length);
+      }
+      if (command.empty())
+         continue;
+      if (!writes && !IsReadOnlyTraffic(command))
+      {
+         skipped++;
+         continue;
+      }
+
+      if (commands == 0)
+         firstUs = commandUs;
+      double dueMs = (commandUs - firstUs) / 1000.0;
+      double elapsedMs = (GetCurrentMMTime() - start).getMsec();
+      if (dueMs > elapsedMs)
+         CDeviceUtils::SleepMs((long) (dueMs - elapsedMs));
+
+      PurgeComPort(port_.c_str());
+      MM::MMTime sent = GetCurrentMMTime();
+      ret = WriteToComPortH(&command[0], (unsigned) command.size());
+      if (ret != DEVICE_OK)
+         return ret;
+      commands++;
+      if (expected.empty())
+         continue;
+
+      std::vector<unsigned char> answer(expected.size());
+      unsigned long bytesRead = 0;
+      double firstByteUs = 0.0;
+      while (bytesRead < answer.size() && (GetCurrentMMTime() - sent).getMsec() < 500)
+      {
+         unsigned long bR;
+         ret = ReadFromComPortH(&answer[bytesRead], (unsigned) (answer.size() - bytesRead), bR);
+         if (ret != DEVICE_OK)
+            return ret;
+         if (bR > 0 && bytesRead == 0)
+            firstByteUs = (GetCurrentMMTime() - sent).getUsec();
+         bytesRead += bR;
+      }
+      if (bytesRead < answer.size())
+      {
+         missing++;
+         continue;
+      }
+      if (answer != expected)
+         differing++;
+      answered++;
+      double recorded = (double) (answerUs - commandUs);
+      recordedUs += recorded;
+      replayedUs += firstByteUs;
+      if (firstByteUs - recorded > worstUs)
+      {
+         worstUs = firstByteUs - recorded;
+         worstOpcode = command[0];
+      }
+   }
+
+   std::ostringstream os;
+   os << commands << " commands, " << skipped << " skipped writes, " << differing << " different answers, "
+      << missing << " missing answers";
+   if (answered > 0)
+   {
+      os << ", mean answer time " << (long) (recordedUs / answered) << " us recorded, "
+         << (long) (replayedUs / answered) << " us replayed";
+      if (worstOpcode >= 0)
+         os << ", worst slowdown " << (long) worstUs << " us (command " << worstOpcode << ")";
+   }
+   report = os.str();
+   return DEVICE_OK;
+}
+
+void ArduinoLatencyStats::Reset()
+{
+   memset(counts_, 0, sizeof(counts_));
+   memset(timeouts_, 0, sizeof(timeouts_));
+   memset(maxUs_, 0, sizeof(maxUs_));
+}
+
+unsigned long ArduinoLatencyStats::GetCount(unsigned char opcode) const
+{
+   unsigned long count = 0;
+   for (unsigned b = 0; b < nBuckets; b++)
+      count += counts_[opcode][b];
+   return count;
+}
+
+unsigned long ArduinoLatencyStats::GetPercentile(unsigned char opcode, double p) const
+{
+   unsigned long count = GetCount(opcode);
+   if (count == 0)
+      return 0;
+   unsigned long seen = 0;
+   for (unsigned b = 0; b < nBuckets; b++)
+   {
+      seen += counts_[opcode][b];
+      if (seen >= p * count)
+         return (std::min)(2UL << b, maxUs_[opcode]);
+   }
+   return maxUs_[opcode];
+}
+
+std::string ArduinoLatencyStats::GetSummary() const
+{
+   std::ostringstream os;
+   for (unsigned op = 0; op < 256; op++)
+   {
+      unsigned long count = GetCount((unsigned char) op);
+      if (count == 0 && timeouts_[op] == 0)
+         continue;
+      if (os.tellp() > 0)
+         os << "; ";
+      os << op << ": " << count << ", " << GetPercentile((unsigned char) op, 0.5) << ", "
+         << GetPercentile((unsigned char) op, 0.99) << ", " << maxUs_[op] << ", " << timeouts_[op];
+   }
+   return os.str();
+}
+
+// Uploads one exposure per basis row with command 53, all in a single write.
+// Expects caller to guard the port
+int CArduinoHub::SendExposureTable(const std::vector<unsigned long>& exposuresUs)
+{
+   unsigned n = (unsigned) exposuresUs.size();
+   if (n > g_MaxExposureTableLength)
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   std::vector<unsigned char> command(3 + 4 * n);
+   command[0] = 53;
+   command[1] = (unsigned char) (n >> 8);
+   command[2] = (unsigned char) (n & 255);
+   for (unsigned i = 0; i < n; i++)
+   {
+      unsigned long exposure = exposuresUs[i];
+      command[3 + 4 * i] = (unsigned char) ((exposure >> 24) & 255);
+      command[4 + 4 * i] = (unsigned char) ((exposure >> 16) & 255);
+      command[5 + 4 * i] = (unsigned char) ((exposure >> 8) & 255);
+      command[6 + 4 * i] = (unsigned char) (exposure & 255);
+   }
+
+   PurgeComPort(port_.c_str());
+   int ret = WriteToComPortH(&command[0], (unsigned) command.size());
+   if (ret != DEVICE_OK)
+      return ret;
+
+   unsigned char answer[3];
+   ret = ReadNBytes(3, answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (answer[0] != 53 || answer[1] != command[1] || answer[2] != command[2])
+      return ERR_COMMUNICATION;
+
+   return DEVICE_OK;
+}
+
+/* Per basis row exposures, as a comma separated list in ms */
+int CArduinoHub::OnExposureTable(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(exposureTable_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string table;
+      pProp->Get(table);
+
+      std::vector<unsigned long> exposuresUs;
+      std::istringstream is(table);
+      std::string entry;
+      while (std::getline(is, entry, ','))
+      {
+         double ms = atof(entry.c_str());
+         if (ms < 0)
+            return DEVICE_INVALID_PROPERTY_VALUE;
+         exposuresUs.push_back((unsigned long) (ms * 1000.0 + 0.5));
+      }
+
+      MMThreadGuard myLock(lock_);
+      int ret = SendExposureTable(exposuresUs);
+      if (ret != DEVICE_OK)
+         return ret;
+
+      // a group gets the same table, or keeps the one it had
+      std::vector<CArduinoHub*> followers;
+      GetCSGroupFollowers(followers);
+      for (unsigned i = 0; i < followers.size(); i++)
+      {
+         {
+            MMThreadGuard followerLock(followers[i]->GetLock());
+            ret = followers[i]->SendExposureTable(exposuresUs);
+         }
+         if (ret != DEVICE_OK)
+         {
+            for (unsigned j = 0; j < i; j++)
+            {
+               MMThreadGuard followerLock(followers[j]->GetLock());
+               followers[j]->SendExposureTable(followers[j]->exposuresUs_);
+            }
+            SendExposureTable(exposuresUs_);
+            return ret;
+         }
+      }
+      exposureTable_ = table;
+      exposuresUs_ = exposuresUs;
+      for (unsigned i = 0; i < followers.size(); i++)
+      {
+         followers[i]->exposureTable_ = table;
+         followers[i]->exposuresUs_ = exposuresUs;
+      }
+   }
+   return DEVICE_OK;
+}
+
+// Expects caller to guard the port
+int CArduinoHub::StartCSRun()
+{
+   PurgeComPort(port_.c_str());
+   unsigned char command[1];
+   command[0] = 54;
+   int ret = WriteToComPortH(command, 1);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   unsigned char answer[1];
+   ret = ReadNBytes(1, answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (answer[0] != 54)
+      return ERR_COMMUNICATION;
+
+   MMThreadGuard eventLock(csEventLock_);
+   csRowEvents_.clear();
+   csRowLog_.clear();
+   csSyncErrors_ = 0;
+   csCurrentRow_ = 0;
+   csRowsCompleted_ = 0;
+   csMissedTriggers_ = 0;
+   csRunActive_ = true;
+   return DEVICE_OK;
+}
+
+// Expects caller to guard the port
+int CArduinoHub::StopCSRun()
+{
+   unsigned char command[1];
+   command[0] = 55;
+   int ret = WriteToComPortH(command, 1);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   unsigned char answer[9];
+   ret = ReadNBytes(9, answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (answer[0] != 55)
+      return ERR_COMMUNICATION;
+
+   MMThreadGuard eventLock(csEventLock_);
+   csRunActive_ = false;
+   csRowsCompleted_ = ((unsigned long) answer[1] << 24) | (answer[2] << 16) | (answer[3] << 8) | answer[4];
+   csMissedTriggers_ = ((unsigned long) answer[5] << 24) | (answer[6] << 16) | (answer[7] << 8) | answer[8];
+
+   std::ostringstream os;
+   os << "CS run stopped after " << csRowsCompleted_ << " rows, " << csMissedTriggers_ << " missed triggers";
+   LogMessage(os.str().c_str(), false);
+   return DEVICE_OK;
+}
+
+// Fetches the row advances since the last call (command 56)
+int CArduinoHub::UpdateCSProgress()
+{
+   MMThreadGuard myLock(lock_);
+   if (!csRunActive_)
+      return DEVICE_OK;
+
+   unsigned char command[1];
+   command[0] = 56;
+   int ret = WriteToComPortH(command, 1);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // a partial answer is drained, so that the next poll starts in step
+   unsigned char answer[12];
+   ret = ReadNBytes(12, answer);
+   if (ret == DEVICE_OK && answer[0] != 56)
+      ret = ERR_COMMUNICATION;
+   if (ret != DEVICE_OK) {
+      DrainComPort();
+      return ret;
+   }
+
+   unsigned nEvents = answer[11];
+   std::vector<unsigned char> events(6 * nEvents + 1);
+   if (nEvents > 0) {
+      ret = ReadNBytes(6 * nEvents, &events[0]);
+      if (ret != DEVICE_OK) {
+         DrainComPort();
+         return ret;
+      }
+   }
+
+   MMThreadGuard eventLock(csEventLock_);
+   csCurrentRow_ = (answer[1] << 8) | answer[2];
+   unsigned long completed = ((unsigned long) answer[3] << 24) | (answer[4] << 16) | (answer[5] << 8) | answer[6];
+   csMissedTriggers_ = ((unsigned long) answer[7] << 24) | (answer[8] << 16) | (answer[9] << 8) | answer[10];
+
+   // the firmware only keeps the last few advances
+   if (completed - csRowsCompleted_ > nEvents) {
+      std::ostringstream os;
+      os << "Lost " << completed - csRowsCompleted_ - nEvents << " CS row reports";
+      LogMessage(os.str().c_str(), false);
+   }
+   csRowsCompleted_ = completed;
+
+   for (unsigned i = 0; i < nEvents; i++)
+   {
+      const unsigned char* e = &events[6 * i];
+      CSRowEvent event;
+      event.row = (e[0] << 8) | e[1];
+      event.timeUs = ((unsigned long) e[2] << 24) | (e[3] << 16) | (e[4] << 8) | e[5];
+      csRowEvents_.push_back(event);
+      // the events are the last nEvents of the completed rows
+      csRowLog_.push_back(std::make_pair(completed - nEvents + i, event.row));
+   }
+   while (csRowLog_.size() > g_CSRowLogLength)
+      csRowLog_.pop_front();
+   return DEVICE_OK;
+}
+
+bool CArduinoHub::PopCSRowEvent(CSRowEvent& event)
+{
+   MMThreadGuard eventLock(csEventLock_);
+   if (csRowEvents_.empty())
+      return false;
+   event = csRowEvents_.front();
+   csRowEvents_.pop_front();
+   return true;
+}
+
+// Starts or stops a hardware triggered run together with its polling thread.
+// The followers of a group leader are armed before it and stopped after it.
+int CArduinoHub::SetCSRunning(bool running)
+{
+   std::vector<CArduinoHub*> followers;
+   GetCSGroupFollowers(followers);
+
+   if (running && !csRunActive_)
+   {
+      // when a board cannot be armed, the ones already armed are stopped
+      unsigned armed = 0;
+      int ret = DEVICE_OK;
+      for (; armed < followers.size(); armed++)
+      {
+         ret = followers[armed]->SetCSRunning(true);
+         if (ret != DEVICE_OK)
+            break;
+      }
+      if (ret == DEVICE_OK)
+      {
+         MMThreadGuard myLock(lock_);
+         ret = StartCSRun();
+      }
+      if (ret != DEVICE_OK)
+      {
+         for (unsigned i = 0; i < armed; i++)
+            followers[i]->SetCSRunning(false);
+         return ret;
+      }
+      if (csThread_ == 0)
+         csThread_ = new ArduinoCSProgressThread(*this);
+      csThread_->Start();
+   }
+   else if (!running && csRunActive_)
+   {
+      if (csThread_ != 0) {
+         delete csThread_;
+         csThread_ = 0;
+      }
+      // collect the last advances before stopping.  Every board of a group
+      // is stopped, also when another one fails; the first error is returned.
+      int ret = UpdateCSProgress();
+      if (ret == DEVICE_OK)
+      {
+         MMThreadGuard myLock(lock_);
+         ret = StopCSRun();
+      }
+      for (unsigned i = 0; i < followers.size(); i++)
+      {
+         int followerRet = followers[i]->SetCSRunning(false);
+         if (ret == DEVICE_OK)
+            ret = followerRet;
+      }
+      if (ret != DEVICE_OK)
+         return ret;
+      CheckCSGroupSync(true);
+   }
+   return DEVICE_OK;
+}
+
+// Followers of this hub when it leads a group
+void CArduinoHub::GetCSGroupFollowers(std::vector<CArduinoHub*>& followers)
+{
+   followers.clear();
+   MMThreadGuard hubsLock(csHubsLock_);
+   if (csGroup_.empty() || !csGroupLeader_)
+      return;
+   for (unsigned i = 0; i < csHubs_.size(); i++)
+   {
+      CArduinoHub* hub = csHubs_[i];
+      if (hub != this && hub->csGroup_ == csGroup_ && !hub->csGroupLeader_)
+         followers.push_back(hub);
+   }
+}
+
+void CArduinoHub::GetCSGroup(std::vector<CArduinoHub*>& hubs)
+{
+   GetCSGroupFollowers(hubs);
+   hubs.insert(hubs.begin(), this);
+}
+
+// Compares the rows the followers played for each trigger with the rows of
+// the leader, and once stopped the number of rows and missed triggers.
+// Rows only one side has reported yet are compared on a later call.
+void CArduinoHub::CheckCSGroupSync(bool stopped)
+{
+   std::vector<CArduinoHub*> followers;
+   GetCSGroupFollowers(followers);
+   if (followers.empty())
+      return;
+   std::string group;
+   {
+      MMThreadGuard hubsLock(csHubsLock_);
+      group = csGroup_;
+   }
+
+   MMThreadGuard eventLock(csEventLock_);
+   for (unsigned i = 0; i < followers.size(); i++)
+   {
+      CArduinoHub* follower = followers[i];
+      MMThreadGuard followerLock(follower->csEventLock_);
+      std::deque<std::pair<unsigned long, unsigned> >& log = follower->csRowLog_;
+      while (!log.empty() && !csRowLog_.empty() && log.front().first <= csRowLog_.back().first)
+      {
+         std::deque<std::pair<unsigned long, unsigned> >::const_iterator it = std::lower_bound(
+               csRowLog_.begin(), csRowLog_.end(), std::make_pair(log.front().first, 0u));
+         if (it != csRowLog_.end() && it->first == log.front().first && it->second != log.front().second)
+         {
+            csSyncErrors_++;
+            std::ostringstream os;
+            os << "CS group " << group << ": trigger " << it->first << " played row " << log.front().second
+               << " on a follower instead of row " << it->second;
+            LogMessage(os.str().c_str(), false);
+         }
+         log.pop_front();
+      }
+      if (stopped && (follower->csRowsCompleted_ != csRowsCompleted_ || follower->csMissedTriggers_ != csMissedTriggers_))
+      {
+         csSyncErrors_++;
+         std::ostringstream os;
+         os << "CS group " << group << ": a follower completed " << follower->csRowsCompleted_ << " rows with "
+            << follower->csMissedTriggers_ << " missed triggers, the leader " << csRowsCompleted_ << " rows with "
+            << csMissedTriggers_;
+         LogMessage(os.str().c_str(), false);
+      }
+   }
+}
+
+int CArduinoHub::OnCSGroup(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard hubsLock(csHubsLock_);
+      pProp->Set(csGroup_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (csRunActive_)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      MMThreadGuard hubsLock(csHubsLock_);
+      pProp->Get(csGroup_);
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSGroupRole(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard hubsLock(csHubsLock_);
+      pProp->Set(csGroupLeader_ ? "Leader" : "Follower");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (csRunActive_)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      std::string role;
+      pProp->Get(role);
+      MMThreadGuard hubsLock(csHubsLock_);
+      csGroupLeader_ = role == "Leader";
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSGroupOffset(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long) csGroupOffset_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long offset;
+      pProp->Get(offset);
+      if (offset < 0)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      csGroupOffset_ = (unsigned) offset;
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSGroupSyncErrors(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard eventLock(csEventLock_);
+      pProp->Set((long) csSyncErrors_);
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSRun(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(csRunActive_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string run;
+      pProp->Get(run);
+      return SetCSRunning(run == g_On);
+   }
+   return DEVICE_OK;
+}
+
+// Whether all rows are in the selected basis, when its size is known.
+// Expects caller to guard the port
+bool CArduinoHub::AreCSRowsValid(const std::vector<unsigned>& rows) const
+{
+   if (csBasisIndex_ >= csBases_.size() || csBases_[csBasisIndex_].rows == 0)
+      return true;
+   for (unsigned i = 0; i < rows.size(); i++)
+      if (rows[i] >= csBases_[csBasisIndex_].rows)
+         return false;
+   return true;
+}
+
+// Uploads the order in which the firmware plays the basis rows to every
+// board of a group.  When one of them fails, the others go back to the
+// playlist they had.
+// Expects caller to guard the port
+int CArduinoHub::SendPlaylist(const std::vector<unsigned>& rows)
+{
+   std::vector<unsigned> previous = csPlaylist_;
+   int ret = WritePlaylist(rows);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   std::vector<CArduinoHub*> followers;
+   GetCSGroupFollowers(followers);
+   std::vector<std::vector<unsigned> > followerPrevious;
+   for (unsigned i = 0; i < followers.size(); i++)
+   {
+      {
+         MMThreadGuard followerLock(followers[i]->GetLock());
+         followerPrevious.push_back(followers[i]->csPlaylist_);
+         ret = followers[i]->WritePlaylist(rows);
+      }
+      if (ret != DEVICE_OK)
+      {
+         for (unsigned j = 0; j < i; j++)
+         {
+            MMThreadGuard followerLock(followers[j]->GetLock());
+            followers[j]->WritePlaylist(followerPrevious[j]);
+         }
+         WritePlaylist(previous);
+         return ret;
+      }
+   }
+   return DEVICE_OK;
+}
+
+// Playlist of this board only (command 57)
+// Expects caller to guard the port
+int CArduinoHub::WritePlaylist(const std::vector<unsigned>& rows)
+{
+   unsigned n = (unsigned) rows.size();
+   if (n > g_MaxPlaylistLength)
+      return DEVICE_SEQUENCE_TOO_LARGE;
+   if (!AreCSRowsValid(rows))
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   std::vector<unsigned char> command(3 + 2 * n);
+   command[0] = 57;
+   command[1] = (unsigned char) (n >> 8);
+   command[2] = (unsigned char) (n & 255);
+   for (unsigned i = 0; i < n; i++)
+   {
+      command[3 + 2 * i] = (unsigned char) (rows[i] >> 8);
+      command[4 + 2 * i] = (unsigned char) (rows[i] & 255);
+   }
+
+   PurgeComPort(port_.c_str());
+   int ret = WriteToComPortH(&command[0], (unsigned) command.size());
+   if (ret != DEVICE_OK)
+      return ret;
+
+   unsigned char answer[3];
+   ret = ReadNBytes(3, answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (answer[0] != 57 || answer[1] != command[1] || answer[2] != command[2])
+      return ERR_COMMUNICATION;
+   csPlaylist_ = rows;
+   return DEVICE_OK;
+}
+
+// Queues basis rows that the firmware plays before resuming its playlist
+// (command 58), used by the adaptive acquisition to pick the next rows
+int CArduinoHub::QueueCSRows(const std::vector<unsigned>& rows)
+{
+   {
+      MMThreadGuard myLock(lock_);
+      if (!AreCSRowsValid(rows))
+         return DEVICE_INVALID_PROPERTY_VALUE;
+   }
+
+   unsigned n = (unsigned) rows.size();
+   if (n > g_MaxCSQueueLength)
+      return DEVICE_SEQUENCE_TOO_LARGE;
+
+   // queued rows cannot be taken back: when a board of a group fails, the
+   // others would play different rows, so the group's run is stopped
+   std::vector<CArduinoHub*> followers;
+   GetCSGroupFollowers(followers);
+   int ret = DEVICE_OK;
+   for (unsigned i = 0; i < followers.size() && ret == DEVICE_OK; i++)
+      ret = followers[i]->QueueCSRows(rows);
+   if (ret == DEVICE_OK)
+      ret = WriteCSQueue(rows);
+   if (ret != DEVICE_OK && !followers.empty() && csRunActive_)
+   {
+      LogMessage("Could not queue the CS rows on every board of the group, stopping its run", false);
+      SetCSRunning(false);
+   }
+   return ret;
+}
+
+// Rows queued on this board only (command 58)
+int CArduinoHub::WriteCSQueue(const std::vector<unsigned>& rows)
+{
+   MMThreadGuard myLock(lock_);
+   unsigned n = (unsigned) rows.size();
+
+   std::vector<unsigned char> command(3 + 2 * n);
+   command[0] = 58;
+   command[1] = (unsigned char) (n >> 8);
+   command[2] = (unsigned char) (n & 255);
+   for (unsigned i = 0; i < n; i++)
+   {
+      command[3 + 2 * i] = (unsigned char) (rows[i] >> 8);
+      command[4 + 2 * i] = (unsigned char) (rows[i] & 255);
+   }
+
+   PurgeComPort(port_.c_str());
+   int ret = WriteToComPortH(&command[0], (unsigned) command.size());
+   if (ret != DEVICE_OK)
+      return ret;
+
+   unsigned char answer[3];
+   ret = ReadNBytes(3, answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   // the firmware answers with the length of its whole queue
+   if (answer[0] != 58 || (unsigned) ((answer[1] << 8) | answer[2]) < n)
+      return ERR_COMMUNICATION;
+
+   return DEVICE_OK;
+}
+
+// Random access to the basis rows.  Setting the property plays that row on
+// every trigger, a loaded sequence is played in order by the next CS run.
+int CArduinoHub::OnCSRow(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard eventLock(csEventLock_);
+      pProp->Set(csCurrentRow_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long row;
+      pProp->Get(row);
+      if (row < 0)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      std::vector<unsigned> rows(1, (unsigned) row);
+      MMThreadGuard myLock(lock_);
+      int ret = SendPlaylist(rows);
+      if (ret != DEVICE_OK)
+         return ret;
+      MMThreadGuard eventLock(csEventLock_);
+      csCurrentRow_ = row;
+   }
+   else if (eAct == MM::IsSequenceable)
+   {
+      pProp->SetSequenceable(g_MaxPlaylistLength);
+   }
+   else if (eAct == MM::AfterLoadSequence)
+   {
+      std::vector<std::string> sequence = pProp->GetSequence();
+      std::vector<unsigned> rows;
+      for (unsigned i = 0; i < sequence.size(); i++)
+      {
+         long row = atol(sequence[i].c_str());
+         if (row < 0)
+            return DEVICE_INVALID_PROPERTY_VALUE;
+         rows.push_back((unsigned) row);
+      }
+      MMThreadGuard myLock(lock_);
+      return SendPlaylist(rows);
+   }
+   else if (eAct == MM::StartSequence)
+   {
+      return SetCSRunning(true);
+   }
+   else if (eAct == MM::StopSequence)
+   {
+      return SetCSRunning(false);
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSCurrentRow(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard eventLock(csEventLock_);
+      pProp->Set(csCurrentRow_);
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSRowsCompleted(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard eventLock(csEventLock_);
+      pProp->Set((long) csRowsCompleted_);
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSMissedTriggers(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard eventLock(csEventLock_);
+      pProp->Set((long) csMissedTriggers_);
+   }
+   return DEVICE_OK;
+}
+
+// Row update time of the last row and its maximum since the start of the
+// last CS run (command 59), both in us
+int CArduinoHub::GetCSRowUpdateTime(unsigned long& lastUs, unsigned long& maxUs)
+{
+   MMThreadGuard myLock(lock_);
+
+   unsigned char command[1];
+   command[0] = 59;
+   PurgeComPort(port_.c_str());
+   int ret = WriteToComPortH(command, 1);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   unsigned char answer[9];
+   ret = ReadNBytes(9, answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (answer[0] != 59)
+      return ERR_COMMUNICATION;
+
+   lastUs = ((unsigned long) answer[1] << 24) | (answer[2] << 16) | (answer[3] << 8) | answer[4];
+   maxUs = ((unsigned long) answer[5] << 24) | (answer[6] << 16) | (answer[7] << 8) | answer[8];
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSRowUpdateTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      unsigned long lastUs, maxUs;
+      int ret = GetCSRowUpdateTime(lastUs, maxUs);
+      if (ret != DEVICE_OK)
+         return ret;
+      pProp->Set((long) lastUs);
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSRowUpdateTimeMax(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      unsigned long lastUs, maxUs;
+      int ret = GetCSRowUpdateTime(lastUs, maxUs);
+      if (ret != DEVICE_OK)
+         return ret;
+      pProp->Set((long) maxUs);
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoHub::OnCSBasis(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(GetCSBasisLabel(csBasisIndex_).c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string label;
+      pProp->Get(label);
+      for (unsigned i = 0; i < csBases_.size(); i++)
+      {
+         if (label == GetCSBasisLabel(i))
+            return SelectCSBasis(i);
+      }
+      return DEVICE_INVALID_PROPERTY_VALUE;
+   }
+   return DEVICE_OK;
+}
+
+// Follows the basis selected with CSBasis
+int CArduinoHub::OnCSBasisId(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long) cs_basis_id_);
+   }
+   return DEVICE_OK;
+}
+
+/* Should set ON or OFF the CS mode*/
+int CArduinoHub::OnCSOnOff(MM::PropertyBase* pProp, MM::ActionType eAct) 
+{
+    if (eAct == MM::BeforeGet) // Do this when the property is being requested
+    {
+        ArduinoLog::Write(ArduinoLog::Debug, this, "CS mode queried");
+        
+        // served from the shadow unless stale
+        long mode;
+        if (!GetShadow(shadowCSMode, mode)) {
+            MMThreadGuard myLock(lock_);
+            int ret = ReadCSMode(mode);
+            if (ret != DEVICE_OK)
+                return ret;
+        }
+        pProp->Set(mode);
+    } 
+    else if (eAct == MM::AfterSet) // If the property is being edited, send the new value to the Arduino 
+    {
+        long cson;
+        pProp->Get(cson);    
+        ArduinoLog::Write(ArduinoLog::Debug, this, "CS mode modified: {}", cson);
+        MMThreadGuard myLock(lock_);
+        
+        // request the state to the Arduino
+        unsigned char command[2];
+        command[0] = 50;
+        command[1] = cson;
+        int ret = WriteToComPortH((const unsigned char*) command, 2);
+        if (ret != DEVICE_OK)
+            return ret;
+
+        // read the answer
+        std::string answer;
+        ret = GetSerialAnswerH(answer);
+        if (ret != DEVICE_OK) {
+            return ret;
+        }
+        ArduinoLog::Write(ArduinoLog::Debug, this, "CS mode answer: {}", answer);
+        if (answer != "2") { // CS activated
+            return ERR_COMMUNICATION;   
+        }           
+        SetShadow(shadowCSMode, cson);
+    }
+    return DEVICE_OK;
+}
+///////////////////////////////////////////////////////////////////////////////
+// CArduinoSwitch implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+CArduinoSwitch::CArduinoSwitch() : 
+   nrPatternsUsed_(0),
+   currentDelay_(0),
+   sequenceOn_(false),
+   blanking_(false),
+   initialized_(false),
+   numPos_(64)
+{
+   InitializeDefaultErrorMessages();
+
+   // add custom error messages
+   SetErrorText(ERR_UNKNOWN_POSITION, "Invalid position (state) specified");
+   SetErrorText(ERR_INITIALIZE_FAILED, "Initialization of the device failed");
+   SetErrorText(ERR_WRITE_FAILED, "Failed to write data to the device");
+   SetErrorText(ERR_CLOSE_FAILED, "Failed closing the device");
+   SetErrorText(ERR_COMMUNICATION, "Error in communication with Arduino board");
+   SetErrorText(ERR_NO_PORT_SET, "Hub Device not found.  The Arduino Hub device is needed to create this device");
+
+   for (unsigned int i=0; i < NUMPATTERNS; i++)
+      pattern_[i] = 0;
+
+   // Description
+   int ret = CreateProperty(MM::g_Keyword_Description, "Arduino digital output driver", MM::String, true);
+   assert(DEVICE_OK == ret);
+
+   // Name
+   ret = CreateProperty(MM::g_Keyword_Name, g_DeviceNameArduinoSwitch, MM::String, true);
+   assert(DEVICE_OK == ret);
+
+   // parent ID display
+   CreateHubIDProperty();
+
+}
+
+CArduinoSwitch::~CArduinoSwitch()
+{
+   Shutdown();
+}
+
+void CArduinoSwitch::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, g_DeviceNameArduinoSwitch);
+}
+
+
+int CArduinoSwitch::Initialize()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   char hubLabel[MM::MaxStrLength];
+   hub->GetLabel(hubLabel);
+   SetParentID(hubLabel); // for backward comp.
+
+   // set property list
+   // -----------------
+   
+   // create positions and labels
+   const int bufSize = 65;
+   char buf[bufSize];
+   for (long i=0; i<numPos_; i++)
+   {
+      snprintf(buf, bufSize, "%d", (unsigned)i);
+      SetPositionLabel(i, buf);
+   }
+
+   // State
+   // -----
+   CPropertyAction* pAct = new CPropertyAction (this, &CArduinoSwitch::OnState);
+   int nRet = CreateProperty(MM::g_Keyword_State, "0", MM::Integer, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   SetPropertyLimits(MM::g_Keyword_State, 0, numPos_ - 1);
+
+   // Label
+   // -----
+   pAct = new CPropertyAction (this, &CStateBase::OnLabel);
+   nRet = CreateProperty(MM::g_Keyword_Label, "", MM::String, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+
+   pAct = new CPropertyAction(this, &CArduinoSwitch::OnSequence);
+   nRet = CreateProperty("Sequence", g_On, MM::String, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   AddAllowedValue("Sequence", g_On);
+   AddAllowedValue("Sequence", g_Off);
+
+   // Starts "blanking" mode: goal is to synchronize laser light with camera exposure
+   std::string blankMode = "Blanking Mode";
+   pAct = new CPropertyAction(this, &CArduinoSwitch::OnBlanking);
+   nRet = CreateProperty(blankMode.c_str(), "Idle", MM::String, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   AddAllowedValue(blankMode.c_str(), g_On);
+   AddAllowedValue(blankMode.c_str(), g_Off);
+
+   // Blank on TTL high or low
+   pAct = new CPropertyAction(this, &CArduinoSwitch::OnBlankingTriggerDirection);
+   nRet = CreateProperty("Blank On", "Low", MM::String, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   AddAllowedValue("Blank On", "Low");
+   AddAllowedValue("Blank On", "High");
+
+   /*
+   // Starts producing timed digital output patterns 
+   // Parameters that influence the pattern are 'Repeat Timed Pattern', 'Delay', 'State' where the latter two are manipulated with the Get and SetPattern functions
+   std::string timedOutput = "Timed Output Mode";
+   pAct = new CPropertyAction(this, &CArduinoSwitch::OnStartTimedOutput);
+   nRet = CreateProperty(timedOutput.c_str(), "Idle", MM::String, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   AddAllowedValue(timedOutput.c_str(), "Stop");
+   AddAllowedValue(timedOutput.c_str(), "Start");
+   AddAllowedValue(timedOutput.c_str(), "Running");
+   AddAllowedValue(timedOutput.c_str(), "Idle");
+
+   // Sets a delay (in ms) to be used in timed output mode
+   // This delay will be transferred to the Arduino using the Get and SetPattern commands
+   pAct = new CPropertyAction(this, &CArduinoSwitch::OnDelay);
+   nRet = CreateProperty("Delay (ms)", "0", MM::Integer, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   SetPropertyLimits("Delay (ms)", 0, 65535);
+
+   // Repeat the timed Pattern this many times:
+   pAct = new CPropertyAction(this, &CArduinoSwitch::OnRepeatTimedPattern);
+   nRet = CreateProperty("Repeat Timed Pattern", "0", MM::Integer, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   SetPropertyLimits("Repeat Timed Pattern", 0, 255);
+   */
+
+   nRet = UpdateStatus();
+   if (nRet != DEVICE_OK)
+      return nRet;
+
+   initialized_ = true;
+
+   return DEVICE_OK;
+}
+
+int CArduinoSwitch::Shutdown()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (hub)
+      hub->WaitForCommands(this);
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+bool CArduinoSwitch::Busy()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   return hub && hub->IsCommandPending(this);
+}
+
+int CArduinoSwitch::WriteToPort(long value)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+
+   value = 63 & value;
+   if (hub->IsLogicInverted())
+      value = 63 & ~value;
+
+   unsigned char command[2];
+   command[0] = 1;
+   command[1] = (unsigned char) value;
+   return hub->SendCommand(this, command, 2, 1, shadowPattern, value);
+}
+
+int CArduinoSwitch::LoadSequence(unsigned size, unsigned char* seq)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   hub->WaitForAllCommands();
+   MMThreadGuard myLock(hub->GetLock());
+   hub->PurgeComPortH();
+
+   for (unsigned i=0; i < size; i++)
+   {
+      unsigned char value = seq[i];
+
+      value = 63 & value;
+      if (hub->IsLogicInverted())
+         value = ~value;
+
+      unsigned char command[3];
+      command[0] = 5;
+      command[1] = (unsigned char) i;
+      command[2] = value;
+      int ret = hub->WriteToComPortH((const unsigned char*) command, 3, this);
+      if (ret != DEVICE_OK)
+         return ret;
+
+
+      MM::MMTime startTime = GetCurrentMMTime();
+      unsigned long bytesRead = 0;
+      unsigned char answer[3];
+      while ((bytesRead < 3) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
+         unsigned long br;
+         ret = hub->ReadFromComPortH(answer + bytesRead, 3, br, this);
+      if (ret != DEVICE_OK)
+         return ret;
+      bytesRead += br;
+      }
+      if (answer[0] != 5)
+         return ERR_COMMUNICATION;
+
+   }
+
+   unsigned char command[2];
+   command[0] = 6;
+   command[1] = (unsigned char) size;
+   int ret = hub->WriteToComPortH((const unsigned char*) command, 2, this);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   MM::MMTime startTime = GetCurrentMMTime();
+   unsigned long bytesRead = 0;
+   unsigned char answer[2];
+   while ((bytesRead < 2) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
+      unsigned long br;
+      ret = hub->ReadFromComPortH(answer + bytesRead, 2, br, this);
+      if (ret != DEVICE_OK)
+         return ret;
+      bytesRead += br;
+   }
+   if (answer[0] != 6)
+      return ERR_COMMUNICATION;
+
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int CArduinoSwitch::OnState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   if (eAct == MM::BeforeGet)
+   {
+      // the pattern written last, also by a preset, while the shutter is
+      // open.  The shadow holds the pattern on the pins.
+      long pattern, pos;
+      pProp->Get(pos);
+      if (hub->GetShutterState() > 0 && hub->GetShadow(shadowPattern, pattern) &&
+            (pattern = hub->IsLogicInverted() ? 63 & ~pattern : pattern) != pos)
+      {
+         pProp->Set(pattern);
+         hub->SetSwitchState(pattern);
+      }
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long pos;
+      pProp->Get(pos);
+      hub->SetSwitchState(pos);
+      if (hub->GetShutterState() > 0)
+         return WriteToPort(pos);
+   }
+   else if (eAct == MM::IsSequenceable)                                      
+   {                                                                         
+      if (sequenceOn_)                                                       
+         pProp->SetSequenceable(NUMPATTERNS);                           
+      else                                                                   
+         pProp->SetSequenceable(0);                                          
+   } 
+   else if (eAct == MM::AfterLoadSequence)                                   
+   {                                                                         
+      std::vector<std::string> sequence = pProp->GetSequence();              
+      std::ostringstream os;
+      if (sequence.size() > NUMPATTERNS)                                
+         return DEVICE_SEQUENCE_TOO_LARGE;                                   
+      unsigned char* seq = new unsigned char[sequence.size()];               
+      for (unsigned int i=0; i < sequence.size(); i++)                       
+      {
+         std::istringstream os (sequence[i]);
+         int val;
+         os >> val;
+         seq[i] = (unsigned char) val;
+      }                                                                      
+      int ret = LoadSequence((unsigned) sequence.size(), seq);
+      if (ret != DEVICE_OK)                                                  
+         return ret;                                                         
+                                                                             
+      delete[] seq;                                                          
+   }                                                                         
+   else if (eAct == MM::StartSequence)
+   { 
+      // the sequence starts after the patterns set before
+      int ret = hub->WaitForCommands(this);
+      if (ret != DEVICE_OK)
+         return ret;
+      hub->WaitForAllCommands();
+
+      MMThreadGuard myLock(hub->GetLock());
+
+      hub->PurgeComPortH();
+      unsigned char command[1];
+      command[0] = 8;
+      ret = hub->WriteToComPortH((const unsigned char*) command, 1, this);
+      if (ret != DEVICE_OK)
+         return ret;
+
+      MM::MMTime startTime = GetCurrentMMTime();
+      unsigned long bytesRead = 0;
+      unsigned char answer[1];
+      while ((bytesRead < 1) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
+         unsigned long br;
+         ret = hub->ReadFromComPortH(answer + bytesRead, 1, br, this);
+         if (ret != DEVICE_OK)
+            return ret;
+         bytesRead += br;
+      }
+      if (answer[0] != 8)
+         return ERR_COMMUNICATION;
+      hub->SetSequenceActive(true);
+   }
+   else if (eAct == MM::StopSequence)                                        
+   {
+      hub->WaitForAllCommands();
+      MMThreadGuard myLock(hub->GetLock());
+
+      unsigned char command[1];
+      command[0] = 9;
+      int ret = hub->WriteToComPortH((const unsigned char*) command, 1, this);
+      if (ret != DEVICE_OK)
+         return ret;
+
+      MM::MMTime startTime = GetCurrentMMTime();
+      unsigned long bytesRead = 0;
+      unsigned char answer[2];
+      while ((bytesRead < 2) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
+         unsigned long br;
+         ret = hub->ReadFromComPortH(answer + bytesRead, 2, br, this);
+         if (ret != DEVICE_OK)
+            return ret;
+         bytesRead += br;
+      }
+      if (answer[0] != 9)
+         return ERR_COMMUNICATION;
+      hub->SetSequenceActive(false);
+      hub->SetShadow(shadowPattern, 0); // command 9 clears the pins
+
+      // the answer only holds the lowest byte of the trigger count
+      ArduinoTelemetry telemetry;
+      std::ostringstream os;
+      if (hub->HasOutputCommands() && hub->ReadTelemetry(telemetry) == DEVICE_OK)
+         os << "Sequence stopped: " << CArduinoHub::FormatTelemetry(telemetry);
+      else
+         os << "Sequence had " << (int) answer[1] << " transitions";
+      LogMessage(os.str().c_str(), false);
+
+   }                                                                         
+
+   return DEVICE_OK;
+}
+
+int CArduinoSwitch::OnSequence(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      if (sequenceOn_)
+         pProp->Set(g_On);
+      else
+         pProp->Set(g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string state;
+      pProp->Get(state);
+      if (state == g_On)
+         sequenceOn_ = true;
+      else
+         sequenceOn_ = false;
+   }
+   return DEVICE_OK;
+}
+
+// Synchronize the "Running" property with the Arduino
+// -- Send command 12 when acquisition is running
+// -- Send command  9 when acquisition is Idle
+int CArduinoSwitch::OnStartTimedOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   if (eAct == MM::BeforeGet) {
+      if (hub->IsTimedOutputActive())
+         pProp->Set("Running");
+      else
+         pProp->Set("Idle");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      hub->WaitForAllCommands();
+      MMThreadGuard myLock(hub->GetLock());
+
+      std::string prop;
+      pProp->Get(prop);
+
+      if (prop =="Start") {
+         hub->PurgeComPortH();
+         unsigned char command[1];
+         command[0] = 12;
+         int ret = hub->WriteToComPortH((const unsigned char*) command, 1, this);
+         if (ret != DEVICE_OK)
+            return ret;
+
+         MM::MMTime startTime = GetCurrentMMTime();
+         unsigned long bytesRead = 0;
+         unsigned char answer[1];
+         while ((bytesRead < 1) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
+            unsigned long br;
+            ret = hub->ReadFromComPortH(answer + bytesRead, 1, br, this);
+            if (ret != DEVICE_OK)
+               return ret;
+            bytesRead += br;
+         }
+         if (answer[0] != 12)
+            return ERR_COMMUNICATION;
+         hub->SetTimedOutput(true);
+         hub->SetShadow(shadowPattern, 0); // as the pins are left at the end
+      } else {
+         unsigned char command[1];
+         command[0] = 9;
+         int ret = hub->WriteToComPortH((const unsigned char*) command, 1, this);
+         if (ret != DEVICE_OK)
+            return ret;
+
+         MM::MMTime startTime = GetCurrentMMTime();
+         unsigned long bytesRead = 0;
+         unsigned char answer[2];
+         while ((bytesRead < 2) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
+            unsigned long br;
+            ret = hub->ReadFromComPortH(answer + bytesRead, 2, br, this);
+            if (ret != DEVICE_OK)
+               return ret;
+            bytesRead += br;
+         }
+         if (answer[0] != 9)
+            return ERR_COMMUNICATION;
+         hub->SetTimedOutput(false);
+         hub->SetShadow(shadowPattern, 0); // command 9 clears the pins
+      }
+   }
+
+   return DEVICE_OK;
+}
+
+// Synchronize the Arduino wrt the blanking state
+// Uses command 20 to switch blanking On
+// Uses command 21 to switch blanking Off
+int CArduinoSwitch::OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   // a recalled preset may have changed it
+   long blanking;
+   if (hub->GetShadow(shadowBlanking, blanking))
+      blanking_ = blanking != 0;
+
+   if (eAct == MM::BeforeGet) {
+      if (blanking_)
+         pProp->Set(g_On);
+      else
+         pProp->Set(g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string prop;
+      pProp->Get(prop);
+
+      if (prop == g_On && !blanking_) {
+         unsigned char command[1];
+         command[0] = 20;
+         int ret = hub->SendCommand(this, command, 1, 1, shadowBlanking, 1);
+         if (ret != DEVICE_OK)
+            return ret;
+         blanking_ = true;
+         LogMessage("Switched blanking on", true);
+
+      } else if (prop == g_Off && blanking_){
+         unsigned char command[1];
+         command[0] = 21;
+         int ret = hub->SendCommand(this, command, 1, 1, shadowBlanking, 0);
+         if (ret != DEVICE_OK)
+            return ret;
+         blanking_ = false;
+         LogMessage("Switched blanking off", true);
+      }
+   }
+
+   return DEVICE_OK;
+}
+
+int CArduinoSwitch::OnBlankingTriggerDirection(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   if (eAct == MM::BeforeGet) {
+      // a recalled preset may have changed it
+      long blankOnLow;
+      if (hub->GetShadow(shadowBlankOnLow, blankOnLow))
+         pProp->Set(blankOnLow ? "Low" : "High");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string direction;
+      pProp->Get(direction);
+
+      unsigned char command[2];
+      command[0] = 22;
+      if (direction == "Low") 
+         command[1] = 1;
+      else
+         command[1] = 0;
+
+      int ret = hub->SendCommand(this, command, 2, 1, shadowBlankOnLow, command[1]);
+      if (ret != DEVICE_OK)
+         return ret;
+
+   }
+
+   return DEVICE_OK;
+}
+
+int CArduinoSwitch::OnDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet) {
+      pProp->Set((long int)currentDelay_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long prop;
+      pProp->Get(prop);
+      currentDelay_ = (int) prop;
+   }
+
+   return DEVICE_OK;
+}
+
+int CArduinoSwitch::OnRepeatTimedPattern(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   if (eAct == MM::BeforeGet) {
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      hub->WaitForAllCommands();
+      MMThreadGuard myLock(hub->GetLock());
+
+      long prop;
+      pProp->Get(prop);
+
+      hub->PurgeComPortH();
+      unsigned char command[2];
+      command[0] = 11;
+      command[1] = (unsigned char) prop;
+
+      int ret = hub->WriteToComPortH((const unsigned char*) command, 2, this);
+      if (ret != DEVICE_OK)
+         return ret;
+
+      MM::MMTime startTime = GetCurrentMMTime();
+      unsigned long bytesRead = 0;
+      unsigned char answer[2];
+      while ((bytesRead < 2) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
+         unsigned long br;
+         ret = hub->ReadFromComPortH(answer + bytesRead, 2, br, this);
+         if (ret != DEVICE_OK)
+            return ret;
+         bytesRead += br;
+      }
+      if (answer[0] != 11)
+         return ERR_COMMUNICATION;
+
+      hub->SetTimedOutput(false);
+   }
+
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CArduinoDA implementation
+// ~~~~~~~~~~~~~~~~~~~~~~
+
+CArduinoDA::CArduinoDA(int channel) :
+      minV_(0.0), 
+      maxV_(5.0), 
+      volts_(0.0),
+      gatedVolts_(0.0),
+      channel_(channel), 
+      maxChannel_(2),
+      gateOpen_(true)
+{
+   InitializeDefaultErrorMessages();
+
+   // add custom error messages
+   SetErrorText(ERR_UNKNOWN_POSITION, "Invalid position (state) specified");
+   SetErrorText(ERR_INITIALIZE_FAILED, "Initialization of the device failed");
+   SetErrorText(ERR_WRITE_FAILED, "Failed to write data to the device");
+   SetErrorText(ERR_CLOSE_FAILED, "Failed closing the device");
+   SetErrorText(ERR_NO_PORT_SET, "Hub Device not found.  The Arduino Hub device is needed to create this device");
+
+   /* Channel property is not needed
+   CPropertyAction* pAct = new CPropertyAction(this, &CArduinoDA::OnChannel);
+   CreateProperty("Channel", channel_ == 1 ? "1" : "2", MM::Integer, false, pAct, true);
+   for (int i=1; i<= 2; i++){
+      std::ostringstream os;
+      os << i;
+      AddAllowedValue("Channel", os.str().c_str());
+   }
+   */
+
+   CPropertyAction* pAct = new CPropertyAction(this, &CArduinoDA::OnMaxVolt);
+   CreateProperty("MaxVolt", "5.0", MM::Float, false, pAct, true);
+
+   name_ = channel_ == 1 ? g_DeviceNameArduinoDA1 : g_DeviceNameArduinoDA2;
+
+   // Description
+   int nRet = CreateProperty(MM::g_Keyword_Description, "Arduino DAC driver", MM::String, true);
+   assert(DEVICE_OK == nRet);
+
+   // Name
+   nRet = CreateProperty(MM::g_Keyword_Name, name_.c_str(), MM::String, true);
+   assert(DEVICE_OK == nRet);
+
+   // parent ID display
+   CreateHubIDProperty();
+}
+
+CArduinoDA::~CArduinoDA()
+{
+   Shutdown();
+}
+
+void CArduinoDA::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, name_.c_str());
+}
+
+
+int CArduinoDA::Initialize()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   char hubLabel[MM::MaxStrLength];
+   hub->GetLabel(hubLabel);
+   SetParentID(hubLabel); // for backward comp.
+
+   // set property list
+   // -----------------
+   
+   // State
+   // -----
+   CPropertyAction* pAct = new CPropertyAction (this, &CArduinoDA::OnVolts);
+   int nRet = CreateProperty("Volts", "0.0", MM::Float, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   SetPropertyLimits("Volts", minV_, maxV_);
+
+   nRet = UpdateStatus();
+   if (nRet != DEVICE_OK)
+      return nRet;
+
+   initialized_ = true;
+
+   return DEVICE_OK;
+}
+
+int CArduinoDA::Shutdown()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (hub)
+      hub->WaitForCommands(this);
+   ArduinoLog::Flush();
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+bool CArduinoDA::Busy()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   return hub && hub->IsCommandPending(this);
+}
+
+int CArduinoDA::WriteToPort(unsigned long value)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   unsigned char command[4];
+   command[0] = 3;
+   command[1] = (unsigned char) (channel_ -1);
+   command[2] = (unsigned char) (value / 256L);
+   command[3] = (unsigned char) (value & 255);
+   return hub->SendCommand(this, command, 4, 4, shadowDA1 + channel_ - 1, (long) value);
+}
+
+
+int CArduinoDA::WriteSignal(double volts)
+{
+   //long value = (long) ( (volts - minV_) / maxV_ * 4095);
+   long value = (long) ( (volts - minV_) / maxV_ * 255); // 8 bits DAC
+   
+   ArduinoLog::Write(ArduinoLog::Debug, this, "8BIT DAC ONLY -- Volts: {} Max Voltage: {} digital value: {}",
+         volts, maxV_, value);
+
+   return WriteToPort(value);
+}
+
+int CArduinoDA::SetSignal(double volts)
+{
+   volts_ = volts;
+   if (gateOpen_) {
+      gatedVolts_ = volts_;
+      return WriteSignal(volts_);
+   } else {
+      gatedVolts_ = 0;
+   }
+
+   return DEVICE_OK;
+}
+
+int CArduinoDA::SetGateOpen(bool open)
+{
+   if (open) {
+      gateOpen_ = true;
+      gatedVolts_ = volts_;
+      return WriteSignal(volts_);
+   } 
+   gateOpen_ = false;
+   gatedVolts_ = 0;
+   return WriteSignal(0.0);
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int CArduinoDA::OnVolts(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      // the value written last, also by a preset, while the gate is open
+      CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+      long value;
+      if (hub && gateOpen_ && hub->GetShadow(shadowDA1 + channel_ - 1, value) &&
+            value != (long) ((volts_ - minV_) / maxV_ * 255))
+      {
+         volts_ = minV_ + value * maxV_ / 255;
+         gatedVolts_ = volts_;
+         pProp->Set(volts_);
+      }
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double volts;
+      pProp->Get(volts);
+      return SetSignal(volts);
+   }
+
+   return DEVICE_OK;
+}
+
+int CArduinoDA::OnMaxVolt(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(maxV_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(maxV_);
+      if (HasProperty("Volts"))
+         SetPropertyLimits("Volts", 0.0, maxV_);
+
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoDA::OnChannel(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long int)channel_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long channel;
+      pProp->Get(channel);
+      if (channel >=1 && ( (unsigned) channel <=maxChannel_) )
+         channel_ = channel;
+   }
+   return DEVICE_OK;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// CArduinoShutter implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+CArduinoShutter::CArduinoShutter() : initialized_(false), name_(g_DeviceNameArduinoShutter)
+{
+   InitializeDefaultErrorMessages();
+   EnableDelay();
+
+   SetErrorText(ERR_NO_PORT_SET, "Hub Device not found.  The Arduino Hub device is needed to create this device");
+
+   // Name
+   int ret = CreateProperty(MM::g_Keyword_Name, g_DeviceNameArduinoShutter, MM::String, true);
+   assert(DEVICE_OK == ret);
+
+   // Description
+   ret = CreateProperty(MM::g_Keyword_Description, "Arduino shutter driver", MM::String, true);
+   assert(DEVICE_OK == ret);
+
+   // parent ID display
+   CreateHubIDProperty();
+}
+
+CArduinoShutter::~CArduinoShutter()
+{
+   Shutdown();
+}
+
+void CArduinoShutter::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, g_DeviceNameArduinoShutter);
+}
+
+bool CArduinoShutter::Busy()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (hub && hub->IsCommandPending(this))
+      return true;
+
+   MM::MMTime interval = GetCurrentMMTime() - changedTime_;
+
+   if (interval < (1000.0 * GetDelayMs() ))
+      return true;
+   else
+       return false;
+}
+
+int CArduinoShutter::Initialize()
+{
+
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   char hubLabel[MM::MaxStrLength];
+   hub->GetLabel(hubLabel);
+   SetParentID(hubLabel); // for backward comp.
+
+   // set property list
+   // -----------------
+   
+   // OnOff
+   // ------
+   CPropertyAction* pAct = new CPropertyAction (this, &CArduinoShutter::OnOnOff);
+   int ret = CreateProperty("OnOff", "0", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // set shutter into the off state
+   //WriteToPort(0);
+
+   std::vector<std::string> vals;
+   vals.push_back("0");
+   vals.push_back("1");
+   ret = SetAllowedValues("OnOff", vals);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   ret = UpdateStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   changedTime_ = GetCurrentMMTime();
+   initialized_ = true;
+
+   return DEVICE_OK;
+}
+
+int CArduinoShutter::Shutdown()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (hub)
+      hub->WaitForCommands(this);
+   ArduinoLog::Flush();
+   if (initialized_)
+   {
+      initialized_ = false;
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoShutter::SetOpen(bool open)
+{
+   ArduinoLog::Write(ArduinoLog::Debug, this, "Request {}", open);
+
+   if (open)
+      return SetProperty("OnOff", "1");
+   else
+      return SetProperty("OnOff", "0");
+}
+
+int CArduinoShutter::GetOpen(bool& open)
+{
+   char buf[MM::MaxStrLength];
+   int ret = GetProperty("OnOff", buf);
+   if (ret != DEVICE_OK)
+      return ret;
+   long pos = atol(buf);
+   pos > 0 ? open = true : open = false;
+
+   return DEVICE_OK;
+}
+
+int CArduinoShutter::Fire(double /*deltaT*/)
+{
+   return DEVICE_UNSUPPORTED_COMMAND;
+}
+
+int CArduinoShutter::WriteToPort(long value)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   value = 63 & value;
+   if (hub->IsLogicInverted())
+      value = 63 & ~value;
+
+   unsigned char command[2];
+   command[0] = 1;
+   command[1] = (unsigned char) value;
+   return hub->SendCommand(this, command, 2, 1, shadowPattern, value);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int CArduinoShutter::OnOnOff(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (eAct == MM::BeforeGet)
+   {
+      // use cached state
+      pProp->Set((long)hub->GetShutterState());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long pos;
+      pProp->Get(pos);
+      int ret;
+      if (pos == 0)
+         ret = WriteToPort(0); // turn everything off
+      else
+         ret = WriteToPort(hub->GetSwitchState()); // restore old setting
+      if (ret != DEVICE_OK)
+         return ret;
+      hub->SetShutterState(pos);
+      changedTime_ = GetCurrentMMTime();
+   }
+
+   return DEVICE_OK;
+}
+
+
+/*
+ * Arduino input.  Can either be for all pins (0-6)
+ * or for an individual pin only
+ */
+
+CArduinoInput::CArduinoInput() :
+   mThread_(0),
+   pin_(0),
+   name_(g_DeviceNameArduinoInput)
+{
+   std::string errorText = "To use the Input function you need firmware version 2 or higher";
+   SetErrorText(ERR_VERSION_MISMATCH, errorText.c_str());
+
+   CreateProperty("Pin", "All", MM::String, false, 0, true);
+   AddAllowedValue("Pin", "All");
+   AddAllowedValue("Pin", "0");
+   AddAllowedValue("Pin", "1");
+   AddAllowedValue("Pin", "2");
+   AddAllowedValue("Pin", "3");
+   AddAllowedValue("Pin", "4");
+   AddAllowedValue("Pin", "5");
+
+   CreateProperty("Pull-Up-Resistor", g_On, MM::String, false, 0, true);
+   AddAllowedValue("Pull-Up-Resistor", g_On);
+   AddAllowedValue("Pull-Up-Resistor", g_Off);
+
+   // Name
+   int ret = CreateProperty(MM::g_Keyword_Name, name_.c_str(), MM::String, true);
+   assert(DEVICE_OK == ret);
+
+   // Description
+   ret = CreateProperty(MM::g_Keyword_Description, "Arduino shutter driver", MM::String, true);
+   assert(DEVICE_OK == ret);
+
+   // parent ID display
+   CreateHubIDProperty();
+}
+
+CArduinoInput::~CArduinoInput()
+{
+   Shutdown();
+}
+
+int CArduinoInput::Shutdown()
+{
+   if (initialized_)
+      delete(mThread_);
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+int CArduinoInput::Initialize()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   char hubLabel[MM::MaxStrLength];
+   hub->GetLabel(hubLabel);
+   SetParentID(hubLabel); // for backward comp.
+
+   char ver[MM::MaxStrLength] = "0";
+   hub->GetProperty(g_versionProp, ver);
+   int version = atoi(ver);
+   if (version < 2)
+      return ERR_VERSION_MISMATCH;
+
+   int ret = GetProperty("Pin", pins_);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (strcmp("All", pins_) != 0)
+      pin_ = atoi(pins_); 
+
+   ret = GetProperty("Pull-Up-Resistor", pullUp_);
+   if (ret != DEVICE_OK)
+      return ret;
+ 
+   // Digital Input
+   CPropertyAction* pAct = new CPropertyAction (this, &CArduinoInput::OnDigitalInput);
+   ret = CreateProperty("DigitalInput", "0", MM::Integer, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   int start = 0;
+   int end = 5;
+   if (strcmp("All", pins_) != 0) {
+      start = pin_;
+      end = pin_;
+   }
+
+   for (long i=start; i <=end; i++) 
+   {
+      CPropertyActionEx *pExAct = new CPropertyActionEx(this, &CArduinoInput::OnAnalogInput, i);
+      std::ostringstream os;
+      os << "AnalogInput" << i;
+      ret = CreateProperty(os.str().c_str(), "0.0", MM::Float, true, pExAct);
+      if (ret != DEVICE_OK)
+         return ret;
+      // set pull up resistor state for this pin
+      if (strcmp(g_On, pullUp_) == 0) {
+         SetPullUp(i, 1);
+      } else {
+         SetPullUp(i, 0);
+      }
+
+   }
+
+   mThread_ = new ArduinoInputMonitorThread(*this);
+   mThread_->Start();
+
+   initialized_ = true;
+
+   return DEVICE_OK;
+}
+
+void CArduinoInput::GetName(char* name) const
+{
+  CDeviceUtils::CopyLimitedString(name, name_.c_str());
+}
+
+bool CArduinoInput::Busy()
+{
+   return false;
+}
+
+int CArduinoInput::GetDigitalInput(long* state)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   MMThreadGuard myLock(hub->GetLock());
+
+   unsigned char bits;
+   int ret = hub->ReadDigitalInputs(bits, this);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   *state = GetPinState(bits);
+
+   return DEVICE_OK;
+}
+
+long CArduinoInput::GetPinState(unsigned char bits)
+{
+   if (strcmp("All", pins_) != 0)
+      return (bits >> pin_) & 1;
+   return bits;
+}
+
+int CArduinoInput::ReportStateChange(long newState)
+{
+   std::ostringstream os;
+   os << newState;
+   return OnPropertyChanged("DigitalInput", os.str().c_str());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int CArduinoInput::OnDigitalInput(MM::PropertyBase*  pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      // the monitor thread keeps the shadow of the hub fresh
+      CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+      long bits;
+      long state;
+      if (hub && hub->GetShadow(shadowDigitalInputs, bits))
+         state = GetPinState((unsigned char) bits);
+      else
+      {
+         int ret = GetDigitalInput(&state);
+         if (ret != DEVICE_OK)
+            return ret;
       }
+
+      pProp->Set(state);
    }
 
    return DEVICE_OK;
 }
 
-int CArduinoSwitch::OnBlankingTriggerDirection(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CArduinoInput::OnAnalogInput(MM::PropertyBase* pProp, MM::ActionType eAct, long  channel )
 {
    CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
    if (!hub || !hub->IsPortAvailable())
       return ERR_NO_PORT_SET;
 
-   if (eAct == MM::BeforeGet) {
-      // nothing to do, let the caller use cached property
-   }
-   else if (eAct == MM::AfterSet)
+   if (eAct == MM::BeforeGet)
    {
-      MMThreadGuard myLock(hub->GetLock());
-
-      std::string direction;
-      pProp->Get(direction);
-
-      hub->PurgeComPortH();
-      unsigned char command[2];
-      command[0] = 22;
-      if (direction == "Low") 
-         command[1] = 1;
-      else
-         command[1] = 0;
-
-      int ret = hub->WriteToComPortH((const unsigned char*) command, 2);
-      if (ret != DEVICE_OK)
-         return ret;
-
-      MM::MMTime startTime = GetCurrentMMTime();
-      unsigned long bytesRead = 0;
-      unsigned char answer[1];
-      while ((bytesRead < 1) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-         unsigned long br;
-         ret = hub->ReadFromComPortH(answer + bytesRead, 1, br);
+      long value;
+      if (!hub->GetShadow(shadowAnalogInput0 + channel, value))
+      {
+         MMThreadGuard myLock(hub->GetLock());
+         int ret = hub->ReadAnalogInput((unsigned) channel, value, this);
          if (ret != DEVICE_OK)
             return ret;
-         bytesRead += br;
       }
-      if (answer[0] != 22)
-         return ERR_COMMUNICATION;
-
-   }
-
-   return DEVICE_OK;
-}
 
-int CArduinoSwitch::OnDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-   if (eAct == MM::BeforeGet) {
-      pProp->Set((long int)currentDelay_);
-   }
-   else if (eAct == MM::AfterSet)
-   {
-      long prop;
-      pProp->Get(prop);
-      currentDelay_ = (int) prop;
+      pProp->Set(value);
    }
-
    return DEVICE_OK;
 }
 
-int CArduinoSwitch::OnRepeatTimedPattern(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CArduinoInput::SetPullUp(int pin, int state)
 {
    CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
    if (!hub || !hub->IsPortAvailable())
       return ERR_NO_PORT_SET;
 
-   if (eAct == MM::BeforeGet) {
-   }
-   else if (eAct == MM::AfterSet)
-   {
-      MMThreadGuard myLock(hub->GetLock());
-
-      long prop;
-      pProp->Get(prop);
-
-      hub->PurgeComPortH();
-      unsigned char command[2];
-      command[0] = 11;
-      command[1] = (unsigned char) prop;
+   hub->WaitForAllCommands();
+   MMThreadGuard myLock(hub->GetLock());
 
-      int ret = hub->WriteToComPortH((const unsigned char*) command, 2);
-      if (ret != DEVICE_OK)
-         return ret;
+   const int nrChrs = 3;
+   unsigned char command[nrChrs];
+   command[0] = 42;
+   command[1] = (unsigned char) pin;
+   command[2] = (unsigned char) state;
 
-      MM::MMTime startTime = GetCurrentMMTime();
-      unsigned long bytesRead = 0;
-      unsigned char answer[2];
-      while ((bytesRead < 2) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-         unsigned long br;
-         ret = hub->ReadFromComPortH(answer + bytesRead, 2, br);
-         if (ret != DEVICE_OK)
-            return ret;
-         bytesRead += br;
-      }
-      if (answer[0] != 11)
-         return ERR_COMMUNICATION;
+   unsigned char answer[3];
+   int ret = hub->Transact(command, nrChrs, answer, 3, this);
+   if (ret != DEVICE_OK)
+      return ret;
 
-      hub->SetTimedOutput(false);
-   }
+   if (answer[1] != pin)
+      return ERR_COMMUNICATION;
 
    return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// CArduinoDA implementation
-// ~~~~~~~~~~~~~~~~~~~~~~
+ArduinoInputMonitorThread::ArduinoInputMonitorThread(CArduinoInput& aInput) :
+   state_(0),
+   aInput_(aInput)
+{
+}
 
-CArduinoDA::CArduinoDA(int channel) :
-      busy_(false), 
-      minV_(0.0), 
-      maxV_(5.0), 
-      volts_(0.0),
-      gatedVolts_(0.0),
-      channel_(channel), 
-      maxChannel_(2),
-      gateOpen_(true)
+ArduinoInputMonitorThread::~ArduinoInputMonitorThread()
 {
-   InitializeDefaultErrorMessages();
+   Stop();
+   wait();
+}
 
-   // add custom error messages
-   SetErrorText(ERR_UNKNOWN_POSITION, "Invalid position (state) specified");
-   SetErrorText(ERR_INITIALIZE_FAILED, "Initialization of the device failed");
-   SetErrorText(ERR_WRITE_FAILED, "Failed to write data to the device");
-   SetErrorText(ERR_CLOSE_FAILED, "Failed closing the device");
-   SetErrorText(ERR_NO_PORT_SET, "Hub Device not found.  The Arduino Hub device is needed to create this device");
+int ArduinoInputMonitorThread::svc() 
+{
+   while (!stop_)
+   {
+      long state;
+      int ret = aInput_.GetDigitalInput(&state);
+      if (ret != DEVICE_OK)
+      {
+         stop_ = true;
+         return ret;
+      }
 
-   /* Channel property is not needed
-   CPropertyAction* pAct = new CPropertyAction(this, &CArduinoDA::OnChannel);
-   CreateProperty("Channel", channel_ == 1 ? "1" : "2", MM::Integer, false, pAct, true);
-   for (int i=1; i<= 2; i++){
-      std::ostringstream os;
-      os << i;
-      AddAllowedValue("Channel", os.str().c_str());
+      if (state != state_) 
+      {
+         aInput_.ReportStateChange(state);
+         state_ = state;
+      }
+      CDeviceUtils::SleepMs(500);
    }
-   */
-
-   CPropertyAction* pAct = new CPropertyAction(this, &CArduinoDA::OnMaxVolt);
-   CreateProperty("MaxVolt", "5.0", MM::Float, false, pAct, true);
-
-   name_ = channel_ == 1 ? g_DeviceNameArduinoDA1 : g_DeviceNameArduinoDA2;
-
-   // Description
-   int nRet = CreateProperty(MM::g_Keyword_Description, "Arduino DAC driver", MM::String, true);
-   assert(DEVICE_OK == nRet);
+   return DEVICE_OK;
+}
 
-   // Name
-   nRet = CreateProperty(MM::g_Keyword_Name, name_.c_str(), MM::String, true);
-   assert(DEVICE_OK == nRet);
 
-   // parent ID display
-   CreateHubIDProperty();
+void ArduinoInputMonitorThread::Start()
+{
+   stop_ = false;
+   activate();
 }
 
-CArduinoDA::~CArduinoDA()
+ArduinoCSProgressThread::ArduinoCSProgressThread(CArduinoHub& hub) :
+   hub_(hub),
+   stop_(true)
 {
-   Shutdown();
 }
 
-void CArduinoDA::GetName(char* name) const
+ArduinoCSProgressThread::~ArduinoCSProgressThread()
 {
-   CDeviceUtils::CopyLimitedString(name, name_.c_str());
+   Stop();
+   wait();
 }
 
-
-int CArduinoDA::Initialize()
+int ArduinoCSProgressThread::svc() 
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable()) {
-      return ERR_NO_PORT_SET;
+   unsigned failures = 0;
+   while (!stop_ && hub_.IsCSRunActive())
+   {
+      // the firmware keeps 16 advances, polling every 20 ms keeps up with 800 rows/s
+      int ret = hub_.UpdateCSProgress();
+      if (ret != DEVICE_OK)
+      {
+         // rows are played by the timer interrupt, so the firmware answers
+         // right away; a lost answer is retried before giving up
+         if (++failures < g_MaxCSProgressFailures)
+         {
+            CDeviceUtils::SleepMs(20);
+            continue;
+         }
+         stop_ = true;
+         return ret;
+      }
+      failures = 0;
+      hub_.CheckCSGroupSync(false);
+      CDeviceUtils::SleepMs(20);
    }
-   char hubLabel[MM::MaxStrLength];
-   hub->GetLabel(hubLabel);
-   SetParentID(hubLabel); // for backward comp.
-
-   // set property list
-   // -----------------
-   
-   // State
-   // -----
-   CPropertyAction* pAct = new CPropertyAction (this, &CArduinoDA::OnVolts);
-   int nRet = CreateProperty("Volts", "0.0", MM::Float, false, pAct);
-   if (nRet != DEVICE_OK)
-      return nRet;
-   SetPropertyLimits("Volts", minV_, maxV_);
-
-   nRet = UpdateStatus();
-   if (nRet != DEVICE_OK)
-      return nRet;
-
-   initialized_ = true;
-
    return DEVICE_OK;
 }
 
-int CArduinoDA::Shutdown()
+void ArduinoCSProgressThread::Start()
 {
-   initialized_ = false;
-   return DEVICE_OK;
+   stop_ = false;
+   activate();
 }
 
-int CArduinoDA::WriteToPort(unsigned long value)
+ArduinoShadowThread::ArduinoShadowThread(CArduinoHub& hub) :
+   hub_(hub),
+   stop_(true)
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable())
-      return ERR_NO_PORT_SET;
-
-   MMThreadGuard myLock(hub->GetLock());
-
-   hub->PurgeComPortH();
+}
 
-   unsigned char command[4];
-   command[0] = 3;
-   command[1] = (unsigned char) (channel_ -1);
-   command[2] = (unsigned char) (value / 256L);
-   command[3] = (unsigned char) (value & 255);
-   int ret = hub->WriteToComPortH((const unsigned char*) command, 4);
-   if (ret != DEVICE_OK)
-      return ret;
+ArduinoShadowThread::~ArduinoShadowThread()
+{
+   Stop();
+   wait();
+}
 
-   MM::MMTime startTime = GetCurrentMMTime();
-   unsigned long bytesRead = 0;
-   unsigned char answer[4];
-   while ((bytesRead < 4) && ( (GetCurrentMMTime() - startTime).getMsec() < 2500)) {
-      unsigned long bR;
-      ret = hub->ReadFromComPortH(answer + bytesRead, 4 - bytesRead, bR);
-      if (ret != DEVICE_OK)
-         return ret;
-      bytesRead += bR;
+int ArduinoShadowThread::svc() 
+{
+   while (!stop_)
+   {
+      hub_.RevalidateShadow();
+      // short sleeps, so that the hub does not wait long at shutdown
+      long periodMs = hub_.GetShadowPeriodMs();
+      for (long slept = 0; slept < periodMs && !stop_; slept += 50)
+         CDeviceUtils::SleepMs(50);
    }
-   
-   if (answer[0] != 3)
-      return ERR_COMMUNICATION;
+   return DEVICE_OK;
+}
 
-   hub->SetTimedOutput(false);
+void ArduinoShadowThread::Start()
+{
+   stop_ = false;
+   activate();
+}
 
-   return DEVICE_OK;
+ArduinoCommandSignal::ArduinoCommandSignal() :
+   generation_(0)
+{
+#ifdef WIN32
+   section_ = new CRITICAL_SECTION;
+   condition_ = new CONDITION_VARIABLE;
+   InitializeCriticalSection((CRITICAL_SECTION*) section_);
+   InitializeConditionVariable((CONDITION_VARIABLE*) condition_);
+#else
+   pthread_mutex_init(&mutex_, 0);
+   pthread_cond_init(&condition_, 0);
+#endif
+}
+
+ArduinoCommandSignal::~ArduinoCommandSignal()
+{
+#ifdef WIN32
+   DeleteCriticalSection((CRITICAL_SECTION*) section_);
+   delete (CRITICAL_SECTION*) section_;
+   delete (CONDITION_VARIABLE*) condition_;
+#else
+   pthread_cond_destroy(&condition_);
+   pthread_mutex_destroy(&mutex_);
+#endif
 }
 
-
-int CArduinoDA::WriteSignal(double volts)
+unsigned long ArduinoCommandSignal::GetGeneration()
 {
-   //long value = (long) ( (volts - minV_) / maxV_ * 4095);
-   long value = (long) ( (volts - minV_) / maxV_ * 255); // 8 bits DAC
-   
-   std::ostringstream os;
-    os << "8BIT DAC ONLY -- Volts: " << volts << " Max Voltage: " << maxV_ << " digital value: " << value;
-    LogMessage(os.str().c_str(), false); // used to be true
-
-   return WriteToPort(value);
+#ifdef WIN32
+   EnterCriticalSection((CRITICAL_SECTION*) section_);
+   unsigned long generation = generation_;
+   LeaveCriticalSection((CRITICAL_SECTION*) section_);
+#else
+   pthread_mutex_lock(&mutex_);
+   unsigned long generation = generation_;
+   pthread_mutex_unlock(&mutex_);
+#endif
+   return generation;
 }
 
-int CArduinoDA::SetSignal(double volts)
+void ArduinoCommandSignal::Wait(unsigned long generation, long maxMs)
 {
-   volts_ = volts;
-   if (gateOpen_) {
-      gatedVolts_ = volts_;
-      return WriteSignal(volts_);
-   } else {
-      gatedVolts_ = 0;
+#ifdef WIN32
+   EnterCriticalSection((CRITICAL_SECTION*) section_);
+   if (generation_ == generation)
+      SleepConditionVariableCS((CONDITION_VARIABLE*) condition_, (CRITICAL_SECTION*) section_, (DWORD) maxMs);
+   LeaveCriticalSection((CRITICAL_SECTION*) section_);
+#else
+   struct timespec deadline;
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_sec += maxMs / 1000;
+   deadline.tv_nsec += (maxMs % 1000) * 1000000L;
+   if (deadline.tv_nsec >= 1000000000L)
+   {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
    }
-
-   return DEVICE_OK;
+   pthread_mutex_lock(&mutex_);
+   while (generation_ == generation)
+   {
+      if (pthread_cond_timedwait(&condition_, &mutex_, &deadline) != 0)
+         break;
+   }
+   pthread_mutex_unlock(&mutex_);
+#endif
 }
 
-int CArduinoDA::SetGateOpen(bool open)
+void ArduinoCommandSignal::Notify()
 {
-   if (open) {
-      gateOpen_ = true;
-      gatedVolts_ = volts_;
-      return WriteSignal(volts_);
-   } 
-   gateOpen_ = false;
-   gatedVolts_ = 0;
-   return WriteSignal(0.0);
+#ifdef WIN32
+   EnterCriticalSection((CRITICAL_SECTION*) section_);
+   generation_++;
+   LeaveCriticalSection((CRITICAL_SECTION*) section_);
+   WakeAllConditionVariable((CONDITION_VARIABLE*) condition_);
+#else
+   pthread_mutex_lock(&mutex_);
+   generation_++;
+   pthread_mutex_unlock(&mutex_);
+   pthread_cond_broadcast(&condition_);
+#endif
+}
 
+ArduinoCommandThread::ArduinoCommandThread(CArduinoHub& hub) :
+   hub_(hub),
+   stop_(true)
+{
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Action handlers
-///////////////////////////////////////////////////////////////////////////////
+ArduinoCommandThread::~ArduinoCommandThread()
+{
+   Stop();
+   wait();
+}
 
-int CArduinoDA::OnVolts(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ArduinoCommandThread::svc() 
 {
-   if (eAct == MM::BeforeGet)
-   {
-      // nothing to do, let the caller use cached property
-   }
-   else if (eAct == MM::AfterSet)
+   // empties the queue before stopping
+   for (;;)
    {
-      double volts;
-      pProp->Get(volts);
-      return SetSignal(volts);
+      unsigned long generation = hub_.GetQueueGeneration();
+      if (hub_.SendQueuedCommand())
+         continue;
+      if (stop_)
+         break;
+      hub_.WaitForQueueChange(generation, 100);
    }
-
    return DEVICE_OK;
 }
 
-int CArduinoDA::OnMaxVolt(MM::PropertyBase* pProp, MM::ActionType eAct)
+void ArduinoCommandThread::Start()
 {
-   if (eAct == MM::BeforeGet)
-   {
-      pProp->Set(maxV_);
-   }
-   else if (eAct == MM::AfterSet)
-   {
-      pProp->Get(maxV_);
-      if (HasProperty("Volts"))
-         SetPropertyLimits("Volts", 0.0, maxV_);
+   stop_ = false;
+   activate();
+}
 
-   }
-   return DEVICE_OK;
+ArduinoCSSolveThread::ArduinoCSSolveThread(const CArduinoCSProcessor& processor) :
+   processor_(processor),
+   pending_(false),
+   running_(false)
+{
 }
 
-int CArduinoDA::OnChannel(MM::PropertyBase* pProp, MM::ActionType eAct)
+// a reconstruction being solved is finished, a waiting one is dropped
+ArduinoCSSolveThread::~ArduinoCSSolveThread()
 {
-   if (eAct == MM::BeforeGet)
    {
-      pProp->Set((long int)channel_);
+      MMThreadGuard guard(lock_);
+      pending_ = false;
    }
-   else if (eAct == MM::AfterSet)
+   wait();
+}
+
+int ArduinoCSSolveThread::svc() 
+{
+   for (;;)
    {
-      long channel;
-      pProp->Get(channel);
-      if (channel >=1 && ( (unsigned) channel <=maxChannel_) )
-         channel_ = channel;
+      CSWaveletJob job;
+      {
+         MMThreadGuard guard(lock_);
+         if (!pending_)
+         {
+            running_ = false;
+            return DEVICE_OK;
+         }
+         job.Swap(job_);
+         pending_ = false;
+      }
+
+      std::vector<float> estimate((size_t) job.n * job.width * job.height);
+      int ret = CSSolveWaveletSparse(&job.gram[0], job.lipschitz, &job.aty[0], job.n, job.width, job.height,
+            job.weight, job.iterations, job.threads, &estimate[0]);
+      if (ret == DEVICE_OK)
+         ret = processor_.WriteEstimate(job.path, estimate, job.n, job.width, job.height, job.rows);
+      if (ret != DEVICE_OK)
+         ArduinoLog::Write(ArduinoLog::Error, &processor_, "Wavelet CS reconstruction failed ({})", ret);
    }
-   return DEVICE_OK;
 }
 
+void ArduinoCSSolveThread::Submit(CSWaveletJob& job)
+{
+   MMThreadGuard guard(lock_);
+   job_.Swap(job);
+   pending_ = true;
+   if (running_)
+      return;
+   // the previous run has returned from svc() once running_ is false
+   wait();
+   running_ = true;
+   activate();
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-// CArduinoShutter implementation
-// ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// CArduinoPresets implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-CArduinoShutter::CArduinoShutter() : initialized_(false), name_(g_DeviceNameArduinoShutter)
+CArduinoPresets::CArduinoPresets() :
+   initialized_(false)
 {
    InitializeDefaultErrorMessages();
-   EnableDelay();
 
+   SetErrorText(ERR_UNKNOWN_POSITION, "Invalid preset specified");
+   SetErrorText(ERR_COMMUNICATION, "Error in communication with Arduino board");
    SetErrorText(ERR_NO_PORT_SET, "Hub Device not found.  The Arduino Hub device is needed to create this device");
+   SetErrorText(ERR_VERSION_MISMATCH, "To use presets you need firmware version 3 with compressed sensing support");
+   SetErrorText(ERR_PRESET_UNDEFINED, "This preset has not been stored on the Arduino, use StoreCurrentState first");
 
-   // Name
-   int ret = CreateProperty(MM::g_Keyword_Name, g_DeviceNameArduinoShutter, MM::String, true);
+   // Description
+   int ret = CreateProperty(MM::g_Keyword_Description, "Arduino output presets", MM::String, true);
    assert(DEVICE_OK == ret);
 
-   // Description
-   ret = CreateProperty(MM::g_Keyword_Description, "Arduino shutter driver", MM::String, true);
+   // Name
+   ret = CreateProperty(MM::g_Keyword_Name, g_DeviceNameArduinoPresets, MM::String, true);
    assert(DEVICE_OK == ret);
 
    // parent ID display
    CreateHubIDProperty();
 }
 
-CArduinoShutter::~CArduinoShutter()
+CArduinoPresets::~CArduinoPresets()
 {
    Shutdown();
 }
 
-void CArduinoShutter::GetName(char* name) const
-{
-   CDeviceUtils::CopyLimitedString(name, g_DeviceNameArduinoShutter);
-}
-
-bool CArduinoShutter::Busy()
+void CArduinoPresets::GetName(char* name) const
 {
-   MM::MMTime interval = GetCurrentMMTime() - changedTime_;
-
-   if (interval < (1000.0 * GetDelayMs() ))
-      return true;
-   else
-       return false;
+   CDeviceUtils::CopyLimitedString(name, g_DeviceNameArduinoPresets);
 }
 
-int CArduinoShutter::Initialize()
+int CArduinoPresets::Initialize()
 {
-
    CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
    if (!hub || !hub->IsPortAvailable()) {
       return ERR_NO_PORT_SET;
    }
+   if (!hub->HasOutputCommands())
+      return ERR_VERSION_MISMATCH;
    char hubLabel[MM::MaxStrLength];
    hub->GetLabel(hubLabel);
    SetParentID(hubLabel); // for backward comp.
 
-   // set property list
-   // -----------------
-   
-   // OnOff
-   // ------
-   CPropertyAction* pAct = new CPropertyAction (this, &CArduinoShutter::OnOnOff);
-   int ret = CreateProperty("OnOff", "0", MM::Integer, false, pAct);
-   if (ret != DEVICE_OK)
-      return ret;
-
-   // set shutter into the off state
-   //WriteToPort(0);
-
-   std::vector<std::string> vals;
-   vals.push_back("0");
-   vals.push_back("1");
-   ret = SetAllowedValues("OnOff", vals);
-   if (ret != DEVICE_OK)
-      return ret;
+   {
+      MMThreadGuard myLock(hub->GetLock());
+      int ret = hub->ReadPresets();
+      if (ret != DEVICE_OK)
+         return ret;
+   }
 
-   ret = UpdateStatus();
-   if (ret != DEVICE_OK)
-      return ret;
+   // create positions and labels
+   const int bufSize = 65;
+   char buf[bufSize];
+   for (long i = 0; i < CArduinoHub::numPresets; i++)
+   {
+      snprintf(buf, bufSize, "Preset-%ld", i);
+      SetPositionLabel(i, buf);
+   }
 
-   changedTime_ = GetCurrentMMTime();
-   initialized_ = true;
+   // State
+   // -----
+   CPropertyAction* pAct = new CPropertyAction (this, &CArduinoPresets::OnState);
+   int nRet = CreateProperty(MM::g_Keyword_State, "0", MM::Integer, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   SetPropertyLimits(MM::g_Keyword_State, 0, CArduinoHub::numPresets - 1);
 
-   return DEVICE_OK;
-}
+   // Label
+   // -----
+   pAct = new CPropertyAction (this, &CStateBase::OnLabel);
+   nRet = CreateProperty(MM::g_Keyword_Label, "", MM::String, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
 
-int CArduinoShutter::Shutdown()
-{
-   if (initialized_)
+   // Stores the present outputs of the board into the preset set here
+   pAct = new CPropertyAction(this, &CArduinoPresets::OnStoreCurrentState);
+   nRet = CreateProperty("StoreCurrentState", "Idle", MM::String, false, pAct);
+   if (nRet != DEVICE_OK)
+      return nRet;
+   AddAllowedValue("StoreCurrentState", "Idle");
+   for (long i = 0; i < CArduinoHub::numPresets; i++)
    {
-      initialized_ = false;
+      snprintf(buf, bufSize, "%ld", i);
+      AddAllowedValue("StoreCurrentState", buf);
    }
-   return DEVICE_OK;
-}
 
-int CArduinoShutter::SetOpen(bool open)
-{
-	std::ostringstream os;
-	os << "Request " << open;
-	LogMessage(os.str().c_str(), true);
+   initialized_ = true;
 
-   if (open)
-      return SetProperty("OnOff", "1");
-   else
-      return SetProperty("OnOff", "0");
+   return DEVICE_OK;
 }
 
-int CArduinoShutter::GetOpen(bool& open)
+int CArduinoPresets::Shutdown()
 {
-   char buf[MM::MaxStrLength];
-   int ret = GetProperty("OnOff", buf);
-   if (ret != DEVICE_OK)
-      return ret;
-   long pos = atol(buf);
-   pos > 0 ? open = true : open = false;
-
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (hub)
+      hub->WaitForCommands(this);
+   initialized_ = false;
    return DEVICE_OK;
 }
 
-int CArduinoShutter::Fire(double /*deltaT*/)
+bool CArduinoPresets::Busy()
 {
-   return DEVICE_UNSUPPORTED_COMMAND;
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   return hub && hub->IsCommandPending(this);
 }
 
-int CArduinoShutter::WriteToPort(long value)
+int CArduinoPresets::LoadSequence(const std::vector<std::string>& sequence)
 {
    CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable())
-      return ERR_NO_PORT_SET;
+   if (sequence.size() > NUMSEQUENCE)
+      return DEVICE_SEQUENCE_TOO_LARGE;
 
+   hub->WaitForAllCommands();
    MMThreadGuard myLock(hub->GetLock());
+   std::vector<unsigned char> command;
+   command.push_back(16);
+   command.push_back((unsigned char) sequence.size());
+   for (unsigned i = 0; i < sequence.size(); i++)
+   {
+      long pos = atol(sequence[i].c_str());
+      ArduinoPreset preset;
+      if (!hub->GetPreset(pos, preset))
+         return ERR_PRESET_UNDEFINED;
+      command.push_back((unsigned char) pos);
+   }
 
-   value = 63 & value;
-   if (hub->IsLogicInverted())
-      value = ~value;
-
-   hub->PurgeComPortH();
-
-   unsigned char command[2];
-   command[0] = 1;
-   command[1] = (unsigned char) value;
-   int ret = hub->WriteToComPortH((const unsigned char*) command, 2);
+   unsigned char answer[2];
+   int ret = hub->Transact(&command[0], (unsigned) command.size(), answer, 2, this);
    if (ret != DEVICE_OK)
       return ret;
-
-   MM::MMTime startTime = GetCurrentMMTime();
-   unsigned long bytesRead = 0;
-   unsigned char answer[1];
-   while ((bytesRead < 1) && ( (GetCurrentMMTime() - startTime).getMsec() < 250)) {
-      ret = hub->ReadFromComPortH(answer, 1, bytesRead);
-      if (ret != DEVICE_OK)
-         return ret;
-   }
-   if (answer[0] != 1)
+   if (answer[1] != sequence.size())
       return ERR_COMMUNICATION;
-
-   hub->SetTimedOutput(false);
-
    return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Action handlers
-///////////////////////////////////////////////////////////////////////////////
-
-int CArduinoShutter::OnOnOff(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CArduinoPresets::OnState(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
    CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
    if (eAct == MM::BeforeGet)
    {
-      // use cached state
-      pProp->Set((long)hub->GetShutterState());
+      // nothing to do, let the caller use cached property
    }
    else if (eAct == MM::AfterSet)
    {
-      long pos;
-      pProp->Get(pos);
-      int ret;
-      if (pos == 0)
-         ret = WriteToPort(0); // turn everything off
-      else
-         ret = WriteToPort(hub->GetSwitchState()); // restore old setting
+      long pos;
+      pProp->Get(pos);
+      ArduinoPreset preset;
+      {
+         MMThreadGuard myLock(hub->GetLock());
+         if (!hub->GetPreset(pos, preset))
+            return ERR_PRESET_UNDEFINED;
+      }
+      unsigned char command[2];
+      command[0] = 19;
+      command[1] = (unsigned char) pos;
+      return hub->SendCommand(this, command, 2, 2, shadowPreset, pos);
+   }
+   else if (eAct == MM::IsSequenceable)
+   {
+      pProp->SetSequenceable(NUMSEQUENCE);
+   }
+   else if (eAct == MM::AfterLoadSequence)
+   {
+      return LoadSequence(pProp->GetSequence());
+   }
+   else if (eAct == MM::StartSequence)
+   {
+      // the sequence starts after the presets recalled before
+      int ret = hub->WaitForCommands(this);
+      if (ret != DEVICE_OK)
+         return ret;
+      hub->WaitForAllCommands();
+
+      MMThreadGuard myLock(hub->GetLock());
+      unsigned char command[1];
+      command[0] = 8;
+      unsigned char answer[1];
+      ret = hub->Transact(command, 1, answer, 1, this);
+      if (ret != DEVICE_OK)
+         return ret;
+      hub->SetSequenceActive(true);
+   }
+   else if (eAct == MM::StopSequence)
+   {
+      hub->WaitForAllCommands();
+      MMThreadGuard myLock(hub->GetLock());
+      unsigned char command[2];
+      command[0] = 9;
+      unsigned char answer[2];
+      int ret = hub->Transact(command, 1, answer, 2, this);
       if (ret != DEVICE_OK)
          return ret;
-      hub->SetShutterState(pos);
-      changedTime_ = GetCurrentMMTime();
+      hub->SetSequenceActive(false);
+      // the presets recalled by the triggers changed the outputs
+      const int keys[] = {shadowPattern, shadowDA1, shadowDA2, shadowBlanking, shadowBlankOnLow, shadowPreset};
+      for (unsigned i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+         hub->InvalidateShadow(keys[i]);
+
+      // back to the patterns of the switch in trigger mode
+      command[0] = 16;
+      command[1] = 0;
+      return hub->Transact(command, 2, answer, 2, this);
    }
 
    return DEVICE_OK;
 }
 
+int CArduinoPresets::OnStoreCurrentState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+
+   if (eAct == MM::AfterSet)
+   {
+      std::string index;
+      pProp->Get(index);
+      pProp->Set("Idle");
+      if (index == "Idle")
+         return DEVICE_OK;
+
+      // outputs never written since startup are as the board starts up
+      hub->WaitForAllCommands();
+      long value;
+      ArduinoPreset preset;
+      preset.pattern = (unsigned char) (hub->GetShadow(shadowPattern, value) ? value : 0);
+      preset.da1 = hub->GetShadow(shadowDA1, value) ? value : 0;
+      preset.da2 = hub->GetShadow(shadowDA2, value) ? value : 0;
+      preset.blanking = hub->GetShadow(shadowBlanking, value) && value != 0;
+      preset.blankOnLow = !hub->GetShadow(shadowBlankOnLow, value) || value != 0;
+
+      MMThreadGuard myLock(hub->GetLock());
+      return hub->StorePreset(atol(index.c_str()), preset);
+   }
+   return DEVICE_OK;
+}
 
 /*
- * Arduino input.  Can either be for all pins (0-6)
- * or for an individual pin only
+ * CS reconstruction.  Every frame that goes through the processor is one
+ * measurement, taken while the Arduino displays the next basis row.
  */
 
-CArduinoInput::CArduinoInput() :
-   mThread_(0),
-   pin_(0),
-   name_(g_DeviceNameArduinoInput)
+CArduinoCSProcessor::CArduinoCSProcessor() :
+   verifyBasis_(false),
+   stackMethod_(false),
+   threads_(4),
+   waveletPrior_(false),
+   priorWeight_(10.0),
+   priorIterations_(100),
+   compressMeasurements_(false),
+   lambda_(1e-3),
+   width_(0),
+   height_(0),
+   framesSeen_(0),
+   batchSize_(8),
+   tolerance_(0.01),
+   oversampling_(2.0),
+   framesInBatch_(0),
+   solveThread_(0),
+   initialized_(false)
 {
-   std::string errorText = "To use the Input function you need firmware version 2 or higher";
-   SetErrorText(ERR_VERSION_MISMATCH, errorText.c_str());
-
-   CreateProperty("Pin", "All", MM::String, false, 0, true);
-   AddAllowedValue("Pin", "All");
-   AddAllowedValue("Pin", "0");
-   AddAllowedValue("Pin", "1");
-   AddAllowedValue("Pin", "2");
-   AddAllowedValue("Pin", "3");
-   AddAllowedValue("Pin", "4");
-   AddAllowedValue("Pin", "5");
+   InitializeDefaultErrorMessages();
 
-   CreateProperty("Pull-Up-Resistor", g_On, MM::String, false, 0, true);
-   AddAllowedValue("Pull-Up-Resistor", g_On);
-   AddAllowedValue("Pull-Up-Resistor", g_Off);
+   SetErrorText(ERR_NO_PORT_SET, "Hub Device not found.  The Arduino Hub device is needed to create this device");
+   SetErrorText(ERR_CS_BASIS_FILE, "Could not read the CS basis file");
+   SetErrorText(ERR_CS_BASIS_MISMATCH, "The frame does not match the loaded CS basis");
+   SetErrorText(ERR_CS_NOT_READY, "No CS basis loaded for the reconstruction");
+   SetErrorText(ERR_CS_STORE, "Could not write or read the CS measurement file");
+   SetErrorText(ERR_CS_BASIS_DIFFERS, "The CS basis file differs from the basis selected on the Arduino");
 
    // Name
-   int ret = CreateProperty(MM::g_Keyword_Name, name_.c_str(), MM::String, true);
+   int ret = CreateProperty(MM::g_Keyword_Name, g_DeviceNameArduinoCSProcessor, MM::String, true);
    assert(DEVICE_OK == ret);
 
    // Description
-   ret = CreateProperty(MM::g_Keyword_Description, "Arduino shutter driver", MM::String, true);
+   ret = CreateProperty(MM::g_Keyword_Description, "Incremental compressed sensing reconstruction", MM::String, true);
    assert(DEVICE_OK == ret);
 
    // parent ID display
    CreateHubIDProperty();
 }
 
-CArduinoInput::~CArduinoInput()
+CArduinoCSProcessor::~CArduinoCSProcessor()
 {
    Shutdown();
 }
 
-int CArduinoInput::Shutdown()
+void CArduinoCSProcessor::GetName(char* name) const
 {
-   if (initialized_)
-      delete(mThread_);
-   initialized_ = false;
-   return DEVICE_OK;
+   CDeviceUtils::CopyLimitedString(name, g_DeviceNameArduinoCSProcessor);
 }
 
-int CArduinoInput::Initialize()
+int CArduinoCSProcessor::Initialize()
 {
    CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
    if (!hub || !hub->IsPortAvailable()) {
@@ -1676,253 +4842,966 @@ int CArduinoInput::Initialize()
    hub->GetLabel(hubLabel);
    SetParentID(hubLabel); // for backward comp.
 
-   char ver[MM::MaxStrLength] = "0";
-   hub->GetProperty(g_versionProp, ver);
-   int version = atoi(ver);
-   if (version < 2)
-      return ERR_VERSION_MISMATCH;
+   // CSV basis, same file as the one exported to the Arduino
+   CPropertyAction* pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnBasisFile);
+   int ret = CreateProperty("BasisFile", "", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
 
-   int ret = GetProperty("Pin", pins_);
+   // Compares the basis file with a readback of the firmware basis
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnVerifyBasis);
+   ret = CreateProperty("VerifyBasis", g_Off, MM::String, false, pAct);
    if (ret != DEVICE_OK)
       return ret;
-   if (strcmp("All", pins_) != 0)
-      pin_ = atoi(pins_); 
+   AddAllowedValue("VerifyBasis", g_Off);
+   AddAllowedValue("VerifyBasis", g_On);
 
-   ret = GetProperty("Pull-Up-Resistor", pullUp_);
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnRegularization);
+   ret = CreateProperty("Regularization", "0.001", MM::Float, false, pAct);
    if (ret != DEVICE_OK)
       return ret;
- 
-   // Digital Input
-   CPropertyAction* pAct = new CPropertyAction (this, &CArduinoInput::OnDigitalInput);
-   ret = CreateProperty("DigitalInput", "0", MM::Integer, true, pAct);
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnReset);
+   ret = CreateProperty("Reset", "Idle", MM::String, false, pAct);
    if (ret != DEVICE_OK)
       return ret;
+   AddAllowedValue("Reset", "Idle");
+   AddAllowedValue("Reset", "Reset");
 
-   int start = 0;
-   int end = 5;
-   if (strcmp("All", pins_) != 0) {
-      start = pin_;
-      end = pin_;
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnRowsAccumulated);
+   ret = CreateProperty("RowsAccumulated", "0", MM::Integer, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // The estimate is written there (raw float32, one plane per basis element)
+   // each time a full pass through the basis has been accumulated
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnOutputFile);
+   ret = CreateProperty("OutputFile", "", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // Directory where the operators of each basis (Cholesky factor,
+   // Lipschitz constant) are kept between runs, empty to disable
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnOperatorCache);
+   ret = CreateProperty("OperatorCache", "", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // Incremental: every frame updates the estimate of each pixel.
+   // Stack: frames are summed per basis row, then all pixels are solved at
+   // once by a blocked product of these sums with the reconstruction operator.
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnMethod);
+   ret = CreateProperty("Method", g_CSMethodIncremental, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue("Method", g_CSMethodIncremental);
+   AddAllowedValue("Method", g_CSMethodStack);
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnThreads);
+   ret = CreateProperty("Threads", "4", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   SetPropertyLimits("Threads", 1, 64);
+
+   // Wavelet: the estimate is sparse in the Haar domain of each element
+   // image (PriorWeight in intensity units), which needs fewer basis rows
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnPrior);
+   ret = CreateProperty("Prior", g_CSPriorNone, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue("Prior", g_CSPriorNone);
+   AddAllowedValue("Prior", g_CSPriorWavelet);
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnPriorWeight);
+   ret = CreateProperty("PriorWeight", "10.0", MM::Float, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnPriorIterations);
+   ret = CreateProperty("PriorIterations", "100", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   SetPropertyLimits("PriorIterations", 1, 10000);
+
+   // Every frame is appended to that file with its basis row and time stamps
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnMeasurementFile);
+   ret = CreateProperty("MeasurementFile", "", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnMeasurementCompression);
+   ret = CreateProperty("MeasurementCompression", g_Off, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue("MeasurementCompression", g_Off);
+   AddAllowedValue("MeasurementCompression", g_On);
+
+   // Setting a measurement file there reconstructs it into OutputFile
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnReprocessFile);
+   ret = CreateProperty("ReprocessFile", "", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // Adaptive acquisition: the rows are chosen batch by batch and the run is
+   // stopped as soon as the estimate has converged
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnAdaptive);
+   ret = CreateProperty("Adaptive", g_Off, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue("Adaptive", g_Off);
+   AddAllowedValue("Adaptive", g_On);
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnAdaptiveBatchSize);
+   ret = CreateProperty("AdaptiveBatchSize", "8", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   SetPropertyLimits("AdaptiveBatchSize", 1, g_MaxCSQueueLength);
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnAdaptiveTolerance);
+   ret = CreateProperty("AdaptiveTolerance", "0.01", MM::Float, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnAdaptiveOversampling);
+   ret = CreateProperty("AdaptiveOversampling", "2.0", MM::Float, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnAdaptiveResidual);
+   ret = CreateProperty("AdaptiveResidual", "0", MM::Float, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnAdaptiveSparsity);
+   ret = CreateProperty("AdaptiveSparsity", "0", MM::Float, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CArduinoCSProcessor::OnAdaptiveChange);
+   ret = CreateProperty("AdaptiveChange", "0", MM::Float, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   ret = UpdateStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int CArduinoCSProcessor::Shutdown()
+{
+   MMThreadGuard myLock(lock_);
+   if (solveThread_ != 0) {
+      delete solveThread_;
+      solveThread_ = 0;
    }
+   writer_.Close();
+   initialized_ = false;
+   return DEVICE_OK;
+}
 
-   for (long i=start; i <=end; i++) 
+int CArduinoCSProcessor::Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth)
+{
+   MMThreadGuard myLock(lock_);
+
+   // without a basis, frames just pass through
+   if (!basis_.IsLoaded())
+      return DEVICE_OK;
+
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!solver_.IsInitialized() || width != width_ || height != height_)
    {
-      CPropertyActionEx *pExAct = new CPropertyActionEx(this, &CArduinoInput::OnAnalogInput, i);
-      std::ostringstream os;
-      os << "AnalogInput" << i;
-      ret = CreateProperty(os.str().c_str(), "0.0", MM::Float, true, pExAct);
+      int ret = InitializeSolver(width, height);
       if (ret != DEVICE_OK)
          return ret;
-      // set pull up resistor state for this pin
-      if (strcmp(g_On, pullUp_) == 0) {
-         SetPullUp(i, 1);
-      } else {
-         SetPullUp(i, 0);
+   }
+
+   // During a hardware triggered run the hub knows which row each trigger
+   // displayed, otherwise the firmware steps through the rows in order
+   unsigned row = (unsigned) (framesSeen_ % basis_.GetNumberOfRows());
+   unsigned long arduinoTimeUs = 0;
+   if (hub && hub->IsCSRunActive())
+   {
+      CSRowEvent event;
+      bool found = hub->PopCSRowEvent(event);
+      if (!found && hub->UpdateCSProgress() == DEVICE_OK)
+         found = hub->PopCSRowEvent(event);
+      if (found) {
+         row = event.row;
+         arduinoTimeUs = event.timeUs;
       }
+      else
+         LogMessage("No CS row reported for this frame, assuming the next row", true);
+   }
+   if (measurementFile_ != "")
+   {
+      int ret = StoreFrame(row, arduinoTimeUs, buffer, byteDepth);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   int ret = solver_.AddFrame(row, buffer, byteDepth);
+   if (ret != DEVICE_OK)
+      return ret;
+   framesSeen_++;
+   if (stackMethod_)
+      AccumulateStack(row, buffer, byteDepth);
+
+   if (sampler_.IsActive())
+   {
+      sampler_.MarkMeasured(row);
+      if (++framesInBatch_ < sampler_.GetBatchSize())
+         return DEVICE_OK;
+      framesInBatch_ = 0;
+      bool converged = sampler_.Update(solver_);
+      std::vector<unsigned> rows;
+      if (!converged && sampler_.NextBatch(solver_, rows))
+         return hub ? hub->QueueCSRows(rows) : DEVICE_OK;
 
+      std::ostringstream os;
+      os << "Adaptive CS run " << (converged ? "converged" : "ended") << " after " << solver_.GetRowsAccumulated() << " of " << basis_.GetNumberOfRows() << " rows (change " << sampler_.GetChange() << ", residual " << sampler_.GetResidual() << ", sparsity " << sampler_.GetSparsity() << ")";
+      LogMessage(os.str().c_str(), false);
+      sampler_.Stop();
+      if (hub)
+      {
+         ret = hub->SetCSRunning(false);
+         if (ret != DEVICE_OK)
+            return ret;
+      }
+      if (outputFile_ != "")
+         return SaveEstimate();
+      return DEVICE_OK;
    }
 
-   mThread_ = new ArduinoInputMonitorThread(*this);
-   mThread_->Start();
+   if (row + 1 == basis_.GetNumberOfRows() && outputFile_ != "")
+      return SaveEstimate();
 
-   initialized_ = true;
+   return DEVICE_OK;
+}
 
+// Expects caller to hold lock_
+int CArduinoCSProcessor::InitializeSolver(unsigned width, unsigned height)
+{
+   if (operatorCache_ != "" && (!operators_.IsReady() || operators_.GetLambda() != lambda_))
+   {
+      CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+      int ret = operators_.Prepare(basis_, lambda_, hub ? hub->GetCurrentCSBasisId() : 0, operatorCache_);
+      if (ret != DEVICE_OK)
+         return ret;
+      LogMessage(operators_.IsMapped() ? "Mapped cached CS operators" : "Computed and cached CS operators", true);
+   }
+   // the stack method only needs the rows from the solver
+   unsigned nPixels = stackMethod_ ? 0 : width * height;
+   int ret = solver_.Initialize(basis_, nPixels, lambda_, operatorCache_ != "" ? &operators_ : 0);
+   if (ret != DEVICE_OK)
+      return ret;
+   width_ = width;
+   height_ = height;
+   framesSeen_ = 0;
+   ClearStack();
    return DEVICE_OK;
 }
 
-void CArduinoInput::GetName(char* name) const
+// Frames of the same row are summed in one slot: the least squares estimate
+// only depends on these sums (the solver's Gram matrix counts every frame),
+// so memory grows with the rows, not with the frames.
+// Expects caller to hold lock_
+void CArduinoCSProcessor::AccumulateStack(unsigned row, const unsigned char* buffer, unsigned byteDepth)
 {
-  CDeviceUtils::CopyLimitedString(name, name_.c_str());
+   const unsigned nPixels = width_ * height_;
+   if (stackSlots_.size() != basis_.GetNumberOfRows())
+      stackSlots_.assign(basis_.GetNumberOfRows(), -1);
+   if (stackSlots_[row] < 0)
+   {
+      stackSlots_[row] = (int) stackRows_.size();
+      stackRows_.push_back(row);
+      stack_.resize(stack_.size() + nPixels, 0.0f);
+   }
+   float* sum = &stack_[(size_t) stackSlots_[row] * nPixels];
+   if (byteDepth == 1)
+      for (unsigned p = 0; p < nPixels; p++)
+         sum[p] += buffer[p];
+   else
+      for (unsigned p = 0; p < nPixels; p++)
+         sum[p] += ((const unsigned short*) buffer)[p];
 }
 
-bool CArduinoInput::Busy()
+// Expects caller to hold lock_
+int CArduinoCSProcessor::StoreFrame(unsigned row, unsigned long arduinoTimeUs, const unsigned char* buffer, unsigned byteDepth)
 {
-   return false;
+   if (!writer_.IsOpen())
+   {
+      CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+      int ret = writer_.Open(measurementFile_, width_, height_, byteDepth,
+            hub ? hub->GetCurrentCSBasisId() : 0, CSOperators::Checksum(basis_), compressMeasurements_);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   // one file holds frames of a single format
+   if (writer_.GetWidth() != width_ || writer_.GetHeight() != height_ || writer_.GetByteDepth() != byteDepth)
+      return ERR_CS_STORE;
+
+   CSMeasurementInfo info;
+   info.row = row;
+   info.frame = (unsigned) framesSeen_;
+   info.hostTimeUs = (unsigned long long) (GetCurrentMMTime().getMsec() * 1000.0);
+   info.arduinoTimeUs = arduinoTimeUs;
+   return writer_.Append(info, buffer);
 }
 
-int CArduinoInput::GetDigitalInput(long* state)
+// Reconstructs a recorded measurement file as if its frames were coming in.
+// Expects caller to hold lock_
+int CArduinoCSProcessor::Reprocess(const std::string& path)
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable())
-      return ERR_NO_PORT_SET;
+   if (!basis_.IsLoaded())
+      return ERR_CS_NOT_READY;
 
-   MMThreadGuard myLock(hub->GetLock());
+   CSMeasurementReader reader;
+   int ret = reader.Open(path);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (reader.GetChecksum() != CSOperators::Checksum(basis_))
+      return ERR_CS_BASIS_MISMATCH;
 
-   unsigned char command[1];
-   command[0] = 40;
+   ret = InitializeSolver(reader.GetWidth(), reader.GetHeight());
+   if (ret != DEVICE_OK)
+      return ret;
+   for (unsigned i = 0; i < reader.GetNumberOfFrames(); i++)
+   {
+      CSMeasurementInfo info;
+      const unsigned char* pixels;
+      ret = reader.GetFrame(i, info, pixels);
+      if (ret != DEVICE_OK)
+         return ret;
+      ret = solver_.AddFrame(info.row, pixels, reader.GetByteDepth());
+      if (ret != DEVICE_OK)
+         return ret;
+      framesSeen_++;
+      if (stackMethod_)
+         AccumulateStack(info.row, pixels, reader.GetByteDepth());
+   }
+
+   std::ostringstream os;
+   os << "Reprocessed " << reader.GetNumberOfFrames() << " CS frames from " << path;
+   LogMessage(os.str().c_str(), false);
+   if (outputFile_ != "")
+      return SaveEstimate();
+   return DEVICE_OK;
+}
 
-   int ret = hub->WriteToComPortH((const unsigned char*) command, 1);
+// Expects caller to hold lock_
+int CArduinoCSProcessor::StartAdaptiveRun()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub)
+      return ERR_NO_PORT_SET;
+   if (!basis_.IsLoaded())
+      return ERR_CS_NOT_READY;
+
+   // the convergence test needs the per pixel estimates
+   if (stackMethod_)
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   if (solver_.IsInitialized())
+      solver_.Reset();
+   framesSeen_ = 0;
+   framesInBatch_ = 0;
+   sampler_.Configure(batchSize_, tolerance_, oversampling_);
+   sampler_.Start(basis_);
+
+   std::vector<unsigned> rows;
+   sampler_.NextBatch(solver_, rows);
+   int ret = hub->SetCSRunning(true);
    if (ret != DEVICE_OK)
       return ret;
+   return hub->QueueCSRows(rows);
+}
 
-   unsigned char answer[2];
-   ret = ReadNBytes(hub, 2, answer);
+void CArduinoCSProcessor::ClearStack()
+{
+   stack_.clear();
+   stackRows_.clear();
+   stackSlots_.clear();
+}
+
+// Expects caller to hold lock_
+int CArduinoCSProcessor::SolveStack(std::vector<float>& estimate)
+{
+   if (stackRows_.empty())
+      return ERR_CS_NOT_READY;
+
+   std::vector<float> w;
+   int ret = solver_.GetStackOperator(stackRows_, w);
    if (ret != DEVICE_OK)
       return ret;
 
-   if (answer[0] != 40)
-      return ERR_COMMUNICATION;
+   const unsigned n = solver_.GetNumberOfElements();
+   const unsigned nPixels = width_ * height_;
+   estimate.resize((size_t) n * nPixels);
+   CSMultiplyStack(&w[0], n, (unsigned) stackRows_.size(), &stack_[0], nPixels, &estimate[0], threads_);
+   return DEVICE_OK;
+}
 
-   if (strcmp("All", pins_) != 0) {
-      answer[1] = answer[1] >> pin_;
-      answer[1] &= answer[1] & 1;
+// Collects what the solve thread needs for a wavelet prior reconstruction
+// Expects caller to hold lock_
+int CArduinoCSProcessor::PrepareWavelet(CSWaveletJob& job)
+{
+   const unsigned n = solver_.GetNumberOfElements();
+   const unsigned nPixels = width_ * height_;
+
+   std::vector<float>& aty = job.aty;
+   int ret;
+   if (stackMethod_)
+   {
+      if (stackRows_.empty())
+         return ERR_CS_NOT_READY;
+      std::vector<float> at;
+      ret = solver_.GetStackTranspose(stackRows_, at);
+      if (ret != DEVICE_OK)
+         return ret;
+      aty.resize((size_t) n * nPixels);
+      CSMultiplyStack(&at[0], n, (unsigned) stackRows_.size(), &stack_[0], nPixels, &aty[0], threads_);
+   }
+   else
+   {
+      ret = solver_.GetATyPlanes(aty);
+      if (ret != DEVICE_OK)
+         return ret;
    }
-   
-   *state = (long) answer[1];
 
+   solver_.GetGram(job.gram);
+   job.lipschitz = solver_.GetLipschitz();
+   job.n = n;
+   job.width = width_;
+   job.height = height_;
+   job.weight = priorWeight_;
+   job.iterations = priorIterations_;
+   job.threads = threads_;
+   job.rows = solver_.GetRowsAccumulated();
+   job.path = outputFile_;
    return DEVICE_OK;
 }
 
-int CArduinoInput::ReportStateChange(long newState)
+// The wavelet prior reconstruction is left to the solve thread, the others
+// are written right away
+// Expects caller to hold lock_
+int CArduinoCSProcessor::SaveEstimate()
+{
+   int ret;
+   if (waveletPrior_)
+   {
+      CSWaveletJob job;
+      ret = PrepareWavelet(job);
+      if (ret != DEVICE_OK)
+         return ret;
+      if (solveThread_ == 0)
+         solveThread_ = new ArduinoCSSolveThread(*this);
+      solveThread_->Submit(job);
+      return DEVICE_OK;
+   }
+
+   std::vector<float> estimate;
+   ret = stackMethod_ ? SolveStack(estimate) : solver_.GetEstimate(estimate);
+   if (ret != DEVICE_OK)
+      return ret;
+   return WriteEstimate(outputFile_, estimate, solver_.GetNumberOfElements(), width_, height_,
+         solver_.GetRowsAccumulated());
+}
+
+int CArduinoCSProcessor::WriteEstimate(const std::string& path, const std::vector<float>& estimate, unsigned n,
+      unsigned width, unsigned height, unsigned long rows) const
 {
+   FILE* fp = fopen(path.c_str(), "wb");
+   if (fp == 0)
+      return ERR_WRITE_FAILED;
+   size_t written = fwrite(&estimate[0], sizeof(float), estimate.size(), fp);
+   fclose(fp);
+   if (written != estimate.size())
+      return ERR_WRITE_FAILED;
+
    std::ostringstream os;
-   os << newState;
-   return OnPropertyChanged("DigitalInput", os.str().c_str());
+   os << "Saved CS estimate (" << n << " planes of " << width << "x" << height << ") after " << rows << " rows to " << path;
+   LogMessage(os.str().c_str(), false);
+   return DEVICE_OK;
 }
 
-
 ///////////////////////////////////////////////////////////////////////////////
 // Action handlers
 ///////////////////////////////////////////////////////////////////////////////
 
-int CArduinoInput::OnDigitalInput(MM::PropertyBase*  pProp, MM::ActionType eAct)
+int CArduinoCSProcessor::OnBasisFile(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
    if (eAct == MM::BeforeGet)
    {
-      long state;
-      int ret = GetDigitalInput(&state);
+      pProp->Set(basis_.GetPath().c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string path;
+      pProp->Get(path);
+      MMThreadGuard myLock(lock_);
+      solver_ = CSIncrementalSolver();
+      operators_.Clear();
+      // a measurement file holds frames of a single basis
+      int ret = writer_.Close();
       if (ret != DEVICE_OK)
          return ret;
-
-      pProp->Set(state);
+      if (path == "") {
+         basis_.Clear();
+         return DEVICE_OK;
+      }
+      ret = basis_.Load(path);
+      if (ret == ERR_CS_BASIS_FILE && !std::ifstream(path.c_str()))
+         ret = RecoverBasis(path);
+      else if (ret == DEVICE_OK && verifyBasis_)
+         ret = VerifyBasis();
+      if (ret != DEVICE_OK) {
+         basis_.Clear();
+         return ret;
+      }
+      std::ostringstream os;
+      os << "Loaded CS basis with " << basis_.GetNumberOfRows() << " rows and " << basis_.GetNumberOfElements() << " elements from " << path;
+      LogMessage(os.str().c_str(), false);
    }
-
    return DEVICE_OK;
 }
 
-int CArduinoInput::OnAnalogInput(MM::PropertyBase* pProp, MM::ActionType eAct, long  channel )
+// Without its CSV file, the basis is read back from the firmware and saved
+// under that path.  The values are the DAC codes the firmware plays.  A CS
+// group is read board by board, each board giving its slice of the elements.
+int CArduinoCSProcessor::RecoverBasis(const std::string& path)
 {
    CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable())
-      return ERR_NO_PORT_SET;
-
-   if (eAct == MM::BeforeGet)
+   if (!hub || hub->GetCurrentCSBasisId() == 0)
+      return ERR_CS_BASIS_FILE;
+
+   std::vector<CArduinoHub*> hubs;
+   hub->GetCSGroup(hubs);
+   std::vector<std::vector<double> > slices(hubs.size());
+   std::vector<unsigned> widths(hubs.size());
+   unsigned nRows = 0;
+   unsigned nElements = 0;
+   for (unsigned h = 0; h < hubs.size(); h++)
    {
-      MMThreadGuard myLock(hub->GetLock());
-
-      unsigned char command[2];
-      command[0] = 41;
-      command[1] = (unsigned char) channel;
-
-      int ret = hub->WriteToComPortH((const unsigned char*) command, 2);
+      unsigned rows;
+      int ret = hubs[h]->ReadCSBasis(hubs[h]->GetCSBasisIndex(), rows, widths[h], slices[h]);
       if (ret != DEVICE_OK)
          return ret;
+      if (h > 0 && rows != nRows)
+         return ERR_CS_BASIS_DIFFERS;
+      nRows = rows;
+      nElements = std::max(nElements, hubs[h]->GetCSGroupOffset() + widths[h]);
+   }
+   std::vector<double> values((size_t) nRows * nElements, 0.0);
+   for (unsigned h = 0; h < hubs.size(); h++)
+      for (unsigned r = 0; r < nRows; r++)
+         for (unsigned i = 0; i < widths[h]; i++)
+            values[(size_t) r * nElements + hubs[h]->GetCSGroupOffset() + i] = slices[h][(size_t) r * widths[h] + i];
+   basis_.Assign(nRows, nElements, values, path);
+   int ret = basis_.Save(path);
+   if (ret != DEVICE_OK)
+      return ret;
 
-      unsigned char answer[4];
-      ret = ReadNBytes(hub, 4, answer);
+   std::ostringstream os;
+   os << "Recovered CS basis " << hub->GetCurrentCSBasisId() << " from the Arduino into " << path;
+   LogMessage(os.str().c_str(), false);
+   return DEVICE_OK;
+}
+
+// The basis file has to give the DAC codes the firmware plays, once rounded
+// and clamped to 12 bits as the exporter does.  In a CS group every board
+// is compared with its slice of the elements.
+int CArduinoCSProcessor::VerifyBasis()
+{
+   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+   if (!hub || hub->GetCurrentCSBasisId() == 0)
+      return DEVICE_OK;
+
+   std::vector<CArduinoHub*> hubs;
+   hub->GetCSGroup(hubs);
+   unsigned covered = 0;
+   for (unsigned h = 0; h < hubs.size(); h++)
+   {
+      unsigned rows, values;
+      std::vector<double> codes;
+      int ret = hubs[h]->ReadCSBasis(hubs[h]->GetCSBasisIndex(), rows, values, codes);
       if (ret != DEVICE_OK)
          return ret;
+      unsigned offset = hubs[h]->GetCSGroupOffset();
+      if (rows != basis_.GetNumberOfRows() || offset + values > basis_.GetNumberOfElements())
+         return ERR_CS_BASIS_DIFFERS;
+      covered += values;
+      for (unsigned r = 0; r < rows; r++)
+      {
+         const double* row = basis_.GetRow(r) + offset;
+         for (unsigned i = 0; i < values; i++)
+         {
+            double code = std::min(4095.0, std::max(0.0, floor(row[i] + 0.5)));
+            if (code != codes[r * values + i])
+            {
+               std::ostringstream os;
+               os << "CS basis differs from the Arduino at row " << r << ", value " << offset + i << ": " << code << " instead of " << codes[r * values + i];
+               LogMessage(os.str().c_str(), false);
+               return ERR_CS_BASIS_DIFFERS;
+            }
+         }
+      }
+   }
+   // the slices have to cover the whole basis
+   if (covered != basis_.GetNumberOfElements())
+      return ERR_CS_BASIS_DIFFERS;
+   return DEVICE_OK;
+}
 
-      if (answer[0] != 41)
-         return ERR_COMMUNICATION;
-      if (answer[1] != channel)
-         return ERR_COMMUNICATION;
-
-      int tmp = answer[2];
-      tmp = tmp << 8;
-      tmp = tmp | answer[3];
+int CArduinoCSProcessor::OnVerifyBasis(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(verifyBasis_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string verify;
+      pProp->Get(verify);
+      MMThreadGuard myLock(lock_);
+      // takes effect with the next basis file
+      verifyBasis_ = verify == g_On;
+   }
+   return DEVICE_OK;
+}
 
-      pProp->Set((long) tmp);
+int CArduinoCSProcessor::OnRegularization(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(lambda_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double lambda;
+      pProp->Get(lambda);
+      if (lambda <= 0.0)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      MMThreadGuard myLock(lock_);
+      lambda_ = lambda;
+      // takes effect with the next frame
+      solver_ = CSIncrementalSolver();
    }
    return DEVICE_OK;
 }
 
-int CArduinoInput::SetPullUp(int pin, int state)
+int CArduinoCSProcessor::OnReset(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
-   if (!hub || !hub->IsPortAvailable())
-      return ERR_NO_PORT_SET;
+   if (eAct == MM::AfterSet)
+   {
+      std::string reset;
+      pProp->Get(reset);
+      if (reset == "Reset")
+      {
+         MMThreadGuard myLock(lock_);
+         if (solver_.IsInitialized())
+            solver_.Reset();
+         framesSeen_ = 0;
+         ClearStack();
+      }
+      pProp->Set("Idle");
+   }
+   return DEVICE_OK;
+}
 
-   MMThreadGuard myLock(hub->GetLock());
+int CArduinoCSProcessor::OnRowsAccumulated(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard myLock(lock_);
+      pProp->Set((long) solver_.GetRowsAccumulated());
+   }
+   return DEVICE_OK;
+}
 
-   const int nrChrs = 3;
-   unsigned char command[nrChrs];
-   command[0] = 42;
-   command[1] = (unsigned char) pin;
-   command[2] = (unsigned char) state;
+int CArduinoCSProcessor::OnOutputFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(outputFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      MMThreadGuard myLock(lock_);
+      pProp->Get(outputFile_);
+   }
+   return DEVICE_OK;
+}
 
-   int ret = hub->WriteToComPortH((const unsigned char*) command, nrChrs);
-   if (ret != DEVICE_OK)
-      return ret;
+int CArduinoCSProcessor::OnOperatorCache(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(operatorCache_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      MMThreadGuard myLock(lock_);
+      pProp->Get(operatorCache_);
+      // takes effect with the next frame
+      operators_.Clear();
+      solver_ = CSIncrementalSolver();
+   }
+   return DEVICE_OK;
+}
 
-   unsigned char answer[3];
-   ret = ReadNBytes(hub, 3, answer);
-   if (ret != DEVICE_OK)
-      return ret;
+int CArduinoCSProcessor::OnMethod(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(stackMethod_ ? g_CSMethodStack : g_CSMethodIncremental);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string method;
+      pProp->Get(method);
+      MMThreadGuard myLock(lock_);
+      if (sampler_.IsActive())
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      stackMethod_ = method == g_CSMethodStack;
+      // takes effect with the next frame
+      solver_ = CSIncrementalSolver();
+      ClearStack();
+   }
+   return DEVICE_OK;
+}
 
-   if (answer[0] != 42)
-      return ERR_COMMUNICATION;
-   if (answer[1] != pin)
-      return ERR_COMMUNICATION;
+int CArduinoCSProcessor::OnThreads(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long) threads_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long threads;
+      pProp->Get(threads);
+      if (threads < 1)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      MMThreadGuard myLock(lock_);
+      threads_ = (unsigned) threads;
+   }
+   return DEVICE_OK;
+}
 
+int CArduinoCSProcessor::OnPrior(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(waveletPrior_ ? g_CSPriorWavelet : g_CSPriorNone);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string prior;
+      pProp->Get(prior);
+      MMThreadGuard myLock(lock_);
+      waveletPrior_ = prior == g_CSPriorWavelet;
+   }
    return DEVICE_OK;
 }
 
+int CArduinoCSProcessor::OnPriorWeight(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(priorWeight_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double weight;
+      pProp->Get(weight);
+      if (weight < 0.0)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      MMThreadGuard myLock(lock_);
+      priorWeight_ = weight;
+   }
+   return DEVICE_OK;
+}
 
-int CArduinoInput::ReadNBytes(CArduinoHub* hub, unsigned int n, unsigned char* answer)
+int CArduinoCSProcessor::OnPriorIterations(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   MM::MMTime startTime = GetCurrentMMTime();
-   unsigned long bytesRead = 0;
-   while ((bytesRead < n) && ( (GetCurrentMMTime() - startTime).getMsec() < 500)) {
-      unsigned long bR;
-      int ret = hub->ReadFromComPortH(answer + bytesRead, n - bytesRead, bR);
-      if (ret != DEVICE_OK)
-         return ret;
-      bytesRead += bR;
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long) priorIterations_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long iterations;
+      pProp->Get(iterations);
+      if (iterations < 1)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      MMThreadGuard myLock(lock_);
+      priorIterations_ = (unsigned) iterations;
    }
+   return DEVICE_OK;
+}
 
+int CArduinoCSProcessor::OnMeasurementFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(measurementFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      MMThreadGuard myLock(lock_);
+      // the file is created with the next frame
+      int ret = writer_.Close();
+      pProp->Get(measurementFile_);
+      return ret;
+   }
    return DEVICE_OK;
 }
 
-ArduinoInputMonitorThread::ArduinoInputMonitorThread(CArduinoInput& aInput) :
-   state_(0),
-   aInput_(aInput)
+int CArduinoCSProcessor::OnMeasurementCompression(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(compressMeasurements_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string compress;
+      pProp->Get(compress);
+      MMThreadGuard myLock(lock_);
+      // takes effect with the next measurement file
+      compressMeasurements_ = compress == g_On;
+   }
+   return DEVICE_OK;
 }
 
-ArduinoInputMonitorThread::~ArduinoInputMonitorThread()
+int CArduinoCSProcessor::OnReprocessFile(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   Stop();
-   wait();
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(reprocessFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      MMThreadGuard myLock(lock_);
+      pProp->Get(reprocessFile_);
+      if (reprocessFile_ == "")
+         return DEVICE_OK;
+      if (reprocessFile_ == measurementFile_)
+         return ERR_CS_STORE;
+      return Reprocess(reprocessFile_);
+   }
+   return DEVICE_OK;
 }
 
-int ArduinoInputMonitorThread::svc() 
+int CArduinoCSProcessor::OnAdaptive(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   while (!stop_)
+   if (eAct == MM::BeforeGet)
    {
-      long state;
-      int ret = aInput_.GetDigitalInput(&state);
-      if (ret != DEVICE_OK)
+      pProp->Set(sampler_.IsActive() ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string adaptive;
+      pProp->Get(adaptive);
+      MMThreadGuard myLock(lock_);
+      if (adaptive == g_On && !sampler_.IsActive())
+         return StartAdaptiveRun();
+      if (adaptive == g_Off && sampler_.IsActive())
       {
-         stop_ = true;
-         return ret;
+         sampler_.Stop();
+         CArduinoHub* hub = static_cast<CArduinoHub*>(GetParentHub());
+         if (hub)
+            return hub->SetCSRunning(false);
       }
+   }
+   return DEVICE_OK;
+}
 
-      if (state != state_) 
-      {
-         aInput_.ReportStateChange(state);
-         state_ = state;
-      }
-      CDeviceUtils::SleepMs(500);
+int CArduinoCSProcessor::OnAdaptiveBatchSize(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long) batchSize_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long batchSize;
+      pProp->Get(batchSize);
+      if (batchSize < 1 || batchSize > (long) g_MaxCSQueueLength)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      // takes effect with the next adaptive run
+      MMThreadGuard myLock(lock_);
+      batchSize_ = (unsigned) batchSize;
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoCSProcessor::OnAdaptiveTolerance(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(tolerance_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double tolerance;
+      pProp->Get(tolerance);
+      if (tolerance <= 0.0)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      MMThreadGuard myLock(lock_);
+      tolerance_ = tolerance;
    }
    return DEVICE_OK;
 }
 
+int CArduinoCSProcessor::OnAdaptiveOversampling(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(oversampling_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double oversampling;
+      pProp->Get(oversampling);
+      if (oversampling < 0.0)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      MMThreadGuard myLock(lock_);
+      oversampling_ = oversampling;
+   }
+   return DEVICE_OK;
+}
 
-void ArduinoInputMonitorThread::Start()
+int CArduinoCSProcessor::OnAdaptiveResidual(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   stop_ = false;
-   activate();
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard myLock(lock_);
+      pProp->Set(sampler_.GetResidual());
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoCSProcessor::OnAdaptiveSparsity(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard myLock(lock_);
+      pProp->Set(sampler_.GetSparsity());
+   }
+   return DEVICE_OK;
+}
+
+int CArduinoCSProcessor::OnAdaptiveChange(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard myLock(lock_);
+      pProp->Set(sampler_.GetChange());
+   }
+   return DEVICE_OK;
 }
 
 /**************************
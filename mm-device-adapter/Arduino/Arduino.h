@@ -18,9 +18,17 @@
 
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
+#include "CSReconstruction.h"
+#include "CSMeasurementStore.h"
+#include "ArduinoTraffic.h"
+#include "ArduinoLog.h"
 #include <string>
 #include <sstream>
 #include <map>
+#include <deque>
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
@@ -34,6 +42,13 @@
 #define ERR_COMMUNICATION 107
 #define ERR_NO_PORT_SET 108
 #define ERR_VERSION_MISMATCH 109
+#define ERR_CS_BASIS_FILE 110
+#define ERR_CS_BASIS_MISMATCH 111
+#define ERR_CS_NOT_READY 112
+#define ERR_CS_STORE 113
+#define ERR_CS_BASIS_DIFFERS 114
+#define ERR_TRAFFIC_FILE 115
+#define ERR_PRESET_UNDEFINED 116
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -57,6 +72,137 @@
 
 
 class ArduinoInputMonitorThread;
+class ArduinoCSProgressThread;
+class ArduinoShadowThread;
+class ArduinoCommandThread;
+class ArduinoCSSolveThread;
+
+// State of the board as last written or read by the hub (see
+// CArduinoHub::GetShadow), so that property reads need not go to the board
+enum ArduinoShadowKey
+{
+   shadowCSMode,
+   shadowExposure,
+   shadowPattern,     // last digital output pattern sent (command 1)
+   shadowDA1,         // DAC values sent (command 3)
+   shadowDA2,
+   shadowBlanking,
+   shadowBlankOnLow,  // blanking trigger direction (command 22)
+   shadowPreset,      // last preset recalled, sets the outputs above
+   shadowDigitalInputs,
+   shadowAnalogInput0, // one per analog input
+   shadowKeys = shadowAnalogInput0 + 6
+};
+
+// Output state stored on the board (firmware command 15) and recalled with
+// command 19
+struct ArduinoPreset
+{
+   bool defined;
+   unsigned char pattern;
+   unsigned da1; // DAC codes
+   unsigned da2;
+   bool blanking;
+   bool blankOnLow;
+};
+
+// One basis row advance of a CS run, as reported by the firmware
+struct CSRowEvent
+{
+   unsigned row;
+   unsigned long timeUs; // micros() on the Arduino at the rising edge of the trigger
+};
+
+// Wakes the threads that wait for the command queue of the hub to change.
+// MMDevice has no condition variable: a Win32 one on Windows, pthread
+// elsewhere.  A waiter takes the generation before it checks its condition,
+// so that a change in between is not missed.
+class ArduinoCommandSignal
+{
+public:
+   ArduinoCommandSignal();
+   ~ArduinoCommandSignal();
+
+   unsigned long GetGeneration();
+   // returns when the generation is no longer the one given, or after maxMs
+   void Wait(unsigned long generation, long maxMs);
+   void Notify();
+
+private:
+   ArduinoCommandSignal(const ArduinoCommandSignal&);
+   ArduinoCommandSignal& operator=(const ArduinoCommandSignal&);
+
+   unsigned long generation_;
+#ifdef WIN32
+   void* section_; // CRITICAL_SECTION
+   void* condition_; // CONDITION_VARIABLE
+#else
+   pthread_mutex_t mutex_;
+   pthread_cond_t condition_;
+#endif
+};
+
+// Wall time from sending a command to the first byte of its answer, per
+// opcode, in buckets of powers of two microseconds.  Recorded by the hub
+// while it holds the port lock, so that recording needs no lock of its own;
+// readers take the counts as they are.
+class ArduinoLatencyStats
+{
+public:
+   enum {nBuckets = 24}; // below 2 us, 4 us, ... 16 s, longer
+   ArduinoLatencyStats() {Reset();}
+
+   void Reset();
+   void Record(unsigned char opcode, unsigned long us)
+   {
+      unsigned b = 0;
+      while ((us >> (b + 1)) != 0 && b < nBuckets - 1)
+         b++;
+      counts_[opcode][b]++;
+      if (us > maxUs_[opcode])
+         maxUs_[opcode] = us;
+   }
+   void RecordTimeout(unsigned char opcode) {timeouts_[opcode]++;}
+
+   unsigned long GetCount(unsigned char opcode) const;
+   unsigned long GetTimeouts(unsigned char opcode) const {return timeouts_[opcode];}
+   unsigned long GetMax(unsigned char opcode) const {return maxUs_[opcode];}
+   // upper bound of the bucket holding the fraction p of the answers
+   unsigned long GetPercentile(unsigned char opcode, double p) const;
+   // "opcode: count, p50, p99, max, timeouts" of every opcode sent
+   std::string GetSummary() const;
+
+private:
+   unsigned long counts_[256][nBuckets];
+   unsigned long timeouts_[256];
+   unsigned long maxUs_[256];
+};
+
+// Counters of the firmware (command 13), the trigger mode ones are reset
+// when a sequence starts
+struct ArduinoTelemetry
+{
+   unsigned long triggers;
+   unsigned long patternAdvances;
+   unsigned long missedEdges;     // rising edges loop() did not see
+   unsigned long loopMaxUs;
+   unsigned long loopHistogram[8]; // below 8, 16, ... 512 us, longer
+   unsigned long bytesIn;
+   unsigned long bytesOut;
+};
+
+// A basis of the bank stored in the firmware
+struct CSBasisInfo
+{
+   int id;            // hashCode of the basis
+   unsigned rows;
+   unsigned values;   // per row
+   unsigned encoding; // bits per stored value
+   // only known after a readback (command 37)
+   unsigned shift;    // 8-bit values are shifted left by this
+   unsigned high;     // DAC word of a set bit of a 1-bit basis
+   unsigned control;  // control bits of the DAC words
+};
 
 class CArduinoHub : public HubBase<CArduinoHub>  
 {
@@ -79,6 +225,33 @@ public:
    int OnVersion(MM::PropertyBase* pPropt, MM::ActionType eAct);
    int OnCSOnOff(MM::PropertyBase* pProp, MM::ActionType pAct); // CS mode
    int OnExposureChanged(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnExposureTable(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSRun(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSCurrentRow(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSRowsCompleted(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSMissedTriggers(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSRow(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSRowUpdateTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSRowUpdateTimeMax(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSBasis(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSBasisId(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSGroup(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSGroupRole(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSGroupOffset(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCSGroupSyncErrors(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTelemetry(MM::PropertyBase* pProp, MM::ActionType eAct, long counter);
+   int OnLatencyCommand(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLatency(MM::PropertyBase* pProp, MM::ActionType eAct, long statistic);
+   int OnLatencyReset(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTrafficRecording(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTrafficRecordsWritten(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTrafficReplay(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTrafficReplayReport(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLogLevel(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnShadowMaxAge(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLinkCounter(MM::PropertyBase* pProp, MM::ActionType eAct, long counter);
+   int OnAsyncCommands(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTransaction(MM::PropertyBase* pProp, MM::ActionType eAct);
    //int ReadNBytes(CArduinoHub* hub, unsigned int n, unsigned char* answer);
 
    // custom interface for child devices
@@ -86,34 +259,233 @@ public:
    bool IsLogicInverted() {return invertedLogic_;}
    bool IsTimedOutputActive() {return timedOutputActive_;}
    void SetTimedOutput(bool active) {timedOutputActive_ = active;}
+   bool IsSequenceActive() {return sequenceActive_;}
+   void SetSequenceActive(bool active) {sequenceActive_ = active;}
 
    int PurgeComPortH() {return PurgeComPort(port_.c_str());}
-   int WriteToComPortH(const unsigned char* command, unsigned len) {return WriteToComPort(port_.c_str(), command, len);}
-   int ReadFromComPortH(unsigned char* answer, unsigned maxLen, unsigned long& bytesRead)
-   {
-      return ReadFromComPort(port_.c_str(), answer, maxLen, bytesRead);
-   }
+   // These record the latency of every command, see ArduinoLatencyStats,
+   // and the traffic of the calling device (the hub when 0) while recording
+   int WriteToComPortH(const unsigned char* command, unsigned len, const MM::Device* caller = 0);
+   int ReadFromComPortH(unsigned char* answer, unsigned maxLen, unsigned long& bytesRead, const MM::Device* caller = 0);
+   int GetSerialAnswerH(std::string& answer, const MM::Device* caller = 0);
    static MMThreadLock& GetLock() {return lock_;}
    void SetShutterState(unsigned state) {shutterState_ = state;}
    void SetSwitchState(unsigned state) {switchState_ = state;}
    unsigned GetShutterState() {return shutterState_;}
    unsigned GetSwitchState() {return switchState_;}
 
+   // Shadow of the board state.  Written values are kept until the next
+   // write; inputs go stale after ShadowMaxAge and are read again in the
+   // background while they are being queried.
+   void SetShadow(int key, long value);
+   // the board changed it on its own
+   void InvalidateShadow(int key);
+   // false when the value is unknown or stale
+   bool GetShadow(int key, long& value);
+   void RevalidateShadow();
+   long GetShadowPeriodMs();
+
+   // Sends a binary command and reads its answer of answerLen bytes, which
+   // echoes the opcode.  After a timeout or a wrong echo the link is
+   // resynchronized and the command sent again.
+   // Expects caller to guard the port
+   int Transact(const unsigned char* command, unsigned len, unsigned char* answer, unsigned answerLen,
+         const MM::Device* caller = 0);
+
+   // Sends a device command through Transact and on success writes
+   // shadowValue into the shadow under shadowKey.  With AsyncCommands on,
+   // the command is queued and sent by a background thread, and the call
+   // returns at once; when an earlier queued command of the device failed,
+   // its error is returned instead and nothing is queued.
+   // Takes the port lock, callers must not hold it
+   int SendCommand(const MM::Device* device, const unsigned char* command, unsigned len, unsigned answerLen,
+         int shadowKey, long shadowValue);
+   bool IsCommandPending(const MM::Device* device);
+   // waits until the queued commands of the device have been sent, returns
+   // the first error among them
+   int WaitForCommands(const MM::Device* device);
+   // sends the oldest queued command, false when there was none
+   bool SendQueuedCommand();
+   // waits until the commands queued by all devices have been sent.  Callers
+   // that go to the port themselves call it before they take the port lock
+   void WaitForAllCommands();
+   // for the command thread: returns when the queue may have changed
+   void WaitForQueueChange(unsigned long generation, long maxMs) {commandSignal_.Wait(generation, maxMs);}
+   unsigned long GetQueueGeneration() {return commandSignal_.GetGeneration();}
+   void NotifyQueueChange() {commandSignal_.Notify();}
+
+   // Between BeginTransaction and CommitTransaction, the commands given to
+   // SendCommand by the thread that began the transaction are collected, a
+   // later one replacing an earlier one with the same shadow key; other
+   // threads send theirs as usual.  The commit sends them as one frame
+   // (command 14) that the board applies at once, after the queued commands.
+   // A failure is returned by the commit only.
+   // Transactions nest, the outermost commit sends.
+   void BeginTransaction();
+   int CommitTransaction();
+
+   // Presets stored on the board, see ArduinoPreset.  ReadPresets fetches
+   // them all (command 18), StorePreset writes one (command 15).
+   // Expects caller to guard the port
+   enum {numPresets = 16};
+   int ReadPresets();
+   int StorePreset(unsigned index, const ArduinoPreset& preset);
+   bool GetPreset(unsigned index, ArduinoPreset& preset);
+
+   // Expects caller to guard the port, these update the shadow
+   int ReadCSMode(long& mode);
+   int ReadDigitalInputs(unsigned char& bits, const MM::Device* caller = 0);
+   int ReadAnalogInput(unsigned channel, long& value, const MM::Device* caller = 0);
+
+   // Expects caller to guard the port
+   int ReadTelemetry(ArduinoTelemetry& telemetry);
+   static std::string FormatTelemetry(const ArduinoTelemetry& telemetry);
+
+   // id of the basis compiled into the firmware, 0 without CS support
+   int GetCurrentCSBasisId() {return cs_firmware_ ? cs_basis_id_ : 0;}
+   bool IsCSFirmware() {return cs_firmware_ != 0;}
+   bool HasOutputCommands();
+
+   // hardware triggered CS runs
+   bool IsCSRunActive() {return csRunActive_;}
+   int SetCSRunning(bool running);
+   int UpdateCSProgress();
+   bool PopCSRowEvent(CSRowEvent& event);
+   int QueueCSRows(const std::vector<unsigned>& rows);
+
+   // basis index of the bank as stored in the firmware, as 12-bit DAC codes
+   // (row-major, values per row)
+   int ReadCSBasis(unsigned index, unsigned& rows, unsigned& values, std::vector<double>& codes);
+   unsigned GetCSBasisIndex() {return csBasisIndex_;}
+
+   // CS group: boards that play slices of one basis on a shared trigger.  The
+   // leader forwards runs, row orders, exposures and basis selections to the
+   // followers and checks that they play the same rows.
+   // hubs gets the leader and its followers (only this hub outside a group)
+   void GetCSGroup(std::vector<CArduinoHub*>& hubs);
+   unsigned GetCSGroupOffset() {return csGroupOffset_;} // first basis element of this board
+   void CheckCSGroupSync(bool stopped);
+
 private:
    int GetControllerVersion(int&);
    int GetCSMode(int&); // Check if the Arduino firmware supports CS
    int GetCSBasisId(int& basis_id); // Get the hashCode of the basis loaded on the Arduino
+   int GetCSBases(std::vector<CSBasisInfo>& bases, unsigned& selected);
+   int SelectCSBasis(unsigned index);
+   std::string GetCSBasisLabel(unsigned index) const;
+   bool AreCSRowsValid(const std::vector<unsigned>& rows) const;
+   int ReadCSBasisChunks(unsigned index, unsigned first, unsigned count, CSBasisInfo& info,
+         std::vector<unsigned char>& data, std::vector<bool>& received);
+   void GetCSGroupFollowers(std::vector<CArduinoHub*>& followers);
+   int SendExposureTable(const std::vector<unsigned long>& exposuresUs);
+   int ReadNBytes(unsigned int n, unsigned char* answer, const MM::Device* caller = 0);
+   int TransactOnce(const unsigned char* command, unsigned len, unsigned char* answer, unsigned answerLen,
+         const MM::Device* caller);
+   void DrainComPort(long maxMs = 500);
+   int Resync();
+   int SendCommandNow(const MM::Device* device, const unsigned char* command, unsigned len,
+         unsigned answerLen, int shadowKey, long shadowValue);
+   int StartCSRun();
+   int StopCSRun();
+   int SendPlaylist(const std::vector<unsigned>& rows);
+   int WritePlaylist(const std::vector<unsigned>& rows);
+   int WriteCSQueue(const std::vector<unsigned>& rows);
+   int SendExposure(long exposureMs);
+   int GetCSRowUpdateTime(unsigned long& lastUs, unsigned long& maxUs);
+   void RecordAnswer();
+   void RecordTimeout();
+   void RecordTraffic(unsigned char direction, const MM::Device* caller, const unsigned char* data, unsigned long length);
+   int ReplayTraffic(const std::string& path, bool writes, std::string& report);
    std::string port_;
    bool initialized_;
    bool portAvailable_;
    bool invertedLogic_;
    bool timedOutputActive_;
+   bool sequenceActive_; // a pattern or preset sequence is running
    int version_;
    static MMThreadLock lock_;
    unsigned switchState_;
    unsigned shutterState_;
    int cs_firmware_; // 1 if the Arduino firmware is compatible with CS
    int cs_basis_id_; // The hashCode of the basis on the Arduino
+   std::vector<CSBasisInfo> csBases_; // bank of bases in the firmware
+   unsigned csBasisIndex_; // selected basis of the bank
+   std::string exposureTable_; // per basis row exposures (ms), comma separated
+   std::vector<unsigned long> exposuresUs_; // the same as sent to the board
+   std::vector<unsigned> csPlaylist_; // as sent to the board
+   bool csRunActive_;
+   long csCurrentRow_;
+   unsigned long csRowsCompleted_;
+   unsigned long csMissedTriggers_;
+   std::deque<CSRowEvent> csRowEvents_; // not yet consumed by the CS processor
+   // recent rows by number of rows completed, for the group sync check
+   std::deque<std::pair<unsigned long, unsigned> > csRowLog_;
+   std::string csGroup_;
+   bool csGroupLeader_;
+   unsigned csGroupOffset_;
+   unsigned long csSyncErrors_;
+   static std::vector<CArduinoHub*> csHubs_; // initialized hubs with CS firmware
+   static MMThreadLock csHubsLock_;
+   MMThreadLock csEventLock_;
+   ArduinoCSProgressThread* csThread_;
+   ArduinoLatencyStats latency_;
+   int latencyOpcode_; // command waiting for its answer, -1 if none
+   MM::MMTime latencyStart_;
+   unsigned char latencyCommand_; // reported by the Latency properties
+   ArduinoTrafficRecorder traffic_;
+   std::map<const MM::Device*, unsigned char> trafficDevices_; // index in the recording
+   MM::MMTime trafficStart_;
+   ArduinoTelemetry telemetry_; // last read, see OnTelemetry
+   MM::MMTime telemetryTime_;
+   bool telemetryValid_;
+   std::string trafficReport_; // of the last replay
+   struct ShadowEntry
+   {
+      long value;
+      bool valid;
+      MM::MMTime time;     // of the last write or read of the board
+      MM::MMTime lastRead; // of the last GetShadow
+   };
+   ShadowEntry shadow_[shadowKeys];
+   long shadowMaxAgeMs_; // 0 reads the inputs from the board every time
+   MMThreadLock shadowLock_;
+   ArduinoShadowThread* shadowThread_;
+   unsigned long linkResyncs_;
+   unsigned long linkResyncFailures_;
+   unsigned long linkRetries_; // commands that succeeded after a resync
+   struct QueuedCommand
+   {
+      const MM::Device* device;
+      unsigned char command[4];
+      unsigned len;
+      unsigned answerLen;
+      int shadowKey;
+      long shadowValue;
+   };
+   bool asyncCommands_;
+   unsigned transactionDepth_;
+#ifdef WIN32
+   unsigned long transactionThread_; // that began the transaction
+#else
+   pthread_t transactionThread_;
+#endif
+   bool propertyTransaction_; // opened through the Transaction property
+   std::vector<QueuedCommand> transaction_;
+   std::deque<QueuedCommand> commandQueue_;
+   std::map<const MM::Device*, unsigned> commandsPending_; // queued or being sent
+   std::map<const MM::Device*, int> commandErrors_; // not yet reported
+   MMThreadLock commandLock_;
+   ArduinoCommandSignal commandSignal_; // queue or pending counts changed
+   ArduinoCommandThread* commandThread_;
+   ArduinoPreset presets_[numPresets];
+
+   // Sends the pattern and DA writes among commands as one command 17 when
+   // all three outputs are written, sent is false when it does not apply.
+   // Outputs are never filled in from the shadow: a sequence may have
+   // changed them on the board since.  Expects caller to guard the port
+   int SendCombined(const std::vector<QueuedCommand>& commands, bool& sent);
+   int SendTransaction(const std::vector<QueuedCommand>& commands);
+   bool IsTransactionThread();
 };
 
 class CArduinoShutter : public CShutterBase<CArduinoShutter>  
@@ -158,7 +530,7 @@ public:
    int Shutdown();
   
    void GetName(char* pszName) const;
-   bool Busy() {return busy_;}
+   bool Busy();
    
    unsigned long GetNumberOfPositions()const {return numPos_;}
 
@@ -196,7 +568,40 @@ private:
    bool blanking_;
    bool initialized_;
    long numPos_;
-   bool busy_;
+};
+
+/**
+ * Recalls the presets of the hub, one state per preset.  Recalling one sets
+ * the digital pattern, both DAC channels, blanking and the blanking trigger
+ * direction with one command; the state can also be sequenced by trigger.
+ */
+class CArduinoPresets : public CStateDeviceBase<CArduinoPresets>  
+{
+public:
+   CArduinoPresets();
+   ~CArduinoPresets();
+  
+   // MMDevice API
+   // ------------
+   int Initialize();
+   int Shutdown();
+  
+   void GetName(char* pszName) const;
+   bool Busy();
+   
+   unsigned long GetNumberOfPositions()const {return CArduinoHub::numPresets;}
+
+   // action interface
+   // ----------------
+   int OnState(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStoreCurrentState(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+private:
+   static const unsigned int NUMSEQUENCE = 16; // PRESETSEQUENCELENGTH of the firmware
+
+   int LoadSequence(const std::vector<std::string>& sequence);
+
+   bool initialized_;
 };
 
 class CArduinoDA : public CSignalIOBase<CArduinoDA>  
@@ -211,7 +616,7 @@ public:
    int Shutdown();
   
    void GetName(char* pszName) const;
-   bool Busy() {return busy_;}
+   bool Busy();
 
    // DA API
    int SetGateOpen(bool open);
@@ -233,7 +638,6 @@ private:
    int WriteSignal(double volts);
 
    bool initialized_;
-   bool busy_;
    double minV_;
    double maxV_;
    double volts_;
@@ -262,8 +666,8 @@ public:
    int ReportStateChange(long newState);
 
 private:
-   int ReadNBytes(CArduinoHub* h, unsigned int n, unsigned char* answer);
    int SetPullUp(int pin, int state);
+   long GetPinState(unsigned char bits);
 
    MMThreadLock lock_;
    ArduinoInputMonitorThread* mThread_;
@@ -297,6 +701,240 @@ class ArduinoInputMonitorThread : public MMDeviceThreadBase
       bool stop_;
 };
 
+/**
+ * Polls the progress of a hardware triggered CS run, so that the hub always
+ * knows which basis row is displayed
+ */
+class ArduinoCSProgressThread : public MMDeviceThreadBase
+{
+   public:
+      ArduinoCSProgressThread(CArduinoHub& hub);
+     ~ArduinoCSProgressThread();
+      int svc();
+      int open (void*) { return 0;}
+      int close(unsigned long) {return 0;}
+
+      void Start();
+      void Stop() {stop_ = true;}
+      ArduinoCSProgressThread & operator=( const ArduinoCSProgressThread & ) 
+      {
+         return *this;
+      }
+
+   private:
+      CArduinoHub& hub_;
+      bool stop_;
+};
+
+/**
+ * Reads again the shadowed inputs of the hub that are being queried before
+ * they go stale, so that the queries are served from memory
+ */
+class ArduinoShadowThread : public MMDeviceThreadBase
+{
+   public:
+      ArduinoShadowThread(CArduinoHub& hub);
+     ~ArduinoShadowThread();
+      int svc();
+      int open (void*) { return 0;}
+      int close(unsigned long) {return 0;}
+
+      void Start();
+      void Stop() {stop_ = true;}
+      ArduinoShadowThread & operator=( const ArduinoShadowThread & ) 
+      {
+         return *this;
+      }
+
+   private:
+      CArduinoHub& hub_;
+      bool stop_;
+};
+
+
+/**
+ * Sends the commands that devices queued on the hub while AsyncCommands is
+ * on, in the order they were queued
+ */
+class ArduinoCommandThread : public MMDeviceThreadBase
+{
+   public:
+      ArduinoCommandThread(CArduinoHub& hub);
+     ~ArduinoCommandThread();
+      int svc();
+      int open (void*) { return 0;}
+      int close(unsigned long) {return 0;}
+
+      void Start();
+      void Stop() {stop_ = true; hub_.NotifyQueueChange();}
+      ArduinoCommandThread & operator=( const ArduinoCommandThread & ) 
+      {
+         return *this;
+      }
+
+   private:
+      CArduinoHub& hub_;
+      bool stop_;
+};
+
+
+// Copy of what a wavelet prior reconstruction needs, so that it can be solved
+// while the processor takes new frames
+struct CSWaveletJob
+{
+   std::vector<double> gram;
+   double lipschitz;
+   std::vector<float> aty;
+   unsigned n;
+   unsigned width;
+   unsigned height;
+   double weight;
+   unsigned iterations;
+   unsigned threads;
+   unsigned long rows; // rows accumulated
+   std::string path;   // output file
+
+   // hands the arrays over without copying them
+   void Swap(CSWaveletJob& other)
+   {
+      gram.swap(other.gram);
+      std::swap(lipschitz, other.lipschitz);
+      aty.swap(other.aty);
+      std::swap(n, other.n);
+      std::swap(width, other.width);
+      std::swap(height, other.height);
+      std::swap(weight, other.weight);
+      std::swap(iterations, other.iterations);
+      std::swap(threads, other.threads);
+      std::swap(rows, other.rows);
+      path.swap(other.path);
+   }
+};
+
+/**
+ * Feeds every camera frame into the incremental CS reconstruction, so that an
+ * estimate is available while the Arduino is still stepping through the basis
+ */
+class CArduinoCSProcessor : public CImageProcessorBase<CArduinoCSProcessor>
+{
+public:
+   CArduinoCSProcessor();
+   ~CArduinoCSProcessor();
+
+   int Initialize();
+   int Shutdown();
+   void GetName(char* pszName) const;
+   bool Busy() {return false;}
+
+   int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
+
+   // action interface
+   // ----------------
+   int OnBasisFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRegularization(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnReset(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRowsAccumulated(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnOutputFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnOperatorCache(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMethod(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnThreads(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPrior(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPriorWeight(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPriorIterations(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMeasurementFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMeasurementCompression(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnVerifyBasis(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnReprocessFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAdaptive(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAdaptiveBatchSize(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAdaptiveTolerance(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAdaptiveOversampling(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAdaptiveResidual(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAdaptiveSparsity(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAdaptiveChange(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+   // only uses its arguments, also called by the solve thread
+   int WriteEstimate(const std::string& path, const std::vector<float>& estimate, unsigned n,
+         unsigned width, unsigned height, unsigned long rows) const;
+
+private:
+   int SaveEstimate();
+   int InitializeSolver(unsigned width, unsigned height);
+   void AccumulateStack(unsigned row, const unsigned char* buffer, unsigned byteDepth);
+   int StoreFrame(unsigned row, unsigned long arduinoTimeUs, const unsigned char* buffer, unsigned byteDepth);
+   int Reprocess(const std::string& path);
+   void ClearStack();
+   int SolveStack(std::vector<float>& estimate);
+   int PrepareWavelet(CSWaveletJob& job);
+   int StartAdaptiveRun();
+   int RecoverBasis(const std::string& path);
+   int VerifyBasis();
+
+   MMThreadLock lock_;
+   CSBasis basis_;
+   CSIncrementalSolver solver_;
+   CSAdaptiveSampler sampler_;
+   CSOperators operators_;
+   std::string operatorCache_;
+   bool verifyBasis_; // compare the basis file with the firmware when loading it
+   // with the stack method, frames are accumulated per basis row and
+   // reconstructed all at once
+   bool stackMethod_;
+   unsigned threads_;
+   std::vector<float> stack_;          // one frame sum per measured row
+   std::vector<unsigned> stackRows_;   // basis row of each sum
+   std::vector<int> stackSlots_;       // index of the sum of each basis row, -1 if none
+   // sparsity prior across the image
+   bool waveletPrior_;
+   double priorWeight_;
+   unsigned priorIterations_;
+   // measurement frames recorded for offline reconstruction
+   CSMeasurementWriter writer_;
+   std::string measurementFile_;
+   bool compressMeasurements_;
+   std::string reprocessFile_;
+   std::string outputFile_;
+   double lambda_;
+   unsigned width_;
+   unsigned height_;
+   unsigned long framesSeen_;
+   unsigned batchSize_;
+   double tolerance_;
+   double oversampling_;
+   unsigned framesInBatch_;
+   ArduinoCSSolveThread* solveThread_;
+   bool initialized_;
+};
+
+/**
+ * Solves the wavelet prior reconstructions of a CS processor, so that the
+ * FISTA iterations do not hold up the image pipeline.  A job submitted while
+ * another one is being solved replaces the job still waiting.
+ */
+class ArduinoCSSolveThread : public MMDeviceThreadBase
+{
+   public:
+      ArduinoCSSolveThread(const CArduinoCSProcessor& processor);
+     ~ArduinoCSSolveThread();
+      int svc();
+      int open (void*) { return 0;}
+      int close(unsigned long) {return 0;}
+
+      // takes the contents of job
+      void Submit(CSWaveletJob& job);
+      ArduinoCSSolveThread & operator=( const ArduinoCSSolveThread & ) 
+      {
+         return *this;
+      }
+
+   private:
+      const CArduinoCSProcessor& processor_;
+      MMThreadLock lock_;
+      CSWaveletJob job_;
+      bool pending_;
+      bool running_;
+};
+
 
 /**
  * Allows a DA device to act like a Drive (better hook it up to a drive!)
@@ -0,0 +1,190 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ArduinoLog.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Logging for the hot paths of the Arduino adapter
+// LICENSE:       LGPL
+//
+
+#include "ArduinoLog.h"
+#include "../../MMDevice/DeviceUtils.h"
+#include <sstream>
+#include <iomanip>
+
+struct ArduinoLogRecord
+{
+   char label[32]; // of the device, empty for the hubs
+   const char* format;
+   int level;
+   unsigned nArgs;
+   ArduinoLogArg args[3];
+};
+
+class ArduinoLogThread : public MMDeviceThreadBase
+{
+public:
+   ArduinoLogThread() : stop_(false) {}
+   ~ArduinoLogThread() {Stop(); wait();}
+   int svc()
+   {
+      while (!stop_)
+      {
+         ArduinoLog::Flush();
+         CDeviceUtils::SleepMs(50);
+      }
+      return 0;
+   }
+   int open(void*) {return 0;}
+   int close(unsigned long) {return 0;}
+   void Start() {stop_ = false; activate();}
+   void Stop() {stop_ = true;}
+
+private:
+   volatile bool stop_;
+};
+
+const unsigned g_ArduinoLogLength = 1024;
+
+static ArduinoLogRecord g_ArduinoLogRing[g_ArduinoLogLength];
+static unsigned g_ArduinoLogFirst = 0;
+static unsigned g_ArduinoLogCount = 0;
+static unsigned long g_ArduinoLogDropped = 0;
+
+volatile int ArduinoLog::level_ = ArduinoLog::Info;
+MM::Core* ArduinoLog::core_ = 0;
+std::vector<const MM::Device*> ArduinoLog::hubs_;
+ArduinoLogThread* ArduinoLog::thread_ = 0;
+MMThreadLock ArduinoLog::ringLock_;
+MMThreadLock ArduinoLog::flushLock_;
+
+void ArduinoLog::Push(Level level, const MM::Device* device, const char* format, unsigned nArgs,
+      const ArduinoLogArg* a0, const ArduinoLogArg* a1, const ArduinoLogArg* a2)
+{
+   char label[MM::MaxStrLength];
+   label[0] = 0;
+   if (device != 0)
+      device->GetLabel(label);
+   MMThreadGuard guard(ringLock_);
+   if (g_ArduinoLogCount == g_ArduinoLogLength)
+   {
+      g_ArduinoLogDropped++;
+      return;
+   }
+   ArduinoLogRecord& record = g_ArduinoLogRing[(g_ArduinoLogFirst + g_ArduinoLogCount) % g_ArduinoLogLength];
+   record.label[0] = 0;
+   for (size_t i = 0; i < hubs_.size(); i++)
+      if (hubs_[i] == device)
+         label[0] = 0;
+   strncat(record.label, label, sizeof(record.label) - 1);
+   record.format = format;
+   record.level = level;
+   record.nArgs = nArgs;
+   if (a0)
+      record.args[0] = *a0;
+   if (a1)
+      record.args[1] = *a1;
+   if (a2)
+      record.args[2] = *a2;
+   g_ArduinoLogCount++;
+}
+
+bool ArduinoLog::Pop(ArduinoLogRecord& record, unsigned long& dropped)
+{
+   MMThreadGuard guard(ringLock_);
+   dropped = g_ArduinoLogDropped;
+   g_ArduinoLogDropped = 0;
+   if (g_ArduinoLogCount == 0)
+      return false;
+   record = g_ArduinoLogRing[g_ArduinoLogFirst];
+   g_ArduinoLogFirst = (g_ArduinoLogFirst + 1) % g_ArduinoLogLength;
+   g_ArduinoLogCount--;
+   return true;
+}
+
+static std::string FormatRecord(const ArduinoLogRecord& record)
+{
+   std::ostringstream os;
+   os << std::setprecision(12);
+   if (record.label[0] != 0)
+      os << record.label << ": ";
+   unsigned next = 0;
+   for (const char* c = record.format; *c != 0; c++)
+   {
+      if (c[0] == '{' && c[1] == '}' && next < record.nArgs)
+      {
+         const ArduinoLogArg& arg = record.args[next++];
+         if (arg.isText)
+            os << arg.text;
+         else
+            os << arg.number;
+         c++;
+      }
+      else
+         os << *c;
+   }
+   return os.str();
+}
+
+void ArduinoLog::Flush()
+{
+   MMThreadGuard guard(flushLock_);
+   ArduinoLogRecord record;
+   unsigned long dropped;
+   bool more = true;
+   while (more)
+   {
+      more = Pop(record, dropped);
+      if (core_ == 0 || hubs_.empty())
+         continue;
+      if (dropped > 0)
+      {
+         std::ostringstream os;
+         os << "Arduino log full, dropped " << dropped << " messages";
+         core_->LogMessage(hubs_.back(), os.str().c_str(), false);
+      }
+      if (more)
+         core_->LogMessage(hubs_.back(), FormatRecord(record).c_str(), record.level == Debug);
+   }
+}
+
+void ArduinoLog::Start(MM::Core* core, const MM::Device* hub)
+{
+   MMThreadGuard guard(flushLock_);
+   core_ = core;
+   {
+      MMThreadGuard ringGuard(ringLock_);
+      hubs_.push_back(hub);
+   }
+   if (thread_ == 0)
+   {
+      thread_ = new ArduinoLogThread();
+      thread_->Start();
+   }
+}
+
+void ArduinoLog::Stop(const MM::Device* hub)
+{
+   // what the hub wrote is logged while it is still there
+   Flush();
+   ArduinoLogThread* thread = 0;
+   {
+      MMThreadGuard guard(flushLock_);
+      MMThreadGuard ringGuard(ringLock_);
+      for (size_t i = 0; i < hubs_.size(); i++)
+      {
+         if (hubs_[i] == hub)
+         {
+            hubs_.erase(hubs_.begin() + i);
+            break;
+         }
+      }
+      if (hubs_.empty())
+      {
+         thread = thread_;
+         thread_ = 0;
+      }
+   }
+   // the thread flushes under flushLock_, wait for it outside
+   delete thread;
+}
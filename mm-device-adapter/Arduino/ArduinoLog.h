@@ -0,0 +1,119 @@
+//////////////////////////////////////////////////////////////////////////////
+// FILE:          ArduinoLog.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Logging for the hot paths of the Arduino adapter: messages
+//                are kept in binary form and formatted on a background
+//                thread
+// LICENSE:       LGPL
+//
+
+#ifndef _ArduinoLog_H_
+#define _ArduinoLog_H_
+
+#include "../../MMDevice/MMDevice.h"
+#include "../../MMDevice/DeviceThreads.h"
+#include <string>
+#include <vector>
+#include <cstring>
+
+// Messages below this level are compiled out
+#ifndef ARDUINO_LOG_MIN_LEVEL
+#define ARDUINO_LOG_MIN_LEVEL 0
+#endif
+
+/**
+ * Value of a log message, kept as is until the message is formatted.  Text
+ * is copied, at most 23 characters.
+ */
+struct ArduinoLogArg
+{
+   ArduinoLogArg() : isText(false), number(0.0) {text[0] = 0;}
+   ArduinoLogArg(int v) : isText(false), number(v) {}
+   ArduinoLogArg(unsigned v) : isText(false), number(v) {}
+   ArduinoLogArg(long v) : isText(false), number(v) {}
+   ArduinoLogArg(unsigned long v) : isText(false), number(v) {}
+   ArduinoLogArg(double v) : isText(false), number(v) {}
+   ArduinoLogArg(const char* v) : isText(true), number(0.0) {SetText(v);}
+   ArduinoLogArg(const std::string& v) : isText(true), number(0.0) {SetText(v.c_str());}
+
+   void SetText(const char* v)
+   {
+      strncpy(text, v, sizeof(text) - 1);
+      text[sizeof(text) - 1] = 0;
+   }
+
+   bool isText;
+   double number;
+   char text[24];
+};
+
+struct ArduinoLogRecord;
+class ArduinoLogThread;
+
+/**
+ * Messages of all the devices of the module go into a preallocated ring of
+ * records.  Writing one copies the format pointer, the label of the device
+ * and the values under a short lock, without allocating; the thread started
+ * by the hub formats them into the core log on behalf of the hub, so a
+ * device may go away while its messages wait.  When the ring is full,
+ * messages are dropped and counted.
+ */
+class ArduinoLog
+{
+public:
+   enum Level {Debug = 0, Info = 1, Error = 2, Off = 3};
+
+   static bool IsEnabled(Level level) {return level >= ARDUINO_LOG_MIN_LEVEL && level >= level_;}
+   static void SetLevel(Level level) {level_ = level;}
+   static Level GetLevel() {return (Level) level_;}
+
+   // format must be a string literal, every {} is replaced by the next value.
+   // The values are converted to ArduinoLogArg at the call site, before the
+   // level is checked: guard values that are costly to build with IsEnabled
+   static void Write(Level level, const MM::Device* device, const char* format)
+   {
+      if (IsEnabled(level))
+         Push(level, device, format, 0, 0, 0, 0);
+   }
+   static void Write(Level level, const MM::Device* device, const char* format,
+         const ArduinoLogArg& a0)
+   {
+      if (IsEnabled(level))
+         Push(level, device, format, 1, &a0, 0, 0);
+   }
+   static void Write(Level level, const MM::Device* device, const char* format,
+         const ArduinoLogArg& a0, const ArduinoLogArg& a1)
+   {
+      if (IsEnabled(level))
+         Push(level, device, format, 2, &a0, &a1, 0);
+   }
+   static void Write(Level level, const MM::Device* device, const char* format,
+         const ArduinoLogArg& a0, const ArduinoLogArg& a1, const ArduinoLogArg& a2)
+   {
+      if (IsEnabled(level))
+         Push(level, device, format, 3, &a0, &a1, &a2);
+   }
+
+   // The hub starts the thread that formats the messages, the last one to
+   // stop it writes what is left
+   static void Start(MM::Core* core, const MM::Device* hub);
+   static void Stop(const MM::Device* hub);
+   // writes the pending messages, devices call it before they go away
+   static void Flush();
+
+private:
+   static void Push(Level level, const MM::Device* device, const char* format, unsigned nArgs,
+         const ArduinoLogArg* a0, const ArduinoLogArg* a1, const ArduinoLogArg* a2);
+   static bool Pop(ArduinoLogRecord& record, unsigned long& dropped);
+
+   static volatile int level_;
+   static MM::Core* core_;
+   static std::vector<const MM::Device*> hubs_; // the last one logs the messages
+   static ArduinoLogThread* thread_;
+   static MMThreadLock ringLock_;
+   static MMThreadLock flushLock_;
+};
+
+#endif //_ArduinoLog_H_
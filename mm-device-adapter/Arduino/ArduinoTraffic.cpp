@@ -0,0 +1,189 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ArduinoTraffic.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Recording of the bytes exchanged with the Arduino
+// LICENSE:       LGPL
+//
+
+#include "ArduinoTraffic.h"
+#include "Arduino.h"
+#include <cstring>
+#include <algorithm>
+
+struct ArduinoTrafficHeader
+{
+   char magic[8];
+   unsigned int capacity;
+   unsigned int reserved;
+   unsigned long long written;
+   char devices[g_ArduinoTrafficDevices][g_ArduinoTrafficDeviceLabel];
+};
+
+static const char g_ArduinoTrafficMagic[8] = {'A', 'R', 'D', 'T', 'R', 'F', '0', '1'};
+
+///////////////////////////////////////////////////////////////////////////////
+// ArduinoTrafficRecorder implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+ArduinoTrafficRecorder::ArduinoTrafficRecorder() :
+   capacity_(0),
+   written_(0),
+   lastTimeUs_(0)
+{
+}
+
+ArduinoTrafficRecorder::~ArduinoTrafficRecorder()
+{
+   Close();
+}
+
+int ArduinoTrafficRecorder::Open(const std::string& path, unsigned capacity)
+{
+   Close();
+   if (capacity == 0)
+      return DEVICE_INVALID_PROPERTY_VALUE;
+   if (!file_.Create(path, sizeof(ArduinoTrafficHeader) + (size_t) capacity * sizeof(ArduinoTrafficRecord)))
+      return ERR_TRAFFIC_FILE;
+
+   ArduinoTrafficHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, g_ArduinoTrafficMagic, sizeof(header.magic));
+   header.capacity = capacity;
+   memcpy(file_.GetWritableData(), &header, sizeof(header));
+
+   capacity_ = capacity;
+   written_ = 0;
+   lastTimeUs_ = 0;
+   devices_.clear();
+   return DEVICE_OK;
+}
+
+void ArduinoTrafficRecorder::Close()
+{
+   file_.Close();
+   capacity_ = 0;
+   written_ = 0;
+   devices_.clear();
+}
+
+unsigned char ArduinoTrafficRecorder::GetDeviceIndex(const std::string& label)
+{
+   for (unsigned i = 0; i < devices_.size(); i++)
+      if (devices_[i] == label)
+         return (unsigned char) i;
+   if (devices_.size() == g_ArduinoTrafficDevices - 1)
+      return (unsigned char) devices_.size();
+
+   devices_.push_back(label);
+   if (IsOpen())
+   {
+      ArduinoTrafficHeader* header = (ArduinoTrafficHeader*) file_.GetWritableData();
+      char* entry = header->devices[devices_.size() - 1];
+      strncpy(entry, label.c_str(), g_ArduinoTrafficDeviceLabel - 1);
+      entry[g_ArduinoTrafficDeviceLabel - 1] = 0;
+   }
+   return (unsigned char) (devices_.size() - 1);
+}
+
+void ArduinoTrafficRecorder::Record(unsigned long long timeUs, unsigned char direction, unsigned char device,
+      const unsigned char* data, unsigned long length)
+{
+   if (!IsOpen())
+      return;
+
+   // the clock of the core may step back, the recording does not
+   timeUs = std::max(timeUs, lastTimeUs_);
+   lastTimeUs_ = timeUs;
+
+   unsigned char* records = file_.GetWritableData() + sizeof(ArduinoTrafficHeader);
+   ArduinoTrafficHeader* header = (ArduinoTrafficHeader*) file_.GetWritableData();
+   unsigned char flags = 0;
+   do
+   {
+      ArduinoTrafficRecord record;
+      memset(&record, 0, sizeof(record));
+      record.timeUs = timeUs;
+      record.direction = direction;
+      record.device = device;
+      record.flags = flags;
+      record.length = (unsigned char) std::min(length, (unsigned long) sizeof(record.data));
+      memcpy(record.data, data, record.length);
+      memcpy(records + (size_t) (written_ % capacity_) * sizeof(record), &record, sizeof(record));
+      written_++;
+      data += record.length;
+      length -= record.length;
+      flags = ArduinoTrafficRecord::continued;
+   } while (length > 0);
+   header->written = written_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ArduinoTrafficReader implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+ArduinoTrafficReader::ArduinoTrafficReader() :
+   capacity_(0),
+   first_(0),
+   count_(0)
+{
+}
+
+void ArduinoTrafficReader::Close()
+{
+   file_.Close();
+   capacity_ = 0;
+   first_ = 0;
+   count_ = 0;
+   devices_.clear();
+}
+
+int ArduinoTrafficReader::Open(const std::string& path)
+{
+   Close();
+   if (!file_.Open(path) || file_.GetSize() < sizeof(ArduinoTrafficHeader))
+   {
+      file_.Close();
+      return ERR_TRAFFIC_FILE;
+   }
+
+   ArduinoTrafficHeader header;
+   memcpy(&header, file_.GetData(), sizeof(header));
+   if (memcmp(header.magic, g_ArduinoTrafficMagic, sizeof(header.magic)) != 0 || header.capacity == 0 ||
+         file_.GetSize() < sizeof(header) + (size_t) header.capacity * sizeof(ArduinoTrafficRecord))
+   {
+      file_.Close();
+      return ERR_TRAFFIC_FILE;
+   }
+   capacity_ = header.capacity;
+   if (header.written > capacity_)
+   {
+      first_ = (unsigned) (header.written % capacity_);
+      count_ = capacity_;
+   }
+   else
+   {
+      first_ = 0;
+      count_ = (unsigned) header.written;
+   }
+   for (unsigned i = 0; i < g_ArduinoTrafficDevices && header.devices[i][0] != 0; i++)
+   {
+      header.devices[i][g_ArduinoTrafficDeviceLabel - 1] = 0;
+      devices_.push_back(header.devices[i]);
+   }
+   return DEVICE_OK;
+}
+
+void ArduinoTrafficReader::GetRecord(unsigned index, ArduinoTrafficRecord& record) const
+{
+   size_t slot = (first_ + (size_t) index) % capacity_;
+   memcpy(&record, file_.GetData() + sizeof(ArduinoTrafficHeader) + slot * sizeof(record), sizeof(record));
+}
+
+std::string ArduinoTrafficReader::GetDeviceLabel(unsigned char device) const
+{
+   if (device < devices_.size())
+      return devices_[device];
+   return "other";
+}
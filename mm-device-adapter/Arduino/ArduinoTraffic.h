@@ -0,0 +1,98 @@
+//////////////////////////////////////////////////////////////////////////////
+// FILE:          ArduinoTraffic.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Recording of the bytes exchanged with the Arduino, written
+//                by the hub into a ring file and read back for replay
+// LICENSE:       LGPL
+//
+
+#ifndef _ArduinoTraffic_H_
+#define _ArduinoTraffic_H_
+
+#include "CSReconstruction.h"
+#include <string>
+#include <vector>
+
+/*
+ * File layout (native byte order):
+ *   header: "ARDTRF01", capacity (records), records written, then a table
+ *   of the labels of the devices that sent the commands
+ *   then capacity records of 16 bytes, used as a ring: once full, record n
+ *   goes into slot n % capacity.
+ * A record holds up to 4 bytes of one direction, longer transfers take
+ * several consecutive records, all but the first marked as continued.
+ */
+
+const unsigned g_ArduinoTrafficDevices = 16;
+const unsigned g_ArduinoTrafficDeviceLabel = 32;
+
+struct ArduinoTrafficRecord
+{
+   enum {hostToBoard = 0, boardToHost = 1};
+   enum {continued = 1};
+   unsigned long long timeUs; // since the recording started, never decreases
+   unsigned char direction;
+   unsigned char device; // index in the device table
+   unsigned char flags;
+   unsigned char length;
+   unsigned char data[4];
+};
+
+/**
+ * Writes the records through a memory mapping of the whole ring, and keeps
+ * the number of records written in the header after every record, so that
+ * a recording survives a crash of the application.
+ */
+class ArduinoTrafficRecorder
+{
+public:
+   ArduinoTrafficRecorder();
+   ~ArduinoTrafficRecorder();
+
+   int Open(const std::string& path, unsigned capacity);
+   void Close();
+   bool IsOpen() const {return file_.IsOpen();}
+
+   // index of the device in the table, the last entry is shared by the
+   // devices that do not fit
+   unsigned char GetDeviceIndex(const std::string& label);
+   void Record(unsigned long long timeUs, unsigned char direction, unsigned char device,
+         const unsigned char* data, unsigned long length);
+   unsigned long long GetNumberOfRecords() const {return written_;}
+
+private:
+   CSMappedFile file_;
+   unsigned capacity_;
+   unsigned long long written_;
+   unsigned long long lastTimeUs_;
+   std::vector<std::string> devices_;
+};
+
+/**
+ * Reads a recording in chronological order, starting with the oldest record
+ * still in the ring.
+ */
+class ArduinoTrafficReader
+{
+public:
+   ArduinoTrafficReader();
+
+   int Open(const std::string& path);
+   void Close();
+
+   unsigned GetNumberOfRecords() const {return count_;}
+   // index 0 is the oldest record
+   void GetRecord(unsigned index, ArduinoTrafficRecord& record) const;
+   std::string GetDeviceLabel(unsigned char device) const;
+
+private:
+   CSMappedFile file_;
+   unsigned capacity_;
+   unsigned first_; // slot of the oldest record
+   unsigned count_;
+   std::vector<std::string> devices_;
+};
+
+#endif //_ArduinoTraffic_H_
@@ -0,0 +1,291 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CSMeasurementStore.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Append-only file of compressed sensing measurement frames
+// LICENSE:       LGPL
+//
+
+#include "CSMeasurementStore.h"
+#include "Arduino.h"
+#include <cstring>
+#include <algorithm>
+
+struct CSStoreHeader
+{
+   char magic[8];
+   unsigned int width;
+   unsigned int height;
+   unsigned int byteDepth;
+   unsigned int reserved;
+   long long basisId;
+   unsigned long long checksum;
+};
+
+struct CSChunkHeader
+{
+   unsigned int magic;
+   unsigned int row;
+   unsigned int frame;
+   unsigned int encoding;
+   unsigned long long hostTimeUs;
+   unsigned int arduinoTimeUs;
+   unsigned int payloadSize;
+};
+
+static const char g_CSStoreMagic[8] = {'C', 'S', 'M', 'E', 'A', 'S', '0', '1'};
+const unsigned int g_CSChunkMagic = 0x48435343; // "CSCH"
+const unsigned int g_CSEncodingRaw = 0;
+const unsigned int g_CSEncodingDelta = 1;
+// the mapping grows by that much at a time
+const size_t g_CSStoreGrowth = 64 << 20;
+
+static size_t Padded(size_t size)
+{
+   return (size + 7) & ~(size_t) 7;
+}
+
+// Differences to the previous pixel, zigzag mapped and written 7 bits a byte
+static size_t EncodeDelta(const unsigned char* pixels, unsigned nPixels, unsigned byteDepth, unsigned char* out)
+{
+   unsigned char* o = out;
+   int previous = 0;
+   for (unsigned p = 0; p < nPixels; p++)
+   {
+      int value = byteDepth == 1 ? pixels[p] : ((const unsigned short*) pixels)[p];
+      int d = value - previous;
+      previous = value;
+      unsigned z = (unsigned) ((d << 1) ^ (d >> 31));
+      while (z >= 0x80) {
+         *o++ = (unsigned char) (z | 0x80);
+         z >>= 7;
+      }
+      *o++ = (unsigned char) z;
+   }
+   return o - out;
+}
+
+static bool DecodeDelta(const unsigned char* in, size_t size, unsigned nPixels, unsigned byteDepth, unsigned char* pixels)
+{
+   const unsigned char* end = in + size;
+   int previous = 0;
+   for (unsigned p = 0; p < nPixels; p++)
+   {
+      unsigned z = 0;
+      for (unsigned shift = 0; ; shift += 7)
+      {
+         if (in == end || shift > 28)
+            return false;
+         unsigned char b = *in++;
+         z |= (unsigned) (b & 0x7f) << shift;
+         if (!(b & 0x80))
+            break;
+      }
+      int d = (int) (z >> 1) ^ -(int) (z & 1);
+      previous += d;
+      if (byteDepth == 1)
+         pixels[p] = (unsigned char) previous;
+      else
+         ((unsigned short*) pixels)[p] = (unsigned short) previous;
+   }
+   return in == end;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CSMeasurementWriter implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+CSMeasurementWriter::CSMeasurementWriter() :
+   used_(0),
+   width_(0),
+   height_(0),
+   byteDepth_(0),
+   compress_(false),
+   nFrames_(0)
+{
+}
+
+CSMeasurementWriter::~CSMeasurementWriter()
+{
+   Close();
+}
+
+int CSMeasurementWriter::Open(const std::string& path, unsigned width, unsigned height, unsigned byteDepth,
+      long basisId, unsigned long long checksum, bool compress)
+{
+   Close();
+   if (byteDepth != 1 && byteDepth != 2)
+      return DEVICE_UNSUPPORTED_COMMAND;
+   if (!file_.Create(path, g_CSStoreGrowth))
+      return ERR_CS_STORE;
+
+   CSStoreHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, g_CSStoreMagic, sizeof(header.magic));
+   header.width = width;
+   header.height = height;
+   header.byteDepth = byteDepth;
+   header.basisId = basisId;
+   header.checksum = checksum;
+   memcpy(file_.GetWritableData(), &header, sizeof(header));
+
+   used_ = sizeof(header);
+   width_ = width;
+   height_ = height;
+   byteDepth_ = byteDepth;
+   compress_ = compress;
+   nFrames_ = 0;
+   return DEVICE_OK;
+}
+
+int CSMeasurementWriter::Reserve(size_t size)
+{
+   if (used_ + size <= file_.GetSize())
+      return DEVICE_OK;
+   size_t grown = file_.GetSize() + std::max(size, g_CSStoreGrowth);
+   return file_.Resize(grown) ? DEVICE_OK : ERR_CS_STORE;
+}
+
+int CSMeasurementWriter::Append(const CSMeasurementInfo& info, const unsigned char* pixels)
+{
+   if (!IsOpen())
+      return ERR_CS_STORE;
+
+   const unsigned nPixels = width_ * height_;
+   const size_t rawSize = (size_t) nPixels * byteDepth_;
+   CSChunkHeader chunk;
+   chunk.magic = g_CSChunkMagic;
+   chunk.row = info.row;
+   chunk.frame = info.frame;
+   chunk.encoding = g_CSEncodingRaw;
+   chunk.hostTimeUs = info.hostTimeUs;
+   chunk.arduinoTimeUs = (unsigned int) info.arduinoTimeUs;
+   chunk.payloadSize = (unsigned int) rawSize;
+
+   const unsigned char* payload = pixels;
+   if (compress_)
+   {
+      // at most 3 bytes per 16 bit pixel
+      packed_.resize((size_t) nPixels * (byteDepth_ + 1));
+      size_t packedSize = EncodeDelta(pixels, nPixels, byteDepth_, &packed_[0]);
+      if (packedSize < rawSize)
+      {
+         chunk.encoding = g_CSEncodingDelta;
+         chunk.payloadSize = (unsigned int) packedSize;
+         payload = &packed_[0];
+      }
+   }
+
+   int ret = Reserve(sizeof(chunk) + Padded(chunk.payloadSize));
+   if (ret != DEVICE_OK)
+      return ret;
+   unsigned char* out = file_.GetWritableData() + used_;
+   memcpy(out, &chunk, sizeof(chunk));
+   memcpy(out + sizeof(chunk), payload, chunk.payloadSize);
+   used_ += sizeof(chunk) + Padded(chunk.payloadSize);
+   nFrames_++;
+   return DEVICE_OK;
+}
+
+int CSMeasurementWriter::Close()
+{
+   if (!IsOpen())
+      return DEVICE_OK;
+   bool ok = file_.Resize(used_);
+   file_.Close();
+   return ok ? DEVICE_OK : ERR_CS_STORE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CSMeasurementReader implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+CSMeasurementReader::CSMeasurementReader() :
+   width_(0),
+   height_(0),
+   byteDepth_(0),
+   basisId_(0),
+   checksum_(0)
+{
+}
+
+void CSMeasurementReader::Close()
+{
+   file_.Close();
+   chunks_.clear();
+   decoded_.clear();
+   width_ = 0;
+   height_ = 0;
+   byteDepth_ = 0;
+   basisId_ = 0;
+   checksum_ = 0;
+}
+
+int CSMeasurementReader::Open(const std::string& path)
+{
+   Close();
+   if (!file_.Open(path) || file_.GetSize() < sizeof(CSStoreHeader))
+   {
+      file_.Close();
+      return ERR_CS_STORE;
+   }
+
+   CSStoreHeader header;
+   memcpy(&header, file_.GetData(), sizeof(header));
+   if (memcmp(header.magic, g_CSStoreMagic, sizeof(header.magic)) != 0 ||
+         (header.byteDepth != 1 && header.byteDepth != 2))
+   {
+      file_.Close();
+      return ERR_CS_STORE;
+   }
+   width_ = header.width;
+   height_ = header.height;
+   byteDepth_ = header.byteDepth;
+   basisId_ = (long) header.basisId;
+   checksum_ = header.checksum;
+
+   // index the chunks, up to the first incomplete one
+   const size_t rawSize = (size_t) width_ * height_ * byteDepth_;
+   size_t offset = sizeof(header);
+   while (offset + sizeof(CSChunkHeader) <= file_.GetSize())
+   {
+      CSChunkHeader chunk;
+      memcpy(&chunk, file_.GetData() + offset, sizeof(chunk));
+      if (chunk.magic != g_CSChunkMagic || chunk.payloadSize > rawSize ||
+            (chunk.encoding == g_CSEncodingRaw && chunk.payloadSize != rawSize) ||
+            offset + sizeof(chunk) + chunk.payloadSize > file_.GetSize())
+         break;
+      chunks_.push_back(offset);
+      offset += sizeof(chunk) + Padded(chunk.payloadSize);
+   }
+   return DEVICE_OK;
+}
+
+int CSMeasurementReader::GetFrame(unsigned index, CSMeasurementInfo& info, const unsigned char*& pixels)
+{
+   if (index >= chunks_.size())
+      return ERR_CS_STORE;
+
+   CSChunkHeader chunk;
+   const unsigned char* data = file_.GetData() + chunks_[index];
+   memcpy(&chunk, data, sizeof(chunk));
+   info.row = chunk.row;
+   info.frame = chunk.frame;
+   info.hostTimeUs = chunk.hostTimeUs;
+   info.arduinoTimeUs = chunk.arduinoTimeUs;
+
+   const unsigned char* payload = data + sizeof(chunk);
+   if (chunk.encoding == g_CSEncodingRaw)
+   {
+      pixels = payload;
+      return DEVICE_OK;
+   }
+   if (chunk.encoding != g_CSEncodingDelta)
+      return ERR_CS_STORE;
+   decoded_.resize((size_t) width_ * height_ * byteDepth_);
+   if (!DecodeDelta(payload, chunk.payloadSize, width_ * height_, byteDepth_, &decoded_[0]))
+      return ERR_CS_STORE;
+   pixels = &decoded_[0];
+   return DEVICE_OK;
+}
@@ -0,0 +1,103 @@
+//////////////////////////////////////////////////////////////////////////////
+// FILE:          CSMeasurementStore.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Append-only file of compressed sensing measurement frames,
+//                written while acquiring and read back for offline
+//                reconstruction
+// LICENSE:       LGPL
+//
+
+#ifndef _CSMeasurementStore_H_
+#define _CSMeasurementStore_H_
+
+#include "CSReconstruction.h"
+#include <string>
+#include <vector>
+
+/*
+ * File layout (native byte order):
+ *   header: "CSMEAS01", width, height, byte depth, basis id, basis checksum
+ *   then one chunk per frame: row, frame number, encoding, host and Arduino
+ *   time stamps, payload size, then the payload padded to 8 bytes.
+ * The payload holds the pixels either raw or, when that is smaller, as the
+ * zigzag varint coded differences between consecutive pixels.
+ */
+
+struct CSMeasurementInfo
+{
+   unsigned row;
+   unsigned frame;
+   unsigned long long hostTimeUs;
+   unsigned long arduinoTimeUs; // 0 when the Arduino did not report the row
+};
+
+/**
+ * Appends frames to the file through a memory mapping that grows by large
+ * steps.  The file is cut to its used size when closed; after a crash the
+ * unused tail is zeroes, which the reader takes as the end.
+ */
+class CSMeasurementWriter
+{
+public:
+   CSMeasurementWriter();
+   ~CSMeasurementWriter();
+
+   int Open(const std::string& path, unsigned width, unsigned height, unsigned byteDepth,
+         long basisId, unsigned long long checksum, bool compress);
+   int Append(const CSMeasurementInfo& info, const unsigned char* pixels);
+   int Close();
+   bool IsOpen() const {return file_.IsOpen();}
+   unsigned GetWidth() const {return width_;}
+   unsigned GetHeight() const {return height_;}
+   unsigned GetByteDepth() const {return byteDepth_;}
+   unsigned GetNumberOfFrames() const {return nFrames_;}
+
+private:
+   int Reserve(size_t size);
+
+   CSMappedFile file_;
+   size_t used_;
+   unsigned width_;
+   unsigned height_;
+   unsigned byteDepth_;
+   bool compress_;
+   unsigned nFrames_;
+   std::vector<unsigned char> packed_;
+};
+
+/**
+ * Reads a measurement file in place: raw frames point into the mapping,
+ * coded ones are decoded into a buffer owned by the reader, valid until the
+ * next call.
+ */
+class CSMeasurementReader
+{
+public:
+   CSMeasurementReader();
+
+   int Open(const std::string& path);
+   void Close();
+
+   unsigned GetWidth() const {return width_;}
+   unsigned GetHeight() const {return height_;}
+   unsigned GetByteDepth() const {return byteDepth_;}
+   long GetBasisId() const {return basisId_;}
+   unsigned long long GetChecksum() const {return checksum_;}
+   unsigned GetNumberOfFrames() const {return (unsigned) chunks_.size();}
+
+   int GetFrame(unsigned index, CSMeasurementInfo& info, const unsigned char*& pixels);
+
+private:
+   CSMappedFile file_;
+   std::vector<size_t> chunks_; // offset of each chunk
+   unsigned width_;
+   unsigned height_;
+   unsigned byteDepth_;
+   long basisId_;
+   unsigned long long checksum_;
+   std::vector<unsigned char> decoded_;
+};
+
+#endif //_CSMeasurementStore_H_
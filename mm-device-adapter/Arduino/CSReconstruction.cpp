@@ -0,0 +1,1289 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CSReconstruction.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Host-side compressed sensing reconstruction for the Arduino
+//                adapter
+// LICENSE:       LGPL
+//
+
+#include "CSReconstruction.h"
+#include "Arduino.h"
+#include "../../MMDevice/DeviceThreads.h"
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#ifdef WIN32
+   #define WIN32_LEAN_AND_MEAN
+   #include <windows.h>
+#else
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// CSBasis implementation
+// ~~~~~~~~~~~~~~~~~~~~~~
+
+CSBasis::CSBasis() :
+   nRows_(0),
+   nElements_(0)
+{
+}
+
+void CSBasis::Clear()
+{
+   values_.clear();
+   nRows_ = 0;
+   nElements_ = 0;
+   path_ = "";
+}
+
+// Splits one CSV line, stripping the quotes opencsv may have written
+static void SplitCSVLine(const std::string& line, std::vector<std::string>& fields)
+{
+   fields.clear();
+   std::string field;
+   bool quoted = false;
+   for (std::string::size_type i = 0; i < line.size(); i++)
+   {
+      char c = line[i];
+      if (c == '"')
+         quoted = !quoted;
+      else if (c == ',' && !quoted)
+      {
+         fields.push_back(field);
+         field = "";
+      }
+      else if (c != '\r')
+         field += c;
+   }
+   fields.push_back(field);
+}
+
+int CSBasis::Load(const std::string& path)
+{
+   Clear();
+
+   std::ifstream in(path.c_str());
+   if (!in)
+      return ERR_CS_BASIS_FILE;
+
+   // Element e is on line e+1, basis row r in column r+1
+   std::vector<std::vector<double> > elements;
+   std::vector<std::string> fields;
+   std::string line;
+   bool header = true;
+   while (std::getline(in, line))
+   {
+      if (header) {
+         header = false;
+         continue;
+      }
+      SplitCSVLine(line, fields);
+      if (fields.size() < 2)
+         continue;
+      std::vector<double> element;
+      for (unsigned j = 1; j < fields.size(); j++)
+         element.push_back(atof(fields[j].c_str()));
+      if (!elements.empty() && element.size() != elements[0].size())
+         return ERR_CS_BASIS_FILE;
+      elements.push_back(element);
+   }
+   if (elements.empty())
+      return ERR_CS_BASIS_FILE;
+
+   nElements_ = (unsigned) elements.size();
+   nRows_ = (unsigned) elements[0].size();
+   values_.resize(nRows_ * nElements_);
+   for (unsigned e = 0; e < nElements_; e++)
+      for (unsigned r = 0; r < nRows_; r++)
+         values_[r * nElements_ + e] = elements[e][r];
+   path_ = path;
+
+   return DEVICE_OK;
+}
+
+void CSBasis::Assign(unsigned nRows, unsigned nElements, const std::vector<double>& values, const std::string& path)
+{
+   values_ = values;
+   nRows_ = nRows;
+   nElements_ = nElements;
+   path_ = path;
+}
+
+// Same layout as read by Load
+int CSBasis::Save(const std::string& path) const
+{
+   std::ofstream out(path.c_str());
+   if (!out)
+      return ERR_CS_BASIS_FILE;
+
+   out << "\"\"";
+   for (unsigned r = 0; r < nRows_; r++)
+      out << "," << r;
+   out << "\n";
+   for (unsigned e = 0; e < nElements_; e++)
+   {
+      out << e;
+      for (unsigned r = 0; r < nRows_; r++)
+         out << "," << values_[r * nElements_ + e];
+      out << "\n";
+   }
+   out.close();
+   if (!out)
+      return ERR_CS_BASIS_FILE;
+
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CSMappedFile implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+CSMappedFile::CSMappedFile() :
+   data_(0),
+   size_(0),
+   writable_(false),
+#ifdef WIN32
+   file_(INVALID_HANDLE_VALUE),
+   mapping_(0)
+#else
+   fd_(-1)
+#endif
+{
+}
+
+CSMappedFile::~CSMappedFile()
+{
+   Close();
+}
+
+bool CSMappedFile::Open(const std::string& path)
+{
+   Close();
+#ifdef WIN32
+   file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+   if (file_ == INVALID_HANDLE_VALUE)
+      return false;
+   LARGE_INTEGER size;
+   if (!GetFileSizeEx(file_, &size)) {
+      Close();
+      return false;
+   }
+   size_ = (size_t) size.QuadPart;
+#else
+   fd_ = open(path.c_str(), O_RDONLY);
+   if (fd_ < 0)
+      return false;
+   struct stat st;
+   if (fstat(fd_, &st) != 0) {
+      Close();
+      return false;
+   }
+   size_ = (size_t) st.st_size;
+#endif
+   if (!Map()) {
+      Close();
+      return false;
+   }
+   return true;
+}
+
+bool CSMappedFile::Create(const std::string& path, size_t size)
+{
+   Close();
+   writable_ = true;
+#ifdef WIN32
+   file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+   if (file_ == INVALID_HANDLE_VALUE) {
+      writable_ = false;
+      return false;
+   }
+#else
+   fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd_ < 0) {
+      writable_ = false;
+      return false;
+   }
+#endif
+   if (!Resize(size)) {
+      Close();
+      return false;
+   }
+   return true;
+}
+
+bool CSMappedFile::Resize(size_t size)
+{
+   if (!writable_)
+      return false;
+   Unmap();
+#ifdef WIN32
+   LARGE_INTEGER position;
+   position.QuadPart = (LONGLONG) size;
+   if (!SetFilePointerEx(file_, position, 0, FILE_BEGIN) || !SetEndOfFile(file_))
+      return false;
+#else
+   // the blocks of a grown file are reserved before it is mapped, writing to
+   // a hole of a sparse file through the mapping raises SIGBUS on a full disk
+   struct stat st;
+   if (fstat(fd_, &st) != 0)
+      return false;
+   if ((off_t) size <= st.st_size)
+   {
+      if (ftruncate(fd_, (off_t) size) != 0)
+         return false;
+   }
+   else if (!Reserve((size_t) st.st_size, size))
+      return false;
+#endif
+   size_ = size;
+   return Map();
+}
+
+#ifndef WIN32
+// Allocates the blocks from offset to end, the file then ends there
+bool CSMappedFile::Reserve(size_t offset, size_t end)
+{
+#ifdef __APPLE__
+   // no posix_fallocate, the zeros are written instead
+   std::vector<char> zeros(65536, 0);
+   while (offset < end)
+   {
+      size_t len = std::min(zeros.size(), end - offset);
+      ssize_t written = pwrite(fd_, &zeros[0], len, (off_t) offset);
+      if (written <= 0)
+         return false;
+      offset += (size_t) written;
+   }
+   return true;
+#else
+   return posix_fallocate(fd_, (off_t) offset, (off_t) (end - offset)) == 0;
+#endif
+}
+#endif
+
+// An empty file has no mapping, but is still open
+bool CSMappedFile::Map()
+{
+   if (size_ == 0)
+      return true;
+#ifdef WIN32
+   mapping_ = CreateFileMappingA(file_, 0, writable_ ? PAGE_READWRITE : PAGE_READONLY, 0, 0, 0);
+   if (mapping_ == 0)
+      return false;
+   data_ = (unsigned char*) MapViewOfFile(mapping_, writable_ ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+#else
+   void* data = mmap(0, size_, writable_ ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd_, 0);
+   data_ = data == MAP_FAILED ? 0 : (unsigned char*) data;
+#endif
+   return data_ != 0;
+}
+
+void CSMappedFile::Unmap()
+{
+#ifdef WIN32
+   if (data_ != 0)
+      UnmapViewOfFile(data_);
+   if (mapping_ != 0)
+      CloseHandle(mapping_);
+   mapping_ = 0;
+#else
+   if (data_ != 0)
+      munmap(data_, size_);
+#endif
+   data_ = 0;
+}
+
+void CSMappedFile::Close()
+{
+   Unmap();
+#ifdef WIN32
+   if (file_ != INVALID_HANDLE_VALUE)
+      CloseHandle(file_);
+   file_ = INVALID_HANDLE_VALUE;
+#else
+   if (fd_ >= 0)
+      close(fd_);
+   fd_ = -1;
+#endif
+   size_ = 0;
+   writable_ = false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CSOperators implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Cache file layout (native byte order, the cache is local to the machine):
+// header, then the n x n factor as doubles
+struct CSOperatorsHeader
+{
+   char magic[8];
+   unsigned int nRows;
+   unsigned int nElements;
+   unsigned long long checksum;
+   double lambda;
+   double lipschitz;
+};
+
+// Power iteration on a symmetric positive semi-definite n x n matrix
+static double LargestEigenvalue(const double* g, unsigned n)
+{
+   std::vector<double> v(n, 1.0 / sqrt((double) n)), w(n);
+   double eigenvalue = 0.0;
+   for (int iter = 0; iter < 100; iter++)
+   {
+      double norm = 0.0;
+      for (unsigned i = 0; i < n; i++)
+      {
+         double sum = 0.0;
+         for (unsigned j = 0; j < n; j++)
+            sum += g[i * n + j] * v[j];
+         w[i] = sum;
+         norm += sum * sum;
+      }
+      norm = sqrt(norm);
+      if (norm == 0.0)
+         break;
+      for (unsigned i = 0; i < n; i++)
+         v[i] = w[i] / norm;
+      bool done = fabs(norm - eigenvalue) <= 1e-9 * norm;
+      eigenvalue = norm;
+      if (done)
+         break;
+   }
+   return eigenvalue;
+}
+
+static const char g_CSOperatorsMagic[8] = {'C', 'S', 'O', 'P', 'S', '0', '0', '2'};
+
+CSOperators::CSOperators() :
+   factor_(0),
+   nElements_(0),
+   lambda_(0.0),
+   lipschitz_(0.0)
+{
+}
+
+void CSOperators::Clear()
+{
+   file_.Close();
+   values_.clear();
+   factor_ = 0;
+   nElements_ = 0;
+   lambda_ = 0.0;
+   lipschitz_ = 0.0;
+}
+
+// FNV-1a over the basis values, guards against a host CSV that differs from
+// the basis the firmware was built with
+unsigned long long CSOperators::Checksum(const CSBasis& basis)
+{
+   unsigned long long hash = 14695981039346656037ULL;
+   for (unsigned r = 0; r < basis.GetNumberOfRows(); r++)
+   {
+      const unsigned char* bytes = (const unsigned char*) basis.GetRow(r);
+      for (size_t i = 0; i < basis.GetNumberOfElements() * sizeof(double); i++)
+      {
+         hash ^= bytes[i];
+         hash *= 1099511628211ULL;
+      }
+   }
+   return hash;
+}
+
+int CSOperators::Prepare(const CSBasis& basis, double lambda, long basisId, const std::string& cacheDir)
+{
+   Clear();
+   if (!basis.IsLoaded())
+      return ERR_CS_NOT_READY;
+
+   std::string path;
+   if (cacheDir != "")
+   {
+      // without an id from the firmware, the content identifies the basis
+      unsigned long key = basisId != 0 ? (unsigned long) basisId : (unsigned long) Checksum(basis);
+      std::ostringstream os;
+      os << cacheDir << "/cs_operators_" << std::hex << key << std::dec << "_" << lambda << ".bin";
+      path = os.str();
+      if (Map(path, basis, lambda))
+         return DEVICE_OK;
+   }
+
+   Compute(basis, lambda);
+   if (path != "")
+      return Save(path, basis);
+   return DEVICE_OK;
+}
+
+bool CSOperators::Map(const std::string& path, const CSBasis& basis, double lambda)
+{
+   if (!file_.Open(path))
+      return false;
+
+   const unsigned n = basis.GetNumberOfElements();
+   CSOperatorsHeader header;
+   size_t expected = sizeof(header) + (size_t) n * n * sizeof(double);
+   if (file_.GetSize() != expected) {
+      file_.Close();
+      return false;
+   }
+   memcpy(&header, file_.GetData(), sizeof(header));
+   if (memcmp(header.magic, g_CSOperatorsMagic, sizeof(header.magic)) != 0 ||
+         header.nRows != basis.GetNumberOfRows() || header.nElements != n ||
+         header.checksum != Checksum(basis) || header.lambda != lambda)
+   {
+      file_.Close();
+      return false;
+   }
+
+   factor_ = (const double*) (file_.GetData() + sizeof(header));
+   nElements_ = n;
+   lambda_ = lambda;
+   lipschitz_ = header.lipschitz;
+   return true;
+}
+
+void CSOperators::Compute(const CSBasis& basis, double lambda)
+{
+   const unsigned n = basis.GetNumberOfElements();
+   std::vector<double> g((size_t) n * n, 0.0);
+   double* gram = &g[0];
+   values_.assign((size_t) n * n, 0.0);
+   double* factor = &values_[0];
+
+   for (unsigned r = 0; r < basis.GetNumberOfRows(); r++)
+   {
+      const double* a = basis.GetRow(r);
+      for (unsigned i = 0; i < n; i++)
+         for (unsigned j = 0; j <= i; j++)
+            gram[i * n + j] += a[i] * a[j];
+   }
+   for (unsigned i = 0; i < n; i++)
+      for (unsigned j = 0; j < i; j++)
+         gram[j * n + i] = gram[i * n + j];
+
+   // Cholesky factor of gram + lambda I
+   for (unsigned j = 0; j < n; j++)
+   {
+      double d = gram[j * n + j] + lambda;
+      for (unsigned k = 0; k < j; k++)
+         d -= factor[j * n + k] * factor[j * n + k];
+      factor[j * n + j] = sqrt(d);
+      for (unsigned i = j + 1; i < n; i++)
+      {
+         double sum = gram[i * n + j];
+         for (unsigned k = 0; k < j; k++)
+            sum -= factor[i * n + k] * factor[j * n + k];
+         factor[i * n + j] = sum / factor[j * n + j];
+      }
+   }
+
+   factor_ = factor;
+   nElements_ = n;
+   lambda_ = lambda;
+   lipschitz_ = LargestEigenvalue(gram, n);
+}
+
+int CSOperators::Save(const std::string& path, const CSBasis& basis) const
+{
+   CSOperatorsHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, g_CSOperatorsMagic, sizeof(header.magic));
+   header.nRows = basis.GetNumberOfRows();
+   header.nElements = nElements_;
+   header.checksum = Checksum(basis);
+   header.lambda = lambda_;
+   header.lipschitz = lipschitz_;
+
+   // written aside then renamed, other processes may have the old file mapped
+   std::string temp = path + ".tmp";
+   FILE* fp = fopen(temp.c_str(), "wb");
+   if (fp == 0)
+      return ERR_WRITE_FAILED;
+   bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fwrite(&values_[0], sizeof(double), values_.size(), fp) == values_.size();
+   ok = fclose(fp) == 0 && ok;
+   if (!ok) {
+      remove(temp.c_str());
+      return ERR_WRITE_FAILED;
+   }
+#ifdef WIN32
+   remove(path.c_str());
+#endif
+   // if the old file is still in use, the operators are just not cached
+   if (rename(temp.c_str(), path.c_str()) != 0)
+      remove(temp.c_str());
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CSIncrementalSolver implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+CSIncrementalSolver::CSIncrementalSolver() :
+   basis_(0),
+   operators_(0),
+   nElements_(0),
+   nPixels_(0),
+   lambda_(0.0),
+   rowsSeenOnce_(0),
+   rowsAccumulated_(0)
+{
+}
+
+int CSIncrementalSolver::Initialize(const CSBasis& basis, unsigned nPixels, double lambda, const CSOperators* operators)
+{
+   if (!basis.IsLoaded())
+      return ERR_CS_BASIS_FILE;
+   // the factor starts as sqrt(lambda) I, lambda has to keep it positive definite
+   if (lambda <= 0.0)
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   basis_ = &basis;
+   operators_ = 0;
+   if (operators && operators->IsReady() && operators->GetLambda() == lambda &&
+         operators->GetNumberOfElements() == basis.GetNumberOfElements())
+      operators_ = operators;
+   nElements_ = basis.GetNumberOfElements();
+   nPixels_ = nPixels;
+   lambda_ = lambda;
+   Reset();
+
+   return DEVICE_OK;
+}
+
+void CSIncrementalSolver::Reset()
+{
+   const unsigned n = nElements_;
+   gram_.assign(n * n, 0.0);
+   factor_.assign(n * n, 0.0);
+   for (unsigned k = 0; k < n; k++)
+      factor_[k * n + k] = sqrt(lambda_);
+   aty_.assign((size_t) nPixels_ * n, 0.0);
+   yy_.assign(nPixels_, 0.0);
+   work_.assign(n, 0.0);
+   pending_.clear();
+   rowCounts_.assign(basis_->GetNumberOfRows(), 0);
+   rowsSeenOnce_ = 0;
+   rowsAccumulated_ = 0;
+}
+
+// Rank-1 update L L^T + a a^T of the lower triangular factor
+void CSIncrementalSolver::UpdateFactor(const double* row) const
+{
+   const unsigned n = nElements_;
+   for (unsigned k = 0; k < n; k++)
+      work_[k] = row[k];
+
+   for (unsigned k = 0; k < n; k++)
+   {
+      double lkk = factor_[k * n + k];
+      double r = sqrt(lkk * lkk + work_[k] * work_[k]);
+      double c = r / lkk;
+      double s = work_[k] / lkk;
+      factor_[k * n + k] = r;
+      for (unsigned i = k + 1; i < n; i++)
+      {
+         double lik = (factor_[i * n + k] + s * work_[i]) / c;
+         work_[i] = c * work_[i] - s * lik;
+         factor_[i * n + k] = lik;
+      }
+   }
+}
+
+int CSIncrementalSolver::AddFrame(unsigned row, const unsigned char* pixels, unsigned byteDepth)
+{
+   if (!IsInitialized())
+      return ERR_CS_NOT_READY;
+   if (row >= basis_->GetNumberOfRows())
+      return ERR_CS_BASIS_MISMATCH;
+   if (byteDepth != 1 && byteDepth != 2)
+      return DEVICE_UNSUPPORTED_COMMAND;
+
+   const unsigned n = nElements_;
+   const double* a = basis_->GetRow(row);
+
+   pending_.push_back(row);
+   if (++rowCounts_[row] == 1)
+      rowsSeenOnce_++;
+   else if (rowCounts_[row] == 2)
+      rowsSeenOnce_--;
+   if (operators_ == 0)
+      Refresh();
+
+   double* aty = aty_.empty() ? 0 : &aty_[0];
+   if (byteDepth == 1)
+   {
+      for (unsigned p = 0; p < nPixels_; p++, aty += n)
+      {
+         double y = pixels[p];
+         if (y == 0.0)
+            continue;
+         yy_[p] += y * y;
+         for (unsigned k = 0; k < n; k++)
+            aty[k] += a[k] * y;
+      }
+   }
+   else
+   {
+      const unsigned short* px = (const unsigned short*) pixels;
+      for (unsigned p = 0; p < nPixels_; p++, aty += n)
+      {
+         double y = px[p];
+         if (y == 0.0)
+            continue;
+         yy_[p] += y * y;
+         for (unsigned k = 0; k < n; k++)
+            aty[k] += a[k] * y;
+      }
+   }
+
+   rowsAccumulated_++;
+   return DEVICE_OK;
+}
+
+// Brings gram_ and factor_ up to date with the rows added since the last call
+void CSIncrementalSolver::Refresh() const
+{
+   if (pending_.empty())
+      return;
+
+   const unsigned n = nElements_;
+   if (operators_ != 0 && rowsSeenOnce_ == basis_->GetNumberOfRows())
+   {
+      // exactly one complete pass: the factor is known, and the Gram matrix
+      // follows from it as L L^T - lambda I
+      memcpy(&factor_[0], operators_->GetFactor(), (size_t) n * n * sizeof(double));
+      for (unsigned i = 0; i < n; i++)
+         for (unsigned j = 0; j <= i; j++)
+         {
+            double sum = i == j ? -lambda_ : 0.0;
+            for (unsigned k = 0; k <= j; k++)
+               sum += factor_[i * n + k] * factor_[j * n + k];
+            gram_[i * n + j] = sum;
+         }
+      pending_.clear();
+      return;
+   }
+
+   for (unsigned r = 0; r < pending_.size(); r++)
+   {
+      const double* a = basis_->GetRow(pending_[r]);
+      for (unsigned i = 0; i < n; i++)
+         for (unsigned j = 0; j <= i; j++)
+            gram_[i * n + j] += a[i] * a[j];
+      UpdateFactor(a);
+   }
+   pending_.clear();
+}
+
+// Forward then backward substitution with the current factor
+void CSIncrementalSolver::Solve(const double* rhs, double* x) const
+{
+   const unsigned n = nElements_;
+   for (unsigned i = 0; i < n; i++)
+   {
+      double sum = rhs[i];
+      for (unsigned k = 0; k < i; k++)
+         sum -= factor_[i * n + k] * x[k];
+      x[i] = sum / factor_[i * n + i];
+   }
+   for (int i = (int) n - 1; i >= 0; i--)
+   {
+      double sum = x[i];
+      for (unsigned k = i + 1; k < n; k++)
+         sum -= factor_[k * n + i] * x[k];
+      x[i] = sum / factor_[i * n + i];
+   }
+}
+
+void CSIncrementalSolver::SolvePixel(unsigned pixel, double* x) const
+{
+   Refresh();
+   Solve(&aty_[(size_t) pixel * nElements_], x);
+}
+
+// ||y - Ax||^2 = y^T y - 2 x^T A^T y + x^T A^T A x, from the accumulators
+double CSIncrementalSolver::GetResidual2(unsigned pixel, const double* x) const
+{
+   Refresh();
+   const unsigned n = nElements_;
+   const double* aty = &aty_[(size_t) pixel * n];
+   double r = yy_[pixel];
+   for (unsigned i = 0; i < n; i++)
+   {
+      double gx = gram_[i * n + i] * x[i];
+      for (unsigned j = 0; j < i; j++)
+         gx += gram_[i * n + j] * x[j];
+      for (unsigned j = i + 1; j < n; j++)
+         gx += gram_[j * n + i] * x[j];
+      r += x[i] * (gx - 2.0 * aty[i]);
+   }
+   return r > 0.0 ? r : 0.0;
+}
+
+double CSIncrementalSolver::GetUncertainty(const double* a) const
+{
+   Refresh();
+   const unsigned n = nElements_;
+   std::vector<double> v(n);
+   double u = 0.0;
+   for (unsigned i = 0; i < n; i++)
+   {
+      double sum = a[i];
+      for (unsigned k = 0; k < i; k++)
+         sum -= factor_[i * n + k] * v[k];
+      v[i] = sum / factor_[i * n + i];
+      u += v[i] * v[i];
+   }
+   return u;
+}
+
+int CSIncrementalSolver::GetEstimate(std::vector<float>& estimate) const
+{
+   if (!IsInitialized())
+      return ERR_CS_NOT_READY;
+
+   Refresh();
+   const unsigned n = nElements_;
+   estimate.resize((size_t) n * nPixels_);
+   std::vector<double> x(n);
+   for (unsigned p = 0; p < nPixels_; p++)
+   {
+      Solve(&aty_[(size_t) p * n], &x[0]);
+      for (unsigned k = 0; k < n; k++)
+         estimate[(size_t) k * nPixels_ + p] = (float) x[k];
+   }
+   return DEVICE_OK;
+}
+
+int CSIncrementalSolver::GetStackOperator(const std::vector<unsigned>& rows, std::vector<float>& w) const
+{
+   if (!IsInitialized())
+      return ERR_CS_NOT_READY;
+
+   Refresh();
+   const unsigned n = nElements_;
+   const unsigned m = (unsigned) rows.size();
+   w.resize((size_t) n * m);
+   std::vector<double> x(n);
+   for (unsigned f = 0; f < m; f++)
+   {
+      if (rows[f] >= basis_->GetNumberOfRows())
+         return ERR_CS_BASIS_MISMATCH;
+      Solve(basis_->GetRow(rows[f]), &x[0]);
+      for (unsigned k = 0; k < n; k++)
+         w[(size_t) k * m + f] = (float) x[k];
+   }
+   return DEVICE_OK;
+}
+
+int CSIncrementalSolver::GetStackTranspose(const std::vector<unsigned>& rows, std::vector<float>& w) const
+{
+   if (!IsInitialized())
+      return ERR_CS_NOT_READY;
+
+   const unsigned n = nElements_;
+   const unsigned m = (unsigned) rows.size();
+   w.resize((size_t) n * m);
+   for (unsigned f = 0; f < m; f++)
+   {
+      if (rows[f] >= basis_->GetNumberOfRows())
+         return ERR_CS_BASIS_MISMATCH;
+      const double* a = basis_->GetRow(rows[f]);
+      for (unsigned k = 0; k < n; k++)
+         w[(size_t) k * m + f] = (float) a[k];
+   }
+   return DEVICE_OK;
+}
+
+int CSIncrementalSolver::GetATyPlanes(std::vector<float>& planes) const
+{
+   if (!IsInitialized())
+      return ERR_CS_NOT_READY;
+
+   const unsigned n = nElements_;
+   planes.resize((size_t) n * nPixels_);
+   for (unsigned p = 0; p < nPixels_; p++)
+      for (unsigned k = 0; k < n; k++)
+         planes[(size_t) k * nPixels_ + p] = (float) aty_[(size_t) p * n + k];
+   return DEVICE_OK;
+}
+
+void CSIncrementalSolver::GetGram(std::vector<double>& gram) const
+{
+   Refresh();
+   const unsigned n = nElements_;
+   gram.resize((size_t) n * n);
+   for (unsigned i = 0; i < n; i++)
+      for (unsigned j = 0; j <= i; j++)
+         gram[i * n + j] = gram[j * n + i] = gram_[i * n + j];
+}
+
+double CSIncrementalSolver::GetLipschitz() const
+{
+   if (operators_ != 0 && rowsSeenOnce_ == basis_->GetNumberOfRows())
+      return operators_->GetLipschitz();
+   std::vector<double> gram;
+   GetGram(gram);
+   return LargestEigenvalue(&gram[0], nElements_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CSMultiplyStack implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// A tile is g_ElementBlock x g_PixelTile output values (32 KB) plus one
+// frame row of g_PixelTile values streaming through
+const unsigned g_PixelTile = 256;
+const unsigned g_ElementBlock = 32;
+
+static void MultiplyTile(const float* w, unsigned n, unsigned m, const float* stack,
+      unsigned nPixels, float* out, unsigned p0, unsigned len)
+{
+   for (unsigned k0 = 0; k0 < n; k0 += g_ElementBlock)
+   {
+      unsigned k1 = std::min(n, k0 + g_ElementBlock);
+      for (unsigned k = k0; k < k1; k++)
+         memset(out + (size_t) k * nPixels + p0, 0, len * sizeof(float));
+      for (unsigned j = 0; j < m; j++)
+      {
+         const float* y = stack + (size_t) j * nPixels + p0;
+         for (unsigned k = k0; k < k1; k++)
+         {
+            const float wkj = w[(size_t) k * m + j];
+            if (wkj == 0.0f)
+               continue;
+            float* x = out + (size_t) k * nPixels + p0;
+            for (unsigned p = 0; p < len; p++)
+               x[p] += wkj * y[p];
+         }
+      }
+   }
+}
+
+// Work cut in independent tiles, shared among threads
+class CSTileTask
+{
+public:
+   virtual ~CSTileTask() {}
+   virtual void RunTile(unsigned tile) = 0;
+};
+
+// Takes every stride-th tile, starting at tile first
+class CSTileWorker : public MMDeviceThreadBase
+{
+public:
+   CSTileWorker(CSTileTask& task, unsigned nTiles, unsigned first, unsigned stride) :
+      task_(task), nTiles_(nTiles), first_(first), stride_(stride)
+   {
+   }
+   int svc()
+   {
+      for (unsigned t = first_; t < nTiles_; t += stride_)
+         task_.RunTile(t);
+      return 0;
+   }
+   int open(void*) {return 0;}
+   int close(unsigned long) {return 0;}
+   CSTileWorker & operator=( const CSTileWorker & ) 
+   {
+      return *this;
+   }
+
+private:
+   CSTileTask& task_;
+   unsigned nTiles_;
+   unsigned first_;
+   unsigned stride_;
+};
+
+static void RunTiles(CSTileTask& task, unsigned nTiles, unsigned nThreads)
+{
+   if (nThreads > nTiles)
+      nThreads = nTiles;
+   if (nThreads < 1)
+      nThreads = 1;
+
+   // the calling thread takes the first share
+   std::vector<CSTileWorker*> workers;
+   for (unsigned t = 1; t < nThreads; t++)
+   {
+      workers.push_back(new CSTileWorker(task, nTiles, t, nThreads));
+      workers.back()->activate();
+   }
+   CSTileWorker(task, nTiles, 0, nThreads).svc();
+   for (unsigned t = 0; t < workers.size(); t++)
+   {
+      workers[t]->wait();
+      delete workers[t];
+   }
+}
+
+class CSMultiplyTask : public CSTileTask
+{
+public:
+   CSMultiplyTask(const float* w, unsigned n, unsigned m, const float* stack,
+         unsigned nPixels, float* out) :
+      w_(w), n_(n), m_(m), stack_(stack), nPixels_(nPixels), out_(out)
+   {
+   }
+   void RunTile(unsigned tile)
+   {
+      unsigned p0 = tile * g_PixelTile;
+      MultiplyTile(w_, n_, m_, stack_, nPixels_, out_, p0, std::min(g_PixelTile, nPixels_ - p0));
+   }
+
+private:
+   const float* w_;
+   unsigned n_;
+   unsigned m_;
+   const float* stack_;
+   unsigned nPixels_;
+   float* out_;
+};
+
+void CSMultiplyStack(const float* w, unsigned n, unsigned m, const float* stack,
+      unsigned nPixels, float* out, unsigned nThreads)
+{
+   CSMultiplyTask task(w, n, m, stack, nPixels, out);
+   RunTiles(task, (nPixels + g_PixelTile - 1) / g_PixelTile, nThreads);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CSSolveWaveletSparse implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// 48 x 48 pixels are kept from each 64 x 64 tile; three Haar levels reach
+// 8 pixels across
+const unsigned g_SpatialTile = 48;
+const unsigned g_SpatialOverlap = 8;
+const unsigned g_HaarLevels = 3;
+
+// One level of the orthonormal Haar transform of len values spaced by
+// stride.  An odd last value is carried over to the approximation.
+static void Haar1D(float* x, unsigned len, unsigned stride, float* temp, bool inverse)
+{
+   const float s = 0.70710678f;
+   unsigned half = len / 2;
+   unsigned approx = (len + 1) / 2;
+   if (!inverse)
+   {
+      for (unsigned i = 0; i < half; i++)
+      {
+         float a = x[2 * i * stride], b = x[(2 * i + 1) * stride];
+         temp[i] = (a + b) * s;
+         temp[approx + i] = (a - b) * s;
+      }
+      if (len & 1)
+         temp[half] = x[(len - 1) * stride];
+   }
+   else
+   {
+      for (unsigned i = 0; i < half; i++)
+      {
+         float a = x[i * stride], d = x[(approx + i) * stride];
+         temp[2 * i] = (a + d) * s;
+         temp[2 * i + 1] = (a - d) * s;
+      }
+      if (len & 1)
+         temp[len - 1] = x[half * stride];
+   }
+   for (unsigned i = 0; i < len; i++)
+      x[i * stride] = temp[i];
+}
+
+static void Haar2D(float* plane, unsigned width, unsigned height, float* temp, bool inverse)
+{
+   unsigned w[g_HaarLevels + 1], h[g_HaarLevels + 1];
+   w[0] = width;
+   h[0] = height;
+   for (unsigned l = 0; l < g_HaarLevels; l++)
+   {
+      w[l + 1] = (w[l] + 1) / 2;
+      h[l + 1] = (h[l] + 1) / 2;
+   }
+   for (unsigned i = 0; i < g_HaarLevels; i++)
+   {
+      unsigned l = inverse ? g_HaarLevels - 1 - i : i;
+      if (w[l] < 2 || h[l] < 2)
+         continue;
+      if (!inverse)
+      {
+         for (unsigned y = 0; y < h[l]; y++)
+            Haar1D(plane + y * width, w[l], 1, temp, false);
+         for (unsigned x = 0; x < w[l]; x++)
+            Haar1D(plane + x, h[l], width, temp, false);
+      }
+      else
+      {
+         for (unsigned x = 0; x < w[l]; x++)
+            Haar1D(plane + x, h[l], width, temp, true);
+         for (unsigned y = 0; y < h[l]; y++)
+            Haar1D(plane + y * width, w[l], 1, temp, true);
+      }
+   }
+}
+
+// Proximal step of threshold * ||H x||_1: soft thresholding of the details,
+// the coarsest approximation is left alone
+static void ShrinkWavelet(float* plane, unsigned width, unsigned height, float threshold, float* temp)
+{
+   Haar2D(plane, width, height, temp, false);
+   unsigned aw = width, ah = height;
+   for (unsigned l = 0; l < g_HaarLevels; l++)
+   {
+      if (aw < 2 || ah < 2)
+         break;
+      aw = (aw + 1) / 2;
+      ah = (ah + 1) / 2;
+   }
+   for (unsigned y = 0; y < height; y++)
+   {
+      float* row = plane + y * width;
+      for (unsigned x = 0; x < width; x++)
+      {
+         if (x < aw && y < ah)
+            continue;
+         float v = row[x];
+         row[x] = v > threshold ? v - threshold : (v < -threshold ? v + threshold : 0.0f);
+      }
+   }
+   Haar2D(plane, width, height, temp, true);
+}
+
+class CSWaveletTask : public CSTileTask
+{
+public:
+   CSWaveletTask(const double* gram, double lipschitz, const float* aty, unsigned n,
+         unsigned width, unsigned height, double weight, unsigned iterations, float* out) :
+      gram_(gram), lipschitz_(lipschitz), aty_(aty), n_(n), width_(width), height_(height),
+      weight_(weight), iterations_(iterations), out_(out),
+      tilesX_((width + g_SpatialTile - 1) / g_SpatialTile)
+   {
+   }
+   void RunTile(unsigned tile);
+
+private:
+   const double* gram_;
+   double lipschitz_;
+   const float* aty_;
+   unsigned n_;
+   unsigned width_;
+   unsigned height_;
+   double weight_;
+   unsigned iterations_;
+   float* out_;
+   unsigned tilesX_;
+};
+
+void CSWaveletTask::RunTile(unsigned tile)
+{
+   const unsigned n = n_;
+   unsigned cx0 = (tile % tilesX_) * g_SpatialTile;
+   unsigned cy0 = (tile / tilesX_) * g_SpatialTile;
+   unsigned cx1 = std::min(cx0 + g_SpatialTile, width_);
+   unsigned cy1 = std::min(cy0 + g_SpatialTile, height_);
+   unsigned rx0 = cx0 > g_SpatialOverlap ? cx0 - g_SpatialOverlap : 0;
+   unsigned ry0 = cy0 > g_SpatialOverlap ? cy0 - g_SpatialOverlap : 0;
+   unsigned rx1 = std::min(cx1 + g_SpatialOverlap, width_);
+   unsigned ry1 = std::min(cy1 + g_SpatialOverlap, height_);
+   const unsigned rw = rx1 - rx0, rh = ry1 - ry0, rp = rw * rh;
+   const size_t nPixels = (size_t) width_ * height_;
+
+   std::vector<float> b((size_t) n * rp), x((size_t) n * rp, 0.0f), z((size_t) n * rp, 0.0f), v((size_t) n * rp);
+   std::vector<float> temp(std::max(rw, rh));
+   for (unsigned k = 0; k < n; k++)
+      for (unsigned y = 0; y < rh; y++)
+         memcpy(&b[(size_t) k * rp + y * rw], aty_ + k * nPixels + (size_t) (ry0 + y) * width_ + rx0, rw * sizeof(float));
+
+   const float step = (float) (1.0 / lipschitz_);
+   const float threshold = (float) (weight_ / lipschitz_);
+   double t = 1.0;
+   for (unsigned iter = 0; iter < iterations_; iter++)
+   {
+      // gradient step from z: v = z - (G z - A^T y) / L, plane by plane
+      for (unsigned i = 0; i < n; i++)
+      {
+         float* vi = &v[(size_t) i * rp];
+         const float* zi = &z[(size_t) i * rp];
+         const float* bi = &b[(size_t) i * rp];
+         for (unsigned p = 0; p < rp; p++)
+            vi[p] = zi[p] + step * bi[p];
+         for (unsigned j = 0; j < n; j++)
+         {
+            const float g = (float) (step * gram_[i * n + j]);
+            if (g == 0.0f)
+               continue;
+            const float* zj = &z[(size_t) j * rp];
+            for (unsigned p = 0; p < rp; p++)
+               vi[p] -= g * zj[p];
+         }
+         ShrinkWavelet(vi, rw, rh, threshold, &temp[0]);
+      }
+
+      // v is the new x, z extrapolates from the previous one
+      double tNext = (1.0 + sqrt(1.0 + 4.0 * t * t)) / 2.0;
+      const float momentum = (float) ((t - 1.0) / tNext);
+      for (size_t q = 0; q < v.size(); q++)
+         z[q] = v[q] + momentum * (v[q] - x[q]);
+      x.swap(v);
+      t = tNext;
+   }
+
+   for (unsigned k = 0; k < n; k++)
+      for (unsigned y = cy0; y < cy1; y++)
+         memcpy(out_ + k * nPixels + (size_t) y * width_ + cx0,
+               &x[(size_t) k * rp + (y - ry0) * rw + (cx0 - rx0)], (cx1 - cx0) * sizeof(float));
+}
+
+int CSSolveWaveletSparse(const double* gram, double lipschitz, const float* aty,
+      unsigned n, unsigned width, unsigned height, double weight,
+      unsigned iterations, unsigned nThreads, float* out)
+{
+   if (lipschitz <= 0.0)
+      return ERR_CS_NOT_READY;
+
+   CSWaveletTask task(gram, lipschitz, aty, n, width, height, weight, iterations, out);
+   unsigned nTiles = ((width + g_SpatialTile - 1) / g_SpatialTile) * ((height + g_SpatialTile - 1) / g_SpatialTile);
+   RunTiles(task, nTiles, nThreads);
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CSAdaptiveSampler implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// at most that many pixels are solved to monitor the convergence
+const unsigned g_MaxMonitoredPixels = 4096;
+
+CSAdaptiveSampler::CSAdaptiveSampler() :
+   basis_(0),
+   batchSize_(8),
+   tolerance_(0.01),
+   oversampling_(2.0),
+   residual_(0.0),
+   sparsity_(0.0),
+   change_(1.0)
+{
+}
+
+void CSAdaptiveSampler::Configure(unsigned batchSize, double tolerance, double oversampling)
+{
+   batchSize_ = batchSize;
+   tolerance_ = tolerance;
+   oversampling_ = oversampling;
+}
+
+void CSAdaptiveSampler::Start(const CSBasis& basis)
+{
+   basis_ = &basis;
+   measured_.assign(basis.GetNumberOfRows(), false);
+   previous_.clear();
+   residual_ = 0.0;
+   sparsity_ = 0.0;
+   change_ = 1.0;
+}
+
+void CSAdaptiveSampler::MarkMeasured(unsigned row)
+{
+   if (row < measured_.size())
+      measured_[row] = true;
+}
+
+bool CSAdaptiveSampler::NextBatch(const CSIncrementalSolver& solver, std::vector<unsigned>& rows)
+{
+   rows.clear();
+   if (!IsActive())
+      return false;
+
+   const unsigned n = basis_->GetNumberOfElements();
+   std::vector<std::pair<double, unsigned> > scores;
+   for (unsigned r = 0; r < basis_->GetNumberOfRows(); r++)
+   {
+      if (measured_[r])
+         continue;
+      const double* a = basis_->GetRow(r);
+      double score = 0.0;
+      if (solver.IsInitialized())
+         score = solver.GetUncertainty(a);
+      else
+         for (unsigned k = 0; k < n; k++)
+            score += a[k] * a[k];
+      scores.push_back(std::make_pair(-score, r));
+   }
+   if (scores.empty())
+      return false;
+
+   unsigned count = std::min((unsigned) scores.size(), batchSize_);
+   std::partial_sort(scores.begin(), scores.begin() + count, scores.end());
+   for (unsigned i = 0; i < count; i++)
+      rows.push_back(scores[i].second);
+   return true;
+}
+
+bool CSAdaptiveSampler::Update(const CSIncrementalSolver& solver)
+{
+   if (!IsActive() || !solver.IsInitialized())
+      return false;
+
+   const unsigned n = solver.GetNumberOfElements();
+   const unsigned nPixels = solver.GetNumberOfPixels();
+   unsigned stride = nPixels / g_MaxMonitoredPixels + 1;
+
+   std::vector<double> estimate;
+   std::vector<double> x(n);
+   std::vector<double> energy(n);
+   double residual2 = 0.0, signal2 = 0.0, sparsity = 0.0;
+   unsigned nMonitored = 0;
+   for (unsigned p = 0; p < nPixels; p += stride, nMonitored++)
+   {
+      solver.SolvePixel(p, &x[0]);
+      residual2 += solver.GetResidual2(p, &x[0]);
+      signal2 += solver.GetSignal2(p);
+      estimate.insert(estimate.end(), x.begin(), x.end());
+
+      // number of coefficients holding 95% of the energy of this pixel
+      double total = 0.0;
+      for (unsigned k = 0; k < n; k++) {
+         energy[k] = x[k] * x[k];
+         total += energy[k];
+      }
+      if (total == 0.0)
+         continue;
+      std::sort(energy.begin(), energy.end());
+      double sum = 0.0;
+      unsigned s = 0;
+      while (s < n && sum < 0.95 * total)
+         sum += energy[n - 1 - s++];
+      sparsity += s;
+   }
+
+   residual_ = signal2 > 0.0 ? sqrt(residual2 / signal2) : 0.0;
+   sparsity_ = nMonitored > 0 ? sparsity / nMonitored : 0.0;
+
+   double diff2 = 0.0, norm2 = 0.0;
+   for (unsigned i = 0; i < estimate.size(); i++) {
+      double previous = previous_.size() == estimate.size() ? previous_[i] : 0.0;
+      diff2 += (estimate[i] - previous) * (estimate[i] - previous);
+      norm2 += estimate[i] * estimate[i];
+   }
+   change_ = norm2 > 0.0 ? sqrt(diff2 / norm2) : 1.0;
+   previous_.swap(estimate);
+
+   // number of measurements needed for an s-sparse signal of size n
+   double s = std::max(sparsity_, 1.0);
+   double needed = std::max(oversampling_ * s * log(n / s), s);
+   return change_ < tolerance_ && solver.GetRowsAccumulated() >= needed;
+}
@@ -0,0 +1,266 @@
+//////////////////////////////////////////////////////////////////////////////
+// FILE:          CSReconstruction.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Host-side compressed sensing reconstruction for the Arduino
+//                adapter.  The measurement matrix is the same CSV basis that
+//                is compiled into the firmware (see ArduinoLibs.csvToIno)
+// LICENSE:       LGPL
+//
+
+#ifndef _CSReconstruction_H_
+#define _CSReconstruction_H_
+
+#include <string>
+#include <vector>
+
+/**
+ * Measurement matrix as stored in the basis CSV file.
+ * The CSV has one header line and one label column.  Every other line is a
+ * basis element, every other column is a basis row (one measurement), which
+ * is the layout read by BasisTools.readBasis on the Java side.
+ */
+class CSBasis
+{
+public:
+   CSBasis();
+
+   int Load(const std::string& path);
+   // values row-major, nElements values per basis row
+   void Assign(unsigned nRows, unsigned nElements, const std::vector<double>& values, const std::string& path);
+   int Save(const std::string& path) const;
+   void Clear();
+
+   bool IsLoaded() const {return nRows_ > 0 && nElements_ > 0;}
+   unsigned GetNumberOfRows() const {return nRows_;}
+   unsigned GetNumberOfElements() const {return nElements_;}
+   // row-major: nElements_ consecutive values per basis row
+   const double* GetRow(unsigned row) const {return &values_[row * nElements_];}
+   const std::string& GetPath() const {return path_;}
+
+private:
+   std::vector<double> values_;
+   unsigned nRows_;
+   unsigned nElements_;
+   std::string path_;
+};
+
+/**
+ * Memory mapping of a whole file, read-only or, for a file created with
+ * Create, read-write and resizable.
+ */
+class CSMappedFile
+{
+public:
+   CSMappedFile();
+   ~CSMappedFile();
+
+   bool Open(const std::string& path);
+   bool Create(const std::string& path, size_t size);
+   // writable files only, the mapping may move
+   bool Resize(size_t size);
+   void Close();
+   bool IsOpen() const {return data_ != 0;}
+   const unsigned char* GetData() const {return data_;}
+   unsigned char* GetWritableData() const {return writable_ ? data_ : 0;}
+   size_t GetSize() const {return size_;}
+
+private:
+   CSMappedFile(const CSMappedFile&);
+   CSMappedFile& operator=(const CSMappedFile&);
+   bool Map();
+   void Unmap();
+#ifndef WIN32
+   bool Reserve(size_t offset, size_t end);
+#endif
+
+   unsigned char* data_;
+   size_t size_;
+   bool writable_;
+#ifdef WIN32
+   void* file_;
+   void* mapping_;
+#else
+   int fd_;
+#endif
+};
+
+/**
+ * Operators of a complete pass through a basis: the lower Cholesky factor of
+ * A^T A + lambda I and the Lipschitz constant of the gradient of ||Ax - y||^2 / 2 (largest eigenvalue of A^T A).
+ * They only depend on the basis, so they are cached on disk, keyed by the
+ * basis id the firmware reports, and memory-mapped when the basis is reused.
+ */
+class CSOperators
+{
+public:
+   CSOperators();
+
+   // loads the cached operators of that basis or computes (and caches) them.
+   // An empty cacheDir only computes them.
+   int Prepare(const CSBasis& basis, double lambda, long basisId, const std::string& cacheDir);
+   void Clear();
+
+   bool IsReady() const {return factor_ != 0;}
+   bool IsMapped() const {return file_.IsOpen();}
+   unsigned GetNumberOfElements() const {return nElements_;}
+   double GetLambda() const {return lambda_;}
+   double GetLipschitz() const {return lipschitz_;}
+   const double* GetFactor() const {return factor_;} // n x n, lower triangle
+
+   static unsigned long long Checksum(const CSBasis& basis);
+
+private:
+   bool Map(const std::string& path, const CSBasis& basis, double lambda);
+   void Compute(const CSBasis& basis, double lambda);
+   int Save(const std::string& path, const CSBasis& basis) const;
+
+   CSMappedFile file_;
+   std::vector<double> values_; // factor, when not mapped
+   const double* factor_;
+   unsigned nElements_;
+   double lambda_;
+   double lipschitz_;
+};
+
+/**
+ * Ridge (Tikhonov) least squares reconstruction that is updated one
+ * measurement frame at a time.
+ * For every pixel p the solver keeps the running product A^T y_p, and it keeps
+ * a single Cholesky factor of A^T A + lambda I for the rows seen so far (the
+ * Gram matrix is shared by all pixels since they see the same basis).  Each
+ * frame costs one rank-1 update of the factor plus nElements multiply-adds per
+ * pixel, so an estimate can be extracted after any frame and the final solve
+ * only has to run the triangular solves.
+ */
+class CSIncrementalSolver
+{
+public:
+   CSIncrementalSolver();
+
+   // With the operators of the complete basis, the factor is not updated
+   // frame by frame: it is taken from the operators once every row has been
+   // seen exactly once, and updated lazily otherwise.
+   int Initialize(const CSBasis& basis, unsigned nPixels, double lambda, const CSOperators* operators = 0);
+   void Reset();
+   bool IsInitialized() const {return basis_ != 0;}
+
+   // pixels holds nPixels values of byteDepth bytes (1 or 2)
+   int AddFrame(unsigned row, const unsigned char* pixels, unsigned byteDepth);
+
+   // element-major output: nElements planes of nPixels values
+   int GetEstimate(std::vector<float>& estimate) const;
+
+   // W = (A^T A + lambda I)^-1 A_F^T for the frames F of a measurement stack,
+   // row-major n x rows.size(), so that the estimate is W times the stack
+   int GetStackOperator(const std::vector<unsigned>& rows, std::vector<float>& w) const;
+   // A_F^T, row-major n x rows.size()
+   int GetStackTranspose(const std::vector<unsigned>& rows, std::vector<float>& w) const;
+
+   // A^T y as nElements planes of nPixels values, the Gram matrix of the rows
+   // seen so far (full n x n) and its largest eigenvalue
+   int GetATyPlanes(std::vector<float>& planes) const;
+   void GetGram(std::vector<double>& gram) const;
+   double GetLipschitz() const;
+
+   // single pixel estimate (nElements values) and its squared residual
+   // ||y - A x||^2 over the rows seen so far
+   void SolvePixel(unsigned pixel, double* x) const;
+   double GetResidual2(unsigned pixel, const double* x) const;
+   double GetSignal2(unsigned pixel) const {return yy_[pixel];}
+   // a^T (A^T A + lambda I)^-1 a: how much a measurement with row a would
+   // still tell about the current estimate
+   double GetUncertainty(const double* a) const;
+
+   const CSBasis* GetBasis() const {return basis_;}
+   unsigned GetRowsAccumulated() const {return rowsAccumulated_;}
+   unsigned GetNumberOfElements() const {return nElements_;}
+   unsigned GetNumberOfPixels() const {return nPixels_;}
+
+private:
+   void UpdateFactor(const double* row) const;
+   void Refresh() const;
+   void Solve(const double* rhs, double* x) const;
+
+   const CSBasis* basis_;
+   const CSOperators* operators_;
+   unsigned nElements_;
+   unsigned nPixels_;
+   double lambda_;
+   // gram_ and factor_ are brought up to date with the pending rows on demand
+   mutable std::vector<double> gram_;    // A^T A of the rows seen so far (n x n)
+   mutable std::vector<double> factor_;  // lower Cholesky factor of gram_ + lambda I
+   mutable std::vector<double> work_;    // scratch for the rank-1 update
+   mutable std::vector<unsigned> pending_; // rows not yet in gram_ and factor_
+   std::vector<double> aty_;     // A^T y, nElements_ values per pixel
+   std::vector<double> yy_;      // y^T y per pixel
+   std::vector<unsigned> rowCounts_;
+   unsigned rowsSeenOnce_;
+   unsigned rowsAccumulated_;
+};
+
+/**
+ * Chooses the basis rows of an adaptive CS run and decides when to stop.
+ * After each batch the estimate of a subset of the pixels is compared with
+ * the one of the previous batch, and its sparsity s is estimated.  The run
+ * has converged when the estimate no longer changes and at least
+ * oversampling * s * log(n / s) rows have been measured.  The next batch is
+ * made of the unmeasured rows with the highest uncertainty.
+ */
+class CSAdaptiveSampler
+{
+public:
+   CSAdaptiveSampler();
+
+   void Configure(unsigned batchSize, double tolerance, double oversampling);
+   void Start(const CSBasis& basis);
+   bool IsActive() const {return basis_ != 0;}
+   void Stop() {basis_ = 0;}
+
+   void MarkMeasured(unsigned row);
+   // false when every row has already been measured
+   bool NextBatch(const CSIncrementalSolver& solver, std::vector<unsigned>& rows);
+   // true once the quality criterion is met
+   bool Update(const CSIncrementalSolver& solver);
+
+   unsigned GetBatchSize() const {return batchSize_;}
+   double GetResidual() const {return residual_;}
+   double GetSparsity() const {return sparsity_;}
+   double GetChange() const {return change_;}
+
+private:
+   const CSBasis* basis_;
+   unsigned batchSize_;
+   double tolerance_;
+   double oversampling_;
+   std::vector<bool> measured_;
+   std::vector<double> previous_; // estimate of the sampled pixels after the last batch
+   double residual_;
+   double sparsity_;
+   double change_;
+};
+
+/**
+ * Whole-frame product X = W Y of an n x m operator W (row-major) with a stack
+ * Y of m frames of nPixels values.  Both Y and X are stored plane after plane.
+ * The pixels are cut in tiles whose output block stays in cache while the
+ * frames stream through, and the tiles are shared among nThreads threads.
+ */
+void CSMultiplyStack(const float* w, unsigned n, unsigned m, const float* stack,
+      unsigned nPixels, float* out, unsigned nThreads);
+
+/**
+ * Reconstruction with a sparsity prior across the image: minimizes
+ * sum_p ||A x_p - y_p||^2 / 2 + weight * sum_k ||H x_k||_1 by FISTA, x_k being
+ * the image of basis element k and H the orthonormal 2D Haar transform.
+ * Only A^T A and A^T y are needed.  The image is processed in overlapping
+ * 64 x 64 pixel tiles, shared among nThreads threads; only the centre of each
+ * tile is kept so that the tile borders do not show.  Runs for a while with
+ * many elements, the CS processor calls it from its own thread.
+ */
+int CSSolveWaveletSparse(const double* gram, double lipschitz, const float* aty,
+      unsigned n, unsigned width, unsigned height, double weight,
+      unsigned iterations, unsigned nThreads, float* out);
+
+#endif //_CSReconstruction_H_
@@ -21,6 +21,7 @@ public class ArduinoLibs {
        Class that contain functions to deal with Arduino stuff
      */
     BasisTools basistools = new BasisTools(); // Load CSV basis
+    static final int DAC_MAX = 4095; // 12-bit TLV5618
 
     /*
     * Make sure that the Arduino is connected. This checks for the following
@@ -74,19 +75,45 @@ public class ArduinoLibs {
     /**
      * Function takes a csv file (a matrix) as an input and returns a string 
      *   ready to be written to a .ino file
+     * The basis is exported as a bank of one basis, see csvToIno(bases, dacChannel)
      * @param basis
      * @return
      */
     public String csvToIno(double basis[][]) {
+        return csvToIno(basis, 0);
+    }
+
+    /**
+     * Same as csvToIno(basis), for the DAC channel (0 = A, 1 = B) the basis
+     *   is played on
+     * @param basis
+     * @param dacChannel
+     * @return
+     */
+    public String csvToIno(double basis[][], int dacChannel) {
+        return csvToIno(java.util.Collections.singletonList(basis), dacChannel);
+    }
+
+    /**
+     * Exports a bank of bases, all stored in the flash of the Arduino and
+     *   selected at runtime (commands 35 and 36 of the firmware)
+     * The values of each basis are stored in the smallest encoding that keeps
+     *   them exactly (see basisEncoding)
+     * The values are exported as TLV5618 words (see dacCodes), so that the
+     *   firmware copies them to the DAC as they are
+     * @param bases
+     * @param dacChannel
+     * @return
+     */
+    public String csvToIno(java.util.List<double[][]> bases, int dacChannel) {
         // Declarations
         String vec;
-        int hash;
+        String bank = "";
+        String addresses = "";
+        int control = dacControl(dacChannel);
         
-        // Hash
-        hash = basistools.hashBasis(basis);
         vec = "#include <avr/pgmspace.h>\n";
-        vec += "char basis_id[] = \"" + hash + "\";\n";
-        vec += "int b_nelements; // Basis size, will be populated at runtime\n" +
+        vec += "int b_nelements; // Size of the selected basis, will be populated at runtime\n" +
                 "int b_nvalues;\n" +
                 "\n" +
                 "// The measurement matrix do not fit in the RAM of the Arduino. However, it fits in SRAM (non-volatile).\n" +
@@ -96,29 +123,211 @@ public class ArduinoLibs {
                 "// In terms of speed, PROGMEM is slower than direct RAM access. According to: http://forum.arduino.cc/index.php?topic=134782.0\n" +
                 "// it takes three clock cycles to run instead of two, a time difference of ~62 ns. Acceptable.\n" +
                 "// Note that PROGMEM seems not to support float types.\n" +
-                "// Furthermore, the values are scaled so that there is no computation to perform before writing to the analog output.\n";
+                "// Furthermore, the values are scaled so that there is no computation to perform before writing to the analog output.\n" +
+                "// Each basis_k holds the rows of a basis one after the other, its BasisEntry in basis_bank gives\n" +
+                "// the number of bits per value: 1 (bit i of a row in bit i%8 of byte i/8 of the row, set bits\n" +
+                "// are the DAC word high), 8 (values shifted right by shift) or 16 (complete TLV5618 words).\n" +
+                "// Zero bits and 8-bit values get the control bits of the DAC words added.\n";
+        vec += "#define BASIS_BANK " + bases.size() + "\n";
         
-        vec += "const PROGMEM int16_t basis["+basis.length+"]["+basis[0].length+"] = {{";
-        for (int j=0; j<basis.length; j++){
-            for (int i=0; i<basis[0].length; i++){
-                vec += basis[j][i];
-                if (i+1 != basis[0].length){
-                    vec += ',';
+        for (int k=0; k<bases.size(); k++) {
+            double[][] basis = bases.get(k);
+            // Hash of the basis as loaded by the host
+            int hash = basistools.hashBasis(basis);
+            basis = dacCodes(basis);
+            int encoding = basisEncoding(basis);
+            int rows = basis.length;
+            int values = basis[0].length;
+            int shift = 0;
+            int high = control;
+            
+            if (encoding == 1) {
+                int bytes = (values + 7) / 8;
+                high = control | (int) basisMax(basis);
+                vec += "const PROGMEM uint8_t basis_"+k+"["+(rows*bytes)+"] = {";
+                for (int j=0; j<rows; j++){
+                    for (int b=0; b<bytes; b++){
+                        int packed = 0;
+                        for (int i=8*b; i<Math.min(values, 8*b+8); i++){
+                            if (basis[j][i] != 0) {
+                                packed |= 1 << (i % 8);
+                            }
+                        }
+                        vec += packed;
+                        if (b+1 != bytes){
+                            vec += ',';
+                        }
+                    }
+                    if (j+1 != rows) {
+                        vec = vec + ",\n";
+                    }
+                }
+            } else {
+                if (encoding == 8) {
+                    shift = basisShift(basis);
+                    vec += "const PROGMEM uint8_t basis_"+k+"["+(rows*values)+"] = {";
+                } else {
+                    vec += "const PROGMEM uint16_t basis_"+k+"["+(rows*values)+"] = {";
+                }
+                for (int j=0; j<rows; j++){
+                    for (int i=0; i<values; i++){
+                        // integer literals, doubles do not narrow to uint16_t
+                        if (encoding == 8) {
+                            vec += Math.round(basis[j][i]) >> shift;
+                        } else {
+                            vec += control | Math.round(basis[j][i]);
+                        }
+                        if (i+1 != values){
+                            vec += ',';
+                        }
+                    }
+                    if (j+1 != rows) {
+                        vec = vec + ",\n";
+                    }
                 }
             }
-            if (j+1 != basis.length) {
-                vec = vec + "},\n{";
+            vec += "};\n";
+            bank += "  {"+rows+", "+values+", "+encoding+", "+shift+", "+high+", "+control+", "+hash+"L}";
+            addresses += "    case "+k+": return BASIS_ADDRESS(basis_"+k+");\n";
+            if (k+1 != bases.size()) {
+                bank += ",";
             }
+            bank += "\n";
+            System.out.println("Converting to CSV. Hash value is: " + hash);
         }
-        vec += "}};\n";
-        vec += "// Compute the size of the basis\n\n" +
-                "int init_basis(int &b_nelements, int &b_nvalues) {\n" +
-                "   b_nvalues = sizeof(basis[0])/sizeof(basis[0][0]);\n" +
-                "   b_nelements = sizeof(basis)/b_nvalues/sizeof(basis[0][0]);\n" +
-                "  return 1;\n" +
-                "}\n\n";
+        vec += "// Bases of the bank: rows, values per row, bits per value, shift, high, control, hashCode\n";
+        vec += "const PROGMEM BasisEntry basis_bank[BASIS_BANK] = {\n" + bank + "};\n";
+        // far addresses (above 64 KB of flash) are only known at run time
+        vec += "BasisAddress basis_address(byte index) {\n  switch (index) {\n" + addresses +
+                "  }\n  return 0;\n}\n\n";
         
-	System.out.println("Converting to CSV. Hash value is: " + hash);
 	return(vec);
     }
+
+    /**
+     * Number of bits per value needed to store the basis exactly:
+     *   1 when every value is either 0 or the same maximum (binary patterns),
+     *   8 when the values are non-negative integers that fit in a byte once
+     *   shifted right by basisShift, 16 otherwise
+     * @param basis
+     * @return
+     */
+    public int basisEncoding(double basis[][]) {
+        double high = basisMax(basis);
+        boolean binary = high > 0;
+        for (double[] row : basis) {
+            for (double value : row) {
+                if (value != 0 && value != high) {
+                    binary = false;
+                }
+            }
+        }
+        if (binary && high == Math.rint(high) && high <= 32767) {
+            return 1;
+        }
+        if (basisShift(basis) >= 0) {
+            return 8;
+        }
+        return 16;
+    }
+
+    /**
+     * Smallest right shift that brings every value of the basis into a byte
+     *   without losing bits, -1 if there is none
+     * @param basis
+     * @return
+     */
+    public int basisShift(double basis[][]) {
+        for (int shift=0; shift<8; shift++) {
+            boolean fits = true;
+            for (double[] row : basis) {
+                for (double value : row) {
+                    if (value < 0 || value != Math.rint(value)) {
+                        return -1;
+                    }
+                    long v = Math.round(value);
+                    if ((v & ((1 << shift) - 1)) != 0) {
+                        return -1;
+                    }
+                    if ((v >> shift) > 255) {
+                        fits = false;
+                    }
+                }
+            }
+            if (fits) {
+                return shift;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * First element of each of the boards sharing a basis of n elements,
+     *   as even as possible, followed by n
+     * @param elements
+     * @param boards
+     * @return
+     */
+    public int[] splitOffsets(int elements, int boards) {
+        int[] offsets = new int[boards + 1];
+        for (int k=0; k<=boards; k++) {
+            offsets[k] = (int) ((long) elements * k / boards);
+        }
+        return offsets;
+    }
+
+    /**
+     * Elements offsets[k] to offsets[k+1]-1 of every row of the basis,
+     *   the part played by board k
+     * @param basis
+     * @param offsets
+     * @param k
+     * @return
+     */
+    public double[][] sliceBasis(double basis[][], int[] offsets, int k) {
+        double[][] slice = new double[basis.length][];
+        for (int j=0; j<basis.length; j++) {
+            slice[j] = java.util.Arrays.copyOfRange(basis[j], offsets[k], offsets[k+1]);
+        }
+        return slice;
+    }
+
+    /**
+     * Basis quantized to the 12-bit codes of the TLV5618 DAC: values are
+     *   rounded and clamped to 0-4095, as the firmware would otherwise
+     *   truncate them when writing to the DAC
+     * @param basis
+     * @return
+     */
+    public double[][] dacCodes(double basis[][]) {
+        double[][] codes = new double[basis.length][];
+        for (int j=0; j<basis.length; j++) {
+            codes[j] = new double[basis[j].length];
+            for (int i=0; i<basis[j].length; i++) {
+                codes[j][i] = Math.min(DAC_MAX, Math.max(0, Math.round(basis[j][i])));
+            }
+        }
+        return codes;
+    }
+
+    /**
+     * Control bits of the TLV5618 words for a DAC channel: channel A
+     *   (0) writes DAC A, any other channel writes DAC B and the buffer,
+     *   as analogueOut in the firmware does
+     * @param dacChannel
+     * @return
+     */
+    public int dacControl(int dacChannel) {
+        return dacChannel == 0 ? 0x8000 : 0x0000;
+    }
+
+    private double basisMax(double basis[][]) {
+        double high = basis[0][0];
+        for (double[] row : basis) {
+            for (double value : row) {
+                high = Math.max(high, value);
+            }
+        }
+        return high;
+    }
 }
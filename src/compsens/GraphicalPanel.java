@@ -318,8 +318,29 @@ public class GraphicalPanel extends javax.swing.JFrame {
         String ino_content;
         int returnVal;
         
-        // Get content
-        ino_content = arduinolibs.csvToIno(params.basis);
+        // Other bases stored in the same firmware, selected at runtime (CSBasis)
+        java.util.List<double[][]> bases = new java.util.ArrayList<double[][]>();
+        bases.add(params.basis);
+        fc = new javax.swing.JFileChooser();
+        fc.setDialogTitle("Other bases to store on the Arduino (optional)");
+        fc.setMultiSelectionEnabled(true);
+        fc.addChoosableFileFilter(new javax.swing.filechooser.FileNameExtensionFilter("CSV files", "csv"));
+        returnVal = fc.showOpenDialog(GraphicalPanel.this);
+        if (returnVal == javax.swing.JFileChooser.APPROVE_OPTION) {
+            for (java.io.File file : fc.getSelectedFiles()) {
+                bases.add(basistools.readBasis(file.getPath()));
+            }
+        }
+        
+        // Boards sharing the basis (hub property CSGroup), each gets a slice of the elements
+        int boards = 1;
+        String answer = javax.swing.JOptionPane.showInputDialog(this, "Number of Arduino boards playing the basis together", "1");
+        try {
+            boards = Math.max(1, Integer.parseInt(answer.trim()));
+        } catch (Exception e) {
+            boards = 1;
+        }
+        int[] offsets = arduinolibs.splitOffsets(params.basis[0].length, boards);
         
         // Know where to save
         fc = new javax.swing.JFileChooser();
@@ -328,18 +349,36 @@ public class GraphicalPanel extends javax.swing.JFrame {
         if (returnVal == javax.swing.JFileChooser.APPROVE_OPTION) {
             java.io.File file = fc.getSelectedFile(); 
             
-            // Saving
-            System.out.println("Saving to " + file.getPath());
+            for (int k=0; k<boards; k++) {
+                java.io.File boardFile = file;
+                java.util.List<double[][]> slices = new java.util.ArrayList<double[][]>();
+                for (double[][] basis : bases) {
+                    slices.add(arduinolibs.sliceBasis(basis, arduinolibs.splitOffsets(basis[0].length, boards), k));
+                }
+                // Get content
+                ino_content = arduinolibs.csvToIno(slices, 0);
+                if (boards > 1) {
+                    String name = file.getName();
+                    int dot = name.lastIndexOf('.');
+                    name = dot < 0 ? name + "_board" + k : name.substring(0, dot) + "_board" + k + name.substring(dot);
+                    boardFile = new java.io.File(file.getParentFile(), name);
+                    ino_content = "// Board " + k + " of " + boards + ": elements " + offsets[k] + " to " + (offsets[k+1]-1) +
+                            " of the basis, set its CSGroupOffset to " + offsets[k] + "\n" + ino_content;
+                }
+                
+                // Saving
+                System.out.println("Saving to " + boardFile.getPath());
 
-            java.io.PrintWriter writer = null;
-            try  {
-                writer = new java.io.PrintWriter(file);
-                writer.print(ino_content);
-            } catch (FileNotFoundException e) {
-                e.printStackTrace();
-            } finally {
-                if ( writer != null ) {
-                    writer.close();
+                java.io.PrintWriter writer = null;
+                try  {
+                    writer = new java.io.PrintWriter(boardFile);
+                    writer.print(ino_content);
+                } catch (FileNotFoundException e) {
+                    e.printStackTrace();
+                } finally {
+                    if ( writer != null ) {
+                        writer.close();
+                    }
                 }
             }
         } else {